@@ -0,0 +1,614 @@
+// -----------------------------------------------------------------------------
+// Splice File Organizer benchmark
+// -----------------------------------------------------------------------------
+// Description:
+// Generates a synthetic sample library laid out like a Splice Samples folder
+// and times each stage of the organizer against it separately:
+//
+// - generate:  writing the synthetic tree (not part of the organizer)
+// - enumerate: walking the source tree
+// - classify:  matching every filename against the category rules
+// - collide:   claiming destination names, including indexed renames
+// - plan:      a full --plan run, which makes every decision but moves nothing
+// - transfer:  a full run into an empty destination
+// - rerun:     a second run, which the index turns into a no-op
+//
+// Each stage reports files per second, and MB per second where it touches file
+// contents. Every run appends one line to a results file so runs can be
+// compared over time.
+//
+// Usage:
+//   splice_bench [--files N] [--packs N] [--depth N] [--size BYTES]
+//                [--duplicates PERCENT] [--seed N] [--dir PATH]
+//                [--results PATH] [--label TEXT] [--rules PATH]
+//                [--workers N] [--mode MODE] [--dedup MODE] [--classify]
+//                [--check-headers] [--tempo-folders] [--copy-chunk MIB]
+//                [--order ORDER] [--pipeline] [--keep]
+//
+// The working folder (default "splice_bench_tree") is deleted and recreated on
+// every run and removed afterwards unless --keep is given.
+//
+// License: MIT, see splice_file_organizer.cpp.
+// -----------------------------------------------------------------------------
+// The stages time internals the library does not export, so the library is
+// compiled into the benchmark rather than linked
+#include "splice_organizer.cpp"
+
+#include <cctype>
+#include <ctime>
+#include <iomanip>
+#include <random>
+
+namespace splice_organizer {
+
+struct BenchOptions {
+  std::size_t files = 2000;
+  std::size_t packs = 40;
+  std::size_t depth = 2;             // Folder levels inside each pack
+  std::uint64_t size = 16 * 1024;    // Mean one-shot size; loops are 4x
+  unsigned duplicates = 5;           // Percent of files copied to other packs
+  std::uint64_t seed = 1;
+  fs::path dir = "splice_bench_tree";
+  fs::path results = "splice_bench_results.tsv";
+  std::string label = "default";
+  std::string rules_file;
+  bool keep = false;
+  OrganizeOptions organize;
+};
+
+constexpr const char* kBenchUsage = R"(Usage: splice_bench [options]
+
+Tree:
+  --files N              Number of samples to generate (default 2000)
+  --packs N              Number of sample packs (default 40)
+  --depth N              Folder levels inside each pack (default 2)
+  --size BYTES           Mean one-shot size; loops are 4x (default 16384)
+  --duplicates PERCENT   Samples copied verbatim into other packs (default 5)
+  --seed N               Random seed; equal seeds give equal trees (default 1)
+  --dir PATH             Working folder (default splice_bench_tree)
+  --keep                 Leave the working folder in place
+
+Organizer:
+  --rules PATH           Rules file (default built-in rules)
+  --workers N            Worker threads (default: one per core)
+  --mode MODE            copy, move, hardlink or reflink (default copy)
+  --dedup MODE           keep, skip or link (default keep)
+  --order ORDER          listing, disk or folder (default listing)
+  --classify             Sort keyword-less files by their audio content
+  --check-headers        Skip files with broken audio headers
+  --tempo-folders        Sort loops into "<n>bpm" folders
+  --copy-chunk MIB       MiB moved per copy call (default: by file size)
+  --pipeline             Copy through the reader/writer pipeline
+
+Results:
+  --results PATH         File the results are appended to
+                         (default splice_bench_results.tsv)
+  --label TEXT           Label stored with the results (default "default")
+)";
+
+// Parse the benchmark command line. Throws std::runtime_error on usage errors,
+// returns false when only the usage was asked for.
+bool parse_bench_command_line(int argc, char* argv[], BenchOptions& bench) {
+  OrganizeOptions& options = bench.organize;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view argument = argv[i];
+    auto value = [&]() -> std::string_view {
+      if (i + 1 >= argc) {
+        throw std::runtime_error(std::string(argument) + " needs a value");
+      }
+      return argv[++i];
+    };
+    auto number = [&](auto& out) {
+      std::string_view text = value();
+      const char* end = text.data() + text.size();
+      auto result = std::from_chars(text.data(), end, out);
+      if (result.ec != std::errc() || result.ptr != end) {
+        throw std::runtime_error("invalid value \"" + std::string(text) +
+                                 "\" for " + std::string(argument));
+      }
+    };
+
+    if (argument == "--files") {
+      number(bench.files);
+    } else if (argument == "--packs") {
+      number(bench.packs);
+      if (bench.packs == 0) throw std::runtime_error("--packs must be > 0");
+    } else if (argument == "--depth") {
+      number(bench.depth);
+    } else if (argument == "--size") {
+      number(bench.size);
+    } else if (argument == "--duplicates") {
+      number(bench.duplicates);
+      bench.duplicates = std::min(bench.duplicates, 100u);
+    } else if (argument == "--seed") {
+      number(bench.seed);
+    } else if (argument == "--dir") {
+      bench.dir = value();
+    } else if (argument == "--results") {
+      bench.results = value();
+    } else if (argument == "--label") {
+      bench.label = value();
+    } else if (argument == "--rules") {
+      bench.rules_file = value();
+    } else if (argument == "--keep") {
+      bench.keep = true;
+    } else if (argument == "--workers") {
+      number(options.worker_count);
+    } else if (argument == "--mode") {
+      std::string_view text = value();
+      auto mode = find_name(kTransferModeNames, text);
+      if (!mode) throw std::runtime_error("unknown mode " + std::string(text));
+      options.transfer_mode = static_cast<TransferMode>(*mode);
+    } else if (argument == "--dedup") {
+      std::string_view text = value();
+      auto dedup = find_name(kDedupModeNames, text);
+      if (!dedup) {
+        throw std::runtime_error("unknown dedup " + std::string(text));
+      }
+      options.dedup = static_cast<DedupMode>(*dedup);
+    } else if (argument == "--order") {
+      std::string_view text = value();
+      auto order = find_name(kWorkOrderNames, text);
+      if (!order) {
+        throw std::runtime_error("unknown order " + std::string(text));
+      }
+      options.work_order = static_cast<WorkOrder>(*order);
+    } else if (argument == "--classify") {
+      options.classify_content = true;
+    } else if (argument == "--check-headers") {
+      options.check_headers = true;
+    } else if (argument == "--tempo-folders") {
+      options.tempo_folders = true;
+    } else if (argument == "--copy-chunk") {
+      number(options.copy_chunk_size);
+      options.copy_chunk_size <<= 20;
+    } else if (argument == "--pipeline") {
+      bench.organize.pipeline = true;
+    } else if (argument == "--help" || argument == "-h") {
+      return false;
+    } else {
+      throw std::runtime_error("unknown option " + std::string(argument));
+    }
+  }
+  return true;
+}
+
+// Word lists for Splice-like pack and sample names. Instruments carry the
+// keywords of the built-in rules; the plain words match none of them.
+constexpr std::array<const char*, 24> kLabelWords = {
+    "Sonic",  "Black",  "Octave",  "Loop",   "Grid",  "Prime",
+    "Vapor",  "Static", "Golden",  "Neon",   "Lunar", "Cosmic",
+    "Urban",  "Vintage", "Analog", "Pulse",  "Echo",  "Crystal",
+    "Velvet", "Iron",   "Silver",  "Wild",   "Rogue", "Zenith"};
+constexpr std::array<const char*, 16> kGenreWords = {
+    "Trap",   "House",  "Lo-Fi",   "Techno", "Drill",     "Boom Bap",
+    "R&B",    "Future", "Afro",    "Garage", "Ambient",   "Disco",
+    "Phonk",  "Soul",   "Cinematic", "Reggaeton"};
+constexpr std::array<const char*, 22> kOneShotWords = {
+    "Kick",   "Snare",  "Clap",    "Hat",    "Open_Hat",  "Closed_Hat",
+    "Rim",    "808",    "Perc",    "Shaker", "Tom",       "Crash",
+    "Ride",   "Snap",   "Impact",  "Riser",  "Vox",       "Chop",
+    "Bass",   "Pluck",  "Stab",    "Cowbell"};
+constexpr std::array<const char*, 14> kLoopWords = {
+    "Drum_Loop", "Top_Loop", "Perc_Loop", "Bass_Loop", "Synth_Loop",
+    "Keys",      "Piano",    "Guitar",    "Pad",       "Lead",
+    "Vocal",     "Arp",      "Chord",     "Strings"};
+constexpr std::array<const char*, 16> kPlainWords = {
+    "Texture", "Dusty",  "Glass",   "Warm",     "Dark",  "Bright",
+    "Vinyl",   "Tape",   "Shimmer", "Deep",     "Gritty", "Soft",
+    "Wide",    "Hollow", "Metallic", "Grainy"};
+constexpr std::array<const char*, 12> kKeys = {
+    "C", "C#", "D", "Eb", "E", "F", "F#", "G", "Ab", "A", "Bb", "B"};
+constexpr std::array<const char*, 6> kOneShotFolders = {
+    "Drum_One_Shots", "One_Shots", "FX", "Vocals", "Bass", "Misc"};
+constexpr std::array<const char*, 6> kLoopFolders = {
+    "Drum_Loops", "Music_Loops", "Melodic", "Tops", "Stems", "Construction"};
+
+struct GeneratedTree {
+  std::size_t files = 0;
+  std::uint64_t bytes = 0;
+};
+
+template <typename T, std::size_t N>
+const T& pick(std::mt19937_64& random, const std::array<T, N>& words) {
+  return words[random() % N];
+}
+
+// Write a 16-bit mono 44.1 kHz WAV of the given size filled with noise
+void write_wav(const fs::path& path, std::uint64_t size,
+               std::mt19937_64& random) {
+  constexpr std::uint32_t kHeaderSize = 44;
+  size = std::max<std::uint64_t>(size, kHeaderSize + 2) & ~std::uint64_t{1};
+  std::vector<unsigned char> data(size);
+  auto put16 = [&](std::size_t at, std::uint16_t v) {
+    data[at] = static_cast<unsigned char>(v);
+    data[at + 1] = static_cast<unsigned char>(v >> 8);
+  };
+  auto put32 = [&](std::size_t at, std::uint32_t v) {
+    put16(at, static_cast<std::uint16_t>(v));
+    put16(at + 2, static_cast<std::uint16_t>(v >> 16));
+  };
+  std::memcpy(&data[0], "RIFF", 4);
+  put32(4, static_cast<std::uint32_t>(size - 8));
+  std::memcpy(&data[8], "WAVEfmt ", 8);
+  put32(16, 16);
+  put16(20, 1);       // PCM
+  put16(22, 1);       // Mono
+  put32(24, 44100);
+  put32(28, 44100 * 2);
+  put16(32, 2);
+  put16(34, 16);
+  std::memcpy(&data[36], "data", 4);
+  put32(40, static_cast<std::uint32_t>(size - kHeaderSize));
+  for (std::size_t at = kHeaderSize; at + 8 <= size; at += 8) {
+    std::uint64_t noise = random();
+    std::memcpy(&data[at], &noise, 8);
+  }
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char*>(data.data()),
+            static_cast<std::streamsize>(data.size()));
+  if (!out) {
+    throw fs::filesystem_error("cannot write sample", path,
+                               std::make_error_code(std::errc::io_error));
+  }
+}
+
+// Generate the synthetic library. About a third of the samples are loops
+// named "<pack>_<bpm>_<key>_<what>_<nn>", a quarter carry no rule keyword at
+// all, and the rest are one-shots; the short numbered names collide across
+// packs the way real libraries do.
+GeneratedTree generate_tree(const BenchOptions& bench, const fs::path& root) {
+  std::mt19937_64 random(bench.seed);
+  struct Pack {
+    fs::path dir;
+    std::string prefix;
+  };
+  std::vector<Pack> packs;
+  for (std::size_t i = 0; i < bench.packs; ++i) {
+    std::string label = pick(random, kLabelWords);
+    label += ' ';
+    label += pick(random, kLabelWords);
+    std::string genre = pick(random, kGenreWords);
+    std::string prefix;
+    for (char c : label) {
+      if (std::isupper(static_cast<unsigned char>(c))) prefix += c;
+    }
+    prefix += '_';
+    prefix += static_cast<char>(std::toupper(genre[0]));
+    prefix += std::to_string(i % 10);
+    packs.push_back({root / (label + " - " + genre + " Vol " +
+                             std::to_string(i + 1)),
+                     prefix});
+  }
+
+  GeneratedTree tree;
+  std::vector<std::pair<fs::path, fs::path>> written;
+  for (std::size_t i = 0; i < bench.files; ++i) {
+    const Pack& pack = packs[random() % packs.size()];
+    unsigned kind = random() % 12;
+    bool loop = kind < 4;
+    std::string name = pack.prefix;
+    name += '_';
+    if (loop) {
+      name += std::to_string(70 + random() % 110);
+      name += '_';
+      name += pick(random, kKeys);
+      if (random() % 2) name += 'm';
+      name += '_';
+      name += pick(random, kLoopWords);
+    } else if (kind < 7) {
+      name += pick(random, kPlainWords);
+      name += '_';
+      name += pick(random, kPlainWords);
+    } else {
+      name += pick(random, kOneShotWords);
+      if (random() % 2) {
+        name += '_';
+        name += pick(random, kPlainWords);
+      }
+    }
+    name += '_';
+    std::size_t number = 1 + random() % 20;
+    if (number < 10) name += '0';
+    name += std::to_string(number);
+    name += random() % 10 == 0 ? ".mp3" : ".wav";
+
+    fs::path dir = pack.dir;
+    for (std::size_t level = 0; level < bench.depth; ++level) {
+      dir /= level == 0 ? (loop ? pick(random, kLoopFolders)
+                                : pick(random, kOneShotFolders))
+                        : pick(random, kPlainWords);
+    }
+    fs::create_directories(dir);
+    fs::path path = dir / name;
+    if (fs::exists(path)) continue;  // Same pack drew the same name twice
+
+    // Spread sizes from a quarter to twice the mean
+    std::uint64_t mean = loop ? bench.size * 4 : bench.size;
+    std::uint64_t size = mean / 4 + random() % (mean * 7 / 4 + 1);
+    if (!written.empty() && random() % 100 < bench.duplicates) {
+      // A verbatim copy of an earlier sample under its original name
+      const auto& [original, original_name] =
+          written[random() % written.size()];
+      path = dir / original_name;
+      if (fs::exists(path)) continue;
+      fs::copy_file(original, path);
+      size = fs::file_size(path);
+    } else {
+      write_wav(path, size, random);
+      written.emplace_back(path, path.filename());
+    }
+    ++tree.files;
+    tree.bytes += size;
+  }
+  return tree;
+}
+
+struct StageResult {
+  const char* name;
+  double seconds = 0;
+  std::size_t files = 0;
+  std::uint64_t bytes = 0;  // 0 when the stage does not read file contents
+  bool skipped = false;
+};
+
+// Times matching filenames against the built-in rules the way the
+// organizer does, folding into a reused buffer for one automaton pass, and
+// the way it first did, with a std::tolower copy of each name and a find for
+// each keyword in priority order. Prints the cost per name of both.
+void compare_matching(const std::vector<SourceFile>& files) {
+  constexpr int kRounds = 20;
+  std::vector<std::string> names;
+  names.reserve(files.size());
+  for (const auto& file : files) {
+    names.push_back(file.path.filename().string());
+  }
+  if (names.empty()) return;
+
+  auto nanoseconds_per_name = [&](auto&& match, std::vector<std::size_t>& out) {
+    out.assign(names.size(), 0);
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < kRounds; ++round) {
+      for (std::size_t i = 0; i < names.size(); ++i) out[i] = match(names[i]);
+    }
+    return std::chrono::duration<double, std::nano>(
+               std::chrono::steady_clock::now() - start)
+               .count() /
+           (static_cast<double>(names.size()) * kRounds);
+  };
+
+  std::vector<std::size_t> find_categories;
+  double find_cost = nanoseconds_per_name(
+      [](const std::string& name) {
+        std::string lower = name;
+        std::transform(lower.begin(), lower.end(), lower.begin(),
+                       [](unsigned char c) {
+                         return static_cast<char>(std::tolower(c));
+                       });
+        for (std::size_t i = 0; i + 1 < kBuiltInCategories.size(); ++i) {
+          bool found = false;
+          for_each_keyword(kBuiltInCategories[i].keywords,
+                           [&](std::string_view keyword) {
+                             found = found ||
+                                     lower.find(keyword) != std::string::npos;
+                           });
+          if (found) return i;
+        }
+        return kBuiltInCategories.size() - 1;
+      },
+      find_categories);
+
+  CompiledRules rules = built_in_rules();
+  std::string lower;
+  std::vector<std::size_t> match_categories;
+  double match_cost = nanoseconds_per_name(
+      [&](const std::string& name) {
+        lower.clear();
+        append_lower(lower, name);
+        return rules.classify(lower);
+      },
+      match_categories);
+
+  std::cout << std::fixed << std::setprecision(1) << "Matching a name: "
+            << find_cost << " ns with to_lower and find, " << match_cost
+            << " ns folded and matched (" << find_cost / match_cost
+            << "x).\n"
+            << std::defaultfloat;
+  if (find_categories != match_categories) {
+    std::cout << "Warning: the two ways classified names differently.\n";
+  }
+}
+
+// Run a stage and time it
+template <typename Function>
+StageResult time_stage(const char* name, Function&& function) {
+  StageResult result{name};
+  auto start = std::chrono::steady_clock::now();
+  function(result);
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  return result;
+}
+
+// Print the results as a table
+void print_results(const std::vector<StageResult>& stages) {
+  std::cout << "\n"
+            << std::left << std::setw(10) << "stage" << std::right
+            << std::setw(10) << "files" << std::setw(12) << "seconds"
+            << std::setw(14) << "files/s" << std::setw(12) << "MB/s" << "\n";
+  for (const auto& stage : stages) {
+    std::cout << std::left << std::setw(10) << stage.name << std::right;
+    if (stage.skipped) {
+      std::cout << std::setw(10) << "-" << std::setw(12) << "skipped\n";
+      continue;
+    }
+    double seconds = std::max(stage.seconds, 1e-9);
+    std::cout << std::setw(10) << stage.files << std::fixed
+              << std::setprecision(4) << std::setw(12) << stage.seconds
+              << std::setprecision(0) << std::setw(14)
+              << stage.files / seconds;
+    if (stage.bytes != 0) {
+      std::cout << std::setprecision(1) << std::setw(12)
+                << stage.bytes / 1e6 / seconds;
+    } else {
+      std::cout << std::setw(12) << "-";
+    }
+    std::cout << std::defaultfloat << "\n";
+  }
+}
+
+// Append one line per run to the results file, writing the header first if
+// the file is new
+void save_results(const BenchOptions& bench, const GeneratedTree& tree,
+                  const std::vector<StageResult>& stages) {
+  bool is_new = !fs::exists(bench.results);
+  std::ofstream out(bench.results, std::ios::app);
+  if (is_new) {
+    out << "time\tlabel\tfiles\tbytes\tpacks\tdepth\tworkers\tmode\tdedup\t"
+           "classify\tcheck_headers\ttempo_folders";
+    for (const auto& stage : stages) out << "\t" << stage.name << "_seconds";
+    out << "\n";
+  }
+
+  std::time_t now = std::time(nullptr);
+  std::tm utc{};
+#ifdef _WIN32
+  gmtime_s(&utc, &now);
+#else
+  gmtime_r(&now, &utc);
+#endif
+  const OrganizeOptions& options = bench.organize;
+  out << std::put_time(&utc, "%Y-%m-%dT%H:%M:%SZ") << "\t" << bench.label
+      << "\t" << tree.files << "\t" << tree.bytes << "\t" << bench.packs
+      << "\t" << bench.depth << "\t" << resolved_worker_count(options) << "\t"
+      << kTransferModeNames[static_cast<int>(options.transfer_mode)] << "\t"
+      << kDedupModeNames[static_cast<int>(options.dedup)] << "\t"
+      << options.classify_content << "\t" << options.check_headers << "\t"
+      << options.tempo_folders;
+  for (const auto& stage : stages) {
+    out << "\t";
+    if (!stage.skipped) out << stage.seconds;
+  }
+  out << "\n";
+  if (!out) {
+    throw fs::filesystem_error("cannot write results", bench.results,
+                               std::make_error_code(std::errc::io_error));
+  }
+}
+
+int run_bench(int argc, char* argv[]) {
+  BenchOptions bench;
+  try {
+    if (!parse_bench_command_line(argc, argv, bench)) {
+      std::cout << kBenchUsage;
+      return 0;
+    }
+  } catch (const std::runtime_error& e) {
+    std::cerr << "Error: " << e.what() << "\n\n" << kBenchUsage;
+    return 1;
+  }
+
+  try {
+    CompiledRules rules = bench.rules_file.empty()
+                              ? built_in_rules()
+                              : load_rules(bench.rules_file);
+    const fs::path source = bench.dir / "source";
+    const fs::path destination = bench.dir / "destination";
+    fs::remove_all(bench.dir);
+
+    GeneratedTree tree;
+    std::vector<StageResult> stages;
+    stages.push_back(time_stage("generate", [&](StageResult& stage) {
+      tree = generate_tree(bench, source);
+      stage.files = tree.files;
+      stage.bytes = tree.bytes;
+    }));
+    std::cout << "Generated " << tree.files << " samples ("
+              << tree.bytes / 1000000 << " MB) in " << source.string()
+              << ".\n";
+
+    std::vector<SourceFile> files;
+    stages.push_back(time_stage("enumerate", [&](StageResult& stage) {
+      walk_directory(source,
+                     [&](SourceFile&& file) { files.push_back(file); });
+      stage.files = files.size();
+    }));
+
+    std::vector<std::size_t> categories(files.size());
+    stages.push_back(time_stage("classify", [&](StageResult& stage) {
+      std::string lower_name;
+      for (std::size_t i = 0; i < files.size(); ++i) {
+        lower_name.clear();
+        append_utf8(lower_name, filename_view(files[i].path), true);
+        categories[i] = rules.classify(lower_name);
+      }
+      stage.files = files.size();
+    }));
+    compare_matching(files);
+
+    // Claims against a destination that does not exist yet, so the stage
+    // measures only the name bookkeeping
+    std::size_t collisions = 0;
+    stages.push_back(time_stage("collide", [&](StageResult& stage) {
+      DestinationModel model(destination, rules.category_paths);
+      std::string lower_name;
+      for (std::size_t i = 0; i < files.size(); ++i) {
+        FolderNames& folder = model.category_folder(categories[i]);
+        lower_name.clear();
+        append_utf8(lower_name, filename_view(files[i].path), true);
+        if (!folder.claim(lower_name)) {
+          folder.claim_indexed(files[i].path.filename());
+          ++collisions;
+        }
+      }
+      stage.files = files.size();
+    }));
+    std::cout << collisions << " name collisions.\n";
+
+    stages.push_back(time_stage("plan", [&](StageResult& stage) {
+      MovePlan plan;
+      JobRunner runner(rules, bench.organize);
+      runner.run({source, destination}, &plan);
+      runner.finish();
+      stage.files = plan.size();
+    }));
+
+    stages.push_back(time_stage("transfer", [&](StageResult& stage) {
+      JobRunner runner(rules, bench.organize);
+      runner.run({source, destination});
+      runner.finish();
+      stage.files = tree.files;
+      stage.bytes = tree.bytes;
+    }));
+
+    // A moved tree is gone, so there is nothing left to skip
+    bool moved = bench.organize.transfer_mode == TransferMode::kMove;
+    stages.push_back(time_stage("rerun", [&](StageResult& stage) {
+      if (moved || !bench.organize.use_index) {
+        stage.skipped = true;
+        return;
+      }
+      JobRunner runner(rules, bench.organize);
+      runner.run({source, destination});
+      runner.finish();
+      stage.files = tree.files;
+    }));
+
+    print_results(stages);
+    save_results(bench, tree, stages);
+    std::cout << "\nResults appended to " << bench.results.string() << ".\n";
+    if (!bench.keep) fs::remove_all(bench.dir);
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace splice_organizer
+
+int main(int argc, char* argv[]) {
+  return splice_organizer::run_bench(argc, argv);
+}
@@ -21,10 +21,190 @@
 //   - Loop: Files containing "loop" in the filename
 //   - Other: Files that don't match any of the above criteria
 //
+// These are the built-in rules. When a "splice_rules.txt" file is present in
+// the working directory, its categories, keywords and priorities are used
+// instead (see the bundled splice_rules.txt for the format). The rules are
+// compiled into a single matcher and cached next to the file as
+// "splice_rules.txt.bin", so later runs skip parsing and compilation. The
+// built-in rules are compiled with the program itself, so a run without a rules
+// file has nothing to parse, build or load. Keywords match regardless of case:
+// names are folded to lowercase 16 or 32 bytes at a time (SSE2, AVX2 or NEON)
+// and only ASCII letters are folded, so UTF-8 names from international packs
+// match the same whatever the locale.
+//
 // The program prompts the user for the source and destination folder names and
 // organizes the files accordingly. It also provides an option to print detailed
 // information about each file move.
 //
+// Files are copied by a pool of worker threads fed from a bounded queue while
+// the source tree is walked, so large libraries keep the disk busy. The number
+// of workers defaults to the number of hardware threads.
+//
+// Files are copied by default. When the source and destination are on the
+// same volume they can instead be moved (renamed), hard linked, or cloned
+// (reflink on Btrfs/XFS, clonefile on APFS, block cloning on ReFS), which only
+// updates metadata. Each of these falls back to a copy when it is not
+// supported for a file.
+//
+// Each run records where every sample was placed in a ".splice_index" file in
+// the destination folder. Later runs skip samples whose size and modification
+// time have not changed, and replace changed ones at their recorded location,
+// so re-running after new downloads only touches the new files.
+//
+// With "--catalog" the organizer also keeps a ".splice_catalog" file in the
+// destination: every sample with its folder, name, size, duration and a hash
+// of its lowercased name, sorted by folder and name, with a second table
+// sorted by name hash. Browsers and other tools can map it and list or search
+// a folder of 90,000 samples in milliseconds instead of listing it. Each run
+// merges the samples it placed into the catalog, so once started it stays up
+// to date without the flag. The layout is declared in splice_organizer.h.
+//
+// Category folders grow flat, and file systems slow down on folders of
+// 100,000 files and more. "--shard pack", "--shard letter" or "--shard hash"
+// leaves a folder as it is until it holds --shard-size files (10,000 by
+// default); new files then go to a subfolder named after the pack they came
+// from, the first letter or digit of their name, or two hex digits of a hash
+// of their name, such as "Drums/Kick/K". A full subfolder continues in
+// "K_2", "K_3" and so on, so no folder grows past the limit. Files already in
+// one of these folders are replaced where they are, and the index keeps every
+// other file where it was first placed.
+//
+// Optionally, byte-identical samples (the same one-shot shipped in several
+// packs or under several names) can be placed only once. Files are grouped by
+// size and only same-sized files are hashed, first over a short prefix and
+// then in full, and files with equal hashes are compared byte by byte.
+// Duplicates are either skipped or hard linked to the copy that was placed.
+//
+// Optionally, WAV files that match no keyword can be sorted by how they sound.
+// Only the first 300 ms are decoded. Their loudness envelope, zero-crossing
+// rate, spectral centroid and the file's length tell 808s, kicks, snares, hats
+// and loops apart; anything else stays in the fallback category.
+//
+// Optionally, the headers of each file are read before it is copied: the
+// RIFF chunks of WAV files (format, data, ACID tempo and loop flags, sampler
+// loops) and the ID3v2 tag and first frame of MP3 files. Only the few pages
+// holding them are read through a memory mapping. Empty, truncated or
+// unrecognizable files are then skipped, and loops that carry a tempo can be
+// sorted into a tempo folder inside their category, such as
+// "Other/Loop/120bpm".
+//
+// Started as "splice_file_organizer --plan <file>", the program asks the same
+// questions but only writes a plan: one tab-separated line per transfer, sorted
+// by destination, with collisions resolved against the current contents of the
+// destination. Nothing is created or copied. The plan can be reviewed or
+// diffed, then carried out with "splice_file_organizer --apply <file>". Files
+// that changed since planning are skipped, and so are files whose destination
+// has been taken since by a sample the plan did not mean to replace.
+//
+// Run with "--source <dir> --dest <dir>" or "--jobs <file>", the program
+// asks nothing and does not wait for Enter, so it can be scheduled. Every
+// option has a flag (see "--help"). A jobs file lists one
+// "<source><TAB><destination>" pair per line. All jobs share one worker pool
+// and one set of compiled rules, and each destination is listed and has its
+// index loaded only once, however many jobs write to it.
+//
+// Progress and errors go to a log on stderr, or to a file given with "--log".
+// It is plain "key=value" text or, with "--log-format json", one JSON object
+// per line. Workers format messages into their own buffers, and a background
+// thread writes them out in large blocks, so even "--log-level debug" barely
+// slows a run down.
+//
+// With --watch the organizer keeps running after the first pass and places
+// samples as they land in the source folders, such as new downloads from
+// Splice. It listens for changes through inotify on Linux and
+// ReadDirectoryChangesW on Windows, and rescans every ten seconds elsewhere.
+// Changes are gathered until two seconds pass without one (at most thirty
+// seconds), then only the files that changed are organized and the index is
+// saved. Folders under the destination are never watched, so the destination
+// may sit inside the source. Stop it with Ctrl+C, which lets the batch in
+// progress finish and saves the index; if the process is killed instead, the
+// files of a batch cut short are placed again on the next run.
+//
+// To reorganize in the background while a studio machine is in use,
+// --background drops the organizer to idle I/O priority and a lower CPU
+// priority (background processing mode on Windows), and --max-rate and
+// --max-files cap the megabytes copied and the files placed per second. The
+// caps are token buckets shared by all workers, so together they run at the
+// full allowed rate but never above it. With "--control <file>" the file is
+// checked every second while the run is in progress, and its "max-rate",
+// "max-files" and "workers" lines replace those budgets on the fly; "workers"
+// can lower the number of busy workers down to one but not raise it above
+// --workers, and lines left out fall back to the command line.
+//
+// "--order disk" lists the whole source tree before the first copy and then
+// hands files to the workers sorted by inode (the MFT record on NTFS), which
+// on most file systems follows where they sit on disk, so a spinning disk or
+// file server reads them nearly in sequence. "--order folder" also groups
+// them by the category folder their tags or name select, so each destination
+// folder is filled in one stretch. Which of two same-named files gets the
+// "_<n>" suffix follows the order they are copied in.
+//
+// With --pipeline, copies go through one reader and one writer thread
+// instead of each worker copying on its own. The reader takes waiting files in
+// order of their inode (or file index on Windows), sweeping across the disk,
+// and reads them in chunks of up to 4 MiB into a fixed 32 MiB ring of aligned
+// memory while the writer empties it into the destination, so the next file
+// is read while the current one is written. Writes start once the ring is full
+// or the reader runs out of files. This keeps a spinning or USB disk streaming
+// instead of seeking between many files at once; on SSDs the default in-kernel
+// copies are usually faster. --copy-chunk does not apply to pipeline copies.
+//
+// With --tags the tags Splice keeps for each sample are used instead of the
+// file name. Splice stores them in its local database; export it to CSV (with
+// a header row) or JSON (an array of objects, or one object per line) that has
+// a "path" column and any of "instrument", "type", "tags" and "bpm". The
+// instrument and type tags are matched against the category keywords once at
+// startup, and the results are frozen into a table sorted by path hash, so
+// each file costs a single lookup even with a million tagged samples. Files
+// whose tags match no category, and files missing from the export, are
+// classified by name as before. With --tempo-folders, loops without a tempo
+// in their headers use the tagged BPM.
+//
+// Files are written under a temporary ".<name>.part" name next to their
+// destination and renamed into place, so an interrupted run never leaves a
+// truncated sample behind, and an existing file is replaced in one step.
+// While a run is in progress it keeps a journal (".splice_journal" in the
+// destination) of every transfer it starts and finishes, written and synced in
+// batches of 256 once the files they finish are synced to disk. If the run
+// dies or the power fails before the index is saved, the next run folds
+// the journal into the index first and skips every transfer it shows as
+// finished; transfers that were cut short are made again.
+//
+// Copies are made inside the kernel where possible: with copy_file_range on
+// Linux (falling back to sendfile, then to plain reads and writes), and with
+// CopyFileExW on Windows, bypassing the system cache for files of 64 MiB and
+// more. On Linux, destinations of 1 MiB and more are preallocated so they are
+// written in few extents, and "--copy-chunk <mib>" sets how much is moved per
+// call (by default 1 MiB, or 16 MiB for large files).
+//
+// While it runs, the program shows one refreshing line with the files done,
+// files/s, MB/s and the time left ("--no-progress" hides it; it is never shown
+// when the output is not a console). At the end it prints what happened to
+// every file, the system calls and errors, and for each stage (listing,
+// hashing, headers, classification, placing names, transfer) the time spent
+// and its median and 99th percentile latency. The busiest stage is named as
+// the bottleneck with a hint: listing is bound by the source disk, reading and
+// classification by workers, transfers by the mode and the destination disk.
+// Every thread counts into its own block, so counting costs no locks.
+//
+// The organizer itself is a library ("Library" in Tools.sln, built from
+// splice_organizer.cpp) that other programs can embed through
+// splice_organizer.h; splice_file_organizer.cpp is only its command line. A
+// splice_organizer::Organizer owns its rules, tags, statistics, budgets, copy
+// pipeline and the index and names of every destination it writes to, so
+// several organizers can work on different libraries in one process at the
+// same time. Each runs on a worker pool of its own or on an Executor the
+// caller supplies, and can be given a whole source folder or a batch of paths
+// as they come. Only the log is shared by the whole process.
+//
+// The "Bench" project in Tools.sln builds splice_bench, which generates a
+// synthetic library with Splice-style pack and sample names (size, depth, pack
+// count and duplicate rate are flags) and times enumeration, filename
+// classification, collision handling, planning, transfer and an index-only
+// rerun separately. It prints files/s and MB/s for each stage and appends
+// the run to "splice_bench_results.tsv" so results can be compared across
+// changes.
+//
 // Additional Requirements:
 // - Set the environment variable "MAX_PATH" to a greater value (e.g., 32767) to
 //   be able handle long file paths.
@@ -51,223 +231,560 @@
 // THE SOFTWARE.
 // -----------------------------------------------------------------------------
 
-#pragma once
-#ifndef GUARD_SPLICE_FILE_ORGANIZER_HPP
-#define GUARD_SPLICE_FILE_ORGANIZER_HPP
+#include "splice_organizer.h"
 
 #include <algorithm>
-#include <filesystem>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
-#include <set>
+#include <optional>
+#include <stdexcept>
+#include <stop_token>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
 #include <vector>
 
-namespace fs = std::filesystem;
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 
-// Set to store processed file names
-std::set<std::string> processed_files;
+namespace splice_organizer {
 
-// Convert a string to lowercase
-std::string to_lower(const std::string& str) {
-  std::string lower_str = str;
-  std::transform(lower_str.begin(), lower_str.end(), lower_str.begin(),
-                 ::tolower);
-  return lower_str;
-}
+// Set by the first Ctrl+C or termination request during a watch
+std::atomic<bool> stop_signalled{false};
 
-// Check if a file is an audio file (wav or mp3)
-bool is_audio_file(const fs::path& file_path) {
-  std::string extension = to_lower(file_path.extension().string());
-  return extension == ".wav" || extension == ".mp3";
+// Note that a watch should stop; a second signal ends the process as usual
+void on_stop_signal(int signal) {
+  stop_signalled.store(true);
+  std::signal(signal, SIG_DFL);
 }
 
-// Check if a file has already been processed
-bool file_already_processed(const fs::path& file_path) {
-  std::string filename = to_lower(file_path.filename().string());
-  return processed_files.find(filename) != processed_files.end();
+// Check if standard output is a console that can redraw a line
+bool stdout_is_terminal() {
+#ifdef _WIN32
+  return _isatty(_fileno(stdout)) != 0;
+#else
+  return isatty(STDOUT_FILENO) != 0;
+#endif
 }
 
-// Append an index to a filename
-std::string append_index_to_filename(const fs::path& filename, int index) {
-  std::string base_name = filename.stem().string();
-  std::string extension = filename.extension().string();
-  return base_name + "_" + std::to_string(index) + extension;
-}
+// Command-line usage, printed for --help and after usage errors
+constexpr const char* kUsage = R"(Usage: splice_file_organizer [options]
 
-// Create parent directories for a file
-void create_parent_directories(const fs::path& file_path) {
-  fs::create_directories(file_path.parent_path());
-}
+Without --source or --jobs the folders and options are asked for.
 
-// Print information about a file move
-void print_file_move_info(const fs::path& source, const fs::path& destination) {
-  std::cout << "Moved: \n";
-  std::cout << "  From: " << source << "\n";
-  std::cout << "  To:   " << destination << "\n";
-}
+  --source <dir>     Folder of samples to organize
+  --dest <dir>       Folder to organize them into
+  --jobs <file>      Run each "<source><TAB><destination>" line of a file in
+                     turn; lines with only a source use --dest
+  --rules <file>     Category rules (default: splice_rules.txt if present)
+  --tags <file>      Classify by the tags in a CSV or JSON export of the
+                     Splice library instead of by file name
+  --workers <n>      Number of copy workers (default: hardware threads)
+  --mode <mode>      copy, move, hardlink or reflink (default: copy)
+  --dedup <mode>     keep, skip or link byte-identical files (default: keep)
+  --order <order>    listing, disk or folder: copy files as listed, or list
+                     the whole tree first and copy in disk order, grouped
+                     by category folder for "folder" (default: listing)
+  --classify         Sort unmatched WAV files by their sound
+  --check-headers    Skip files with broken audio headers
+  --tempo-folders    Sort loops into tempo folders (e.g. 120bpm)
+  --no-index         Neither use nor update the .splice_index file
+  --catalog          Keep a .splice_catalog of the destination, a sorted
+                     list of every sample for fast browsing; once started
+                     it is updated by every run
+  --shard <mode>     off, pack, letter or hash: once a folder holds
+                     --shard-size files, put new ones in subfolders named
+                     after their pack, first letter or a hash (default: off)
+  --shard-size <n>   Files per folder before it is sharded (default: 10000)
+  --copy-chunk <mib> MiB moved per copy call on Linux (default: 1, or 16
+                     for files of 64 MiB and more)
+  --background       Run at low I/O and CPU priority
+  --max-rate <MB/s>  Copy at most this many megabytes per second
+  --max-files <n>    Place at most this many files per second
+  --control <file>   Re-read "max-rate", "max-files" and "workers" lines
+                     from a file whenever it changes during the run
+  --watch            After the run, keep organizing samples as they appear
+                     in the sources until stopped with Ctrl+C
+  --pipeline         Copy through one reader and one writer thread that
+                     read the next files while writing the current one, for
+                     spinning and USB disks (Linux and Windows)
+  --print            Log the source and destination of every file
+  --log <file>       Append the log to a file instead of stderr
+  --log-level <lvl>  error, warning, info or debug (default: warning)
+  --log-format <fmt> text or json, one message per line (default: text)
+  --no-progress      Do not show the progress line on the console
+  --plan <file>      Write a plan of a single job instead of transferring
+  --apply <file>     Carry out a plan written by --plan
+  --help             Show this help
+)";
 
-// Organize a file based on its content
-void organize_file(const fs::path& source, const fs::path& destination,
-                   bool print_info) {
-  if (!is_audio_file(source)) {
-    return;  // Ignore non-audio files
-  }
-
-  std::string filename = to_lower(source.filename().string());
-  fs::path dest_path = destination;
-
-  // Organize files based on content
-  if (filename.find("808") != std::string::npos) {
-    dest_path /= "Drums";
-    dest_path /= "808";
-    dest_path /= source.filename().c_str();
-  } else if (filename.find("snare") != std::string::npos ||
-             filename.find("_snr") != std::string::npos ||
-             filename.find("snr_") != std::string::npos) {
-    dest_path /= "Drums";
-    dest_path /= "Snare";
-    dest_path /= source.filename().c_str();
-  } else if (filename.find("kick") != std::string::npos ||
-             filename.find("_kck") != std::string::npos ||
-             filename.find("kck_") != std::string::npos) {
-    dest_path /= "Drums";
-    dest_path /= "Kick";
-    dest_path /= source.filename().c_str();
-  } else if (filename.find("clap") != std::string::npos ||
-             filename.find("_clp") != std::string::npos ||
-             filename.find("clp_") != std::string::npos) {
-    dest_path /= "Drums";
-    dest_path /= "Clap";
-    dest_path /= source.filename().c_str();
-  } else if (filename.find("hat") != std::string::npos ||
-             filename.find("ht_") != std::string::npos ||
-             filename.find("_ht") != std::string::npos) {
-    dest_path /= "Drums";
-    dest_path /= "Hat";
-    dest_path /= source.filename().c_str();
-  } else if (filename.find("drum") != std::string::npos ||
-             filename.find("_drm") != std::string::npos ||
-             filename.find("drm_") != std::string::npos) {
-    dest_path /= "Drums";
-    dest_path /= "Other";
-    dest_path /= source.filename().c_str();
-  } else if (filename.find("loop") != std::string::npos) {
-    dest_path /= "Other";
-    dest_path /= "Loop";
-    dest_path /= source.filename().c_str();
-  } else {
-    dest_path /= "Other";
-    dest_path /= "Other";
-    dest_path /= source.filename().c_str();
-  }
+// Options and jobs given on the command line
+struct CommandLine {
+  OrganizeOptions options;
+  std::string source;
+  std::string destination;
+  std::string jobs_file;
+  std::string rules_file;  // Empty selects the default rules
+  std::string tags_file;   // Empty classifies by file name only
+  std::string plan_file;
+  std::string apply_file;
+  LogLevel log_level = LogLevel::kWarning;
+  LogFormat log_format = LogFormat::kText;
+  std::string log_file;  // Empty logs to stderr
+  bool progress = true;   // Shown only when stdout is a console
+  bool watch = false;     // Keep organizing new files after the run
+  bool background = false;  // Low I/O and CPU priority
+  Budget budget;            // From --max-rate and --max-files
+  std::string control_file;
+  bool help = false;
+};
 
-  try {
-    create_parent_directories(dest_path);
-
-    if (print_info) {
-      std::cout << "Request: \n";
-      std::cout << "  Source:      " << source << "\n";
-      std::cout << "  Destination: " << dest_path << "\n";
-    }
+// Parse the command line. Throws std::runtime_error on usage errors.
+CommandLine parse_command_line(int argc, char* argv[]) {
+  CommandLine command;
+  OrganizeOptions& options = command.options;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view argument = argv[i];
+    auto value = [&]() -> std::string_view {
+      if (i + 1 >= argc) {
+        throw std::runtime_error(std::string(argument) + " needs a value");
+      }
+      return argv[++i];
+    };
+    auto invalid = [&](std::string_view text) {
+      return std::runtime_error("invalid value \"" + std::string(text) +
+                                "\" for " + std::string(argument));
+    };
 
-    // Perform the file move
-    if (!fs::exists(dest_path)) {
-      fs::copy_file(source, dest_path);
-      if (print_info) print_file_move_info(source, dest_path);
-    } else {
-      if (!file_already_processed(dest_path)) {
-        fs::remove(dest_path);
-        fs::copy_file(source, dest_path);
-        if (print_info) print_file_move_info(source, dest_path);
-      } else {
-        for (int i = 0; i < 999999; ++i) {
-          fs::path indexed_dest_path =
-              destination / append_index_to_filename(source.filename(), i);
-          if (!fs::exists(indexed_dest_path)) {
-            fs::copy_file(source, indexed_dest_path);
-            if (print_info) print_file_move_info(source, indexed_dest_path);
-            break;
-          }
-        }
+    if (argument == "--source") {
+      command.source = value();
+    } else if (argument == "--dest") {
+      command.destination = value();
+    } else if (argument == "--jobs") {
+      command.jobs_file = value();
+    } else if (argument == "--rules") {
+      command.rules_file = value();
+    } else if (argument == "--tags") {
+      command.tags_file = value();
+    } else if (argument == "--workers") {
+      std::string_view text = value();
+      auto result = std::from_chars(text.data(), text.data() + text.size(),
+                                    options.worker_count);
+      if (result.ec != std::errc() || result.ptr != text.data() + text.size()) {
+        throw invalid(text);
+      }
+    } else if (argument == "--mode") {
+      std::string_view text = value();
+      auto mode = find_name(kTransferModeNames, text);
+      if (!mode) throw invalid(text);
+      options.transfer_mode = static_cast<TransferMode>(*mode);
+    } else if (argument == "--dedup") {
+      std::string_view text = value();
+      auto dedup = find_name(kDedupModeNames, text);
+      if (!dedup) throw invalid(text);
+      options.dedup = static_cast<DedupMode>(*dedup);
+    } else if (argument == "--order") {
+      std::string_view text = value();
+      auto order = find_name(kWorkOrderNames, text);
+      if (!order) throw invalid(text);
+      options.work_order = static_cast<WorkOrder>(*order);
+    } else if (argument == "--classify") {
+      options.classify_content = true;
+    } else if (argument == "--check-headers") {
+      options.check_headers = true;
+    } else if (argument == "--tempo-folders") {
+      options.tempo_folders = true;
+    } else if (argument == "--no-index") {
+      options.use_index = false;
+    } else if (argument == "--catalog") {
+      options.catalog = true;
+    } else if (argument == "--shard") {
+      std::string_view text = value();
+      auto shard = find_name(kShardModeNames, text);
+      if (!shard) throw invalid(text);
+      options.shard = static_cast<ShardMode>(*shard);
+    } else if (argument == "--shard-size") {
+      std::string_view text = value();
+      auto result = std::from_chars(text.data(), text.data() + text.size(),
+                                    options.shard_size);
+      if (result.ec != std::errc() || result.ptr != text.data() + text.size() ||
+          options.shard_size == 0) {
+        throw invalid(text);
       }
+    } else if (argument == "--copy-chunk") {
+      std::string_view text = value();
+      std::size_t mebibytes = 0;
+      auto result = std::from_chars(text.data(), text.data() + text.size(),
+                                    mebibytes);
+      if (result.ec != std::errc() || result.ptr != text.data() + text.size() ||
+          mebibytes == 0 || mebibytes > 1024) {
+        throw invalid(text);
+      }
+      options.copy_chunk_size = mebibytes << 20;
+    } else if (argument == "--print") {
+      command.log_level = std::max(command.log_level, LogLevel::kInfo);
+    } else if (argument == "--plan") {
+      command.plan_file = value();
+    } else if (argument == "--apply") {
+      command.apply_file = value();
+    } else if (argument == "--log") {
+      command.log_file = value();
+    } else if (argument == "--log-level") {
+      std::string_view text = value();
+      auto level = find_name(kLogLevelNames, text);
+      if (!level) throw invalid(text);
+      command.log_level = static_cast<LogLevel>(*level);
+    } else if (argument == "--log-format") {
+      std::string_view text = value();
+      auto format = find_name(kLogFormatNames, text);
+      if (!format) throw invalid(text);
+      command.log_format = static_cast<LogFormat>(*format);
+    } else if (argument == "--no-progress") {
+      command.progress = false;
+    } else if (argument == "--watch") {
+      command.watch = true;
+    } else if (argument == "--pipeline") {
+      options.pipeline = true;
+    } else if (argument == "--background") {
+      command.background = true;
+    } else if (argument == "--max-rate") {
+      std::string_view text = value();
+      auto rate = parse_rate(text);
+      if (!rate) throw invalid(text);
+      command.budget.bytes_per_second = *rate * 1e6;
+    } else if (argument == "--max-files") {
+      std::string_view text = value();
+      auto rate = parse_rate(text);
+      if (!rate) throw invalid(text);
+      command.budget.files_per_second = *rate;
+    } else if (argument == "--control") {
+      command.control_file = value();
+    } else if (argument == "--help" || argument == "-h") {
+      command.help = true;
+    } else {
+      throw std::runtime_error("unknown option " + std::string(argument));
     }
-
-    // Mark the file as processed
-    processed_files.insert(to_lower(source.filename().string()));
-  } catch (const fs::filesystem_error& e) {
-    std::cerr << "\nError copying file: " << e.what() << "\n";
   }
+  return command;
 }
 
-// Process a directory and organize its files
-void process_directory(const fs::path& source, const fs::path& destination,
-                       bool print_info) {
-  try {
-    for (const auto& entry : fs::directory_iterator(source)) {
-      if (entry.is_directory()) {
-        process_directory(entry.path(), destination, print_info);
-      } else {
-        organize_file(entry.path(), destination, print_info);
-      }
+// Parse a jobs file. Each job is a line "<source><TAB><destination>"; a line
+// with only a source uses default_destination. Blank lines and lines
+// starting with '#' are ignored.
+std::vector<Job> parse_jobs_file(const fs::path& jobs_path,
+                                 const fs::path& default_destination) {
+  std::ifstream in(jobs_path);
+  if (!in) throw std::runtime_error("cannot open " + jobs_path.string());
+
+  std::vector<Job> jobs;
+  std::string line;
+  int line_number = 0;
+  while (std::getline(in, line)) {
+    ++line_number;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty() || line[0] == '#') continue;
+
+    auto tab = line.find('\t');
+    Job job;
+    job.source = line.substr(0, tab);
+    job.destination = tab != std::string::npos
+                          ? fs::path(line.substr(tab + 1))
+                          : default_destination;
+    if (job.source.empty() || job.destination.empty()) {
+      throw std::runtime_error(jobs_path.string() + ":" +
+                               std::to_string(line_number) +
+                               ": expected <source><TAB><destination>");
     }
-  } catch (const fs::filesystem_error& e) {
-    std::cerr << "\nError processing file system: \n" << e.what() << "\n";
+    jobs.push_back(std::move(job));
   }
+  return jobs;
 }
 
-int main() {
-  std::cout << "---------------------------------------------------------------"
-               "-------------- "
-            << std::endl;
-  std::cout << "Splice File Organizer " << std::endl;
-  std::cout << "Author: Anton Yashchenko (BigTeeny) " << std::endl;
-  std::cout << "Contact: bigteenymusic@gmail.com " << std::endl;
-  std::cout << "Website: bigteenymusic.com \n" << std::endl;
-
+// Ask for the folders and options of a single job. Returns false if the
+// source folder does not exist.
+bool prompt_for_job(CommandLine& command) {
   std::cout << "Enter Splice Samples folder name: ";
-  std::string source_folder;
-  std::cin >> source_folder;
+  std::cin >> command.source;
 
   // Verify if the source folder exists
-  if (!fs::exists(source_folder)) {
+  if (!fs::exists(command.source)) {
     std::cout << "Source folder does not exist. Exiting.\n";
-    return 1;
+    return false;
   }
 
   std::cout << "Enter destination folder name: ";
-  std::string destination_folder;
-  std::cin >> destination_folder;
+  std::cin >> command.destination;
 
   // Ask the user if they want to print detailed information about file moves
   std::cout
       << "Print the source and destination info: Enter 1 for YES, 0 for NO: ";
-  bool print_info;
+  OrganizeOptions& options = command.options;
+  bool print_info = false;
   std::cin >> print_info;
+  if (print_info) {
+    command.log_level = std::max(command.log_level, LogLevel::kInfo);
+  }
+  // Ask how many files may be copied at the same time
+  std::cout << "Enter number of copy workers (0 for default of "
+            << default_worker_count() << "): ";
+  std::cin >> options.worker_count;
 
-  // Set the source and destination folders
-  fs::path source_path = source_folder;
-  fs::path destination_path = destination_folder;
-
-  // Create destination folders if they don't exist
-  fs::create_directories(destination_path / "Drums" / "808");
-  fs::create_directories(destination_path / "Drums" / "Snare");
-  fs::create_directories(destination_path / "Drums" / "Kick");
-  fs::create_directories(destination_path / "Drums" / "Clap");
-  fs::create_directories(destination_path / "Drums" / "Hat");
-  fs::create_directories(destination_path / "Drums" / "Other");
-  fs::create_directories(destination_path / "Other" / "Loop");
-  fs::create_directories(destination_path / "Other" / "Other");
+  // Ask how files should be placed; anything but a copy needs the source and
+  // destination on the same volume and falls back to copying otherwise
+  std::cout << "Transfer mode: Enter 0 to COPY, 1 to MOVE, 2 to HARD LINK, "
+               "3 to CLONE (reflink): ";
+  int transfer_mode = 0;
+  std::cin >> transfer_mode;
+  if (transfer_mode >= 0 && transfer_mode <= 3) {
+    options.transfer_mode = static_cast<TransferMode>(transfer_mode);
+  }
 
-  // Process the source directory
-  process_directory(source_path, destination_path, print_info);
+  // Ask whether byte-identical samples should be placed only once
+  std::cout << "Duplicates: Enter 0 to KEEP, 1 to SKIP, 2 to HARD LINK: ";
+  int dedup = 0;
+  std::cin >> dedup;
+  if (dedup >= 0 && dedup <= 2) options.dedup = static_cast<DedupMode>(dedup);
 
-  std::cout << "Splice Files organized successfully.\n";
+  // Ask whether files without a keyword should be sorted by how they sound
+  std::cout << "Sort unmatched WAV files by their sound: Enter 1 for YES, 0 "
+               "for NO: ";
+  std::cin >> options.classify_content;
 
-  std::cout << "Press Enter to exit...";
-  std::cin.ignore();  // Ignore the previous newline character
-  std::cin.get();     // Wait for the user to press Enter
+  // Ask whether audio headers should be checked before copying, and loops
+  // sorted by the tempo they carry
+  std::cout << "Skip files with broken audio headers: Enter 1 for YES, 0 for "
+               "NO: ";
+  std::cin >> options.check_headers;
+  std::cout << "Sort loops into tempo folders (e.g. 120bpm): Enter 1 for YES, "
+               "0 for NO: ";
+  std::cin >> options.tempo_folders;
 
-  return 0;
+  return true;
 }
 
-#endif  // !GUARD_SPLICE_FILE_ORGANIZER_HPP
\ No newline at end of file
+}  // namespace splice_organizer
+
+int main(int argc, char* argv[]) {
+  using namespace splice_organizer;
+  std::cout << "---------------------------------------------------------------"
+               "-------------- \n";
+  std::cout << "Splice File Organizer \n";
+  std::cout << "Author: Anton Yashchenko (BigTeeny) \n";
+  std::cout << "Contact: bigteenymusic@gmail.com \n";
+  std::cout << "Website: bigteenymusic.com \n\n";
+
+  CommandLine command;
+  try {
+    command = parse_command_line(argc, argv);
+  } catch (const std::runtime_error& e) {
+    std::cerr << "Error: " << e.what() << "\n\n" << kUsage;
+    return 1;
+  }
+  if (command.help) {
+    std::cout << kUsage;
+    return 0;
+  }
+  if (command.background) enter_background_mode();
+
+  // The control file is watched once its messages can be logged
+  auto begin = [&command](Organizer& organizer) {
+    if (!start_logging(command.log_level, command.log_format,
+                       command.log_file)) {
+      std::cerr << "Error: cannot open log file " << command.log_file << "\n";
+      return false;
+    }
+    organizer.set_budget(command.budget);
+    if (!command.control_file.empty()) {
+      organizer.follow_control_file(command.control_file, command.budget);
+    }
+    return true;
+  };
+
+  if (!command.apply_file.empty()) {
+    // A plan names its destinations itself, so no rules are needed
+    Organizer organizer(Rules::built_in(), command.options);
+    if (!begin(organizer)) return 1;
+    auto apply_start = std::chrono::steady_clock::now();
+    try {
+      std::cout << "Applying plan " << command.apply_file << ".\n";
+      std::size_t transfers = organizer.apply(command.apply_file);
+      std::cout << "Applied " << transfers << " transfers.\n";
+    } catch (const std::exception& e) {
+      std::cerr << "\nError loading plan: " << e.what() << "\n";
+      return 1;
+    }
+    organizer.print_summary(std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - apply_start)
+                                .count());
+    stop_logging();
+    std::cout << "Splice Files organized successfully.\n";
+    return 0;
+  }
+
+  // Without a source on the command line, ask for everything
+  bool interactive = command.source.empty() && command.jobs_file.empty();
+  if (interactive && !prompt_for_job(command)) return 1;
+
+  std::vector<Job> jobs;
+  try {
+    if (!command.jobs_file.empty()) {
+      jobs = parse_jobs_file(command.jobs_file, command.destination);
+    }
+    if (!command.source.empty()) {
+      if (command.destination.empty()) {
+        throw std::runtime_error("--source needs --dest");
+      }
+      jobs.push_back({command.source, command.destination});
+    }
+    if (!command.plan_file.empty() && jobs.size() != 1) {
+      throw std::runtime_error("--plan takes exactly one job");
+    }
+    if (command.watch && !command.plan_file.empty()) {
+      throw std::runtime_error("--watch cannot be combined with --plan");
+    }
+  } catch (const std::runtime_error& e) {
+    std::cerr << "Error: " << e.what() << "\n";
+    return 1;
+  }
+
+  // Load the category rules, falling back to the built-in set
+  std::optional<Rules> rules;
+  try {
+    fs::path rules_file = command.rules_file.empty() ? kDefaultRulesFile
+                                                     : command.rules_file;
+    if (!command.rules_file.empty() || fs::exists(rules_file)) {
+      rules = Rules::load(rules_file);
+      std::cout << "Using " << rules->size() << " categories from "
+                << rules_file.string() << ".\n";
+    } else {
+      rules = Rules::built_in();
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "\nError loading rules: " << e.what() << "\n";
+    return 1;
+  }
+
+  // Read the tag export once; its table is shared by every worker
+  Tags tags;
+  if (!command.tags_file.empty()) {
+    try {
+      tags = Tags::load(command.tags_file, *rules);
+      std::cout << "Using tags of " << tags.size() << " samples from "
+                << command.tags_file << ".\n";
+    } catch (const std::exception& e) {
+      std::cerr << "\nError loading tags: " << e.what() << "\n";
+      return 1;
+    }
+  }
+
+  // The pool, rules and per-destination state are shared by all jobs
+  Organizer organizer(*rules, command.options, tags);
+  if (!begin(organizer)) return 1;
+
+  // Show progress while jobs run and a summary of the whole run at the end
+  bool show_progress = command.progress && stdout_is_terminal();
+  auto run_start = std::chrono::steady_clock::now();
+  auto summarize = [&] {
+    organizer.stop_progress();
+    organizer.print_summary(std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - run_start)
+                                .count());
+  };
+
+  if (!command.plan_file.empty()) {
+    // Plan only; nothing is created or copied
+    if (show_progress) organizer.start_progress();
+    std::size_t planned = 0;
+    try {
+      planned = organizer.plan(jobs.front(), command.plan_file);
+    } catch (const fs::filesystem_error& e) {
+      summarize();
+      std::cerr << "\nError writing plan: " << e.what() << "\n";
+      return 1;
+    }
+    summarize();
+    stop_logging();
+    std::cout << "Planned " << planned << " transfers in "
+              << command.plan_file << ".\n";
+    return 0;
+  }
+
+  // Process the source directories
+  bool failed = false;
+  for (const auto& job : jobs) {
+    if (!fs::exists(job.source)) {
+      std::cerr << "\nSource folder does not exist: " << job.source << "\n";
+      failed = true;
+      continue;
+    }
+    if (jobs.size() > 1) {
+      organizer.stop_progress();
+      std::cout << "Organizing " << job.source << " into " << job.destination
+                << ".\n";
+    }
+    if (show_progress) organizer.start_progress();
+    try {
+      organizer.organize(job);
+    } catch (const fs::filesystem_error& e) {
+      organizer.stop_progress();
+      std::cerr << "\nError processing file system: " << e.what() << "\n";
+      failed = true;
+    }
+  }
+  organizer.finish();
+  summarize();
+
+  if (command.watch) {
+    std::cout << "Watching for new samples; press Ctrl+C to stop."
+              << std::endl;
+    // Ctrl+C lets the batch in progress finish and the index be saved. A
+    // signal handler may only set a flag, so a thread passes it on to the
+    // watch's stop token.
+    std::stop_source stop;
+    std::signal(SIGINT, on_stop_signal);
+    std::signal(SIGTERM, on_stop_signal);
+    std::jthread relay([&stop](std::stop_token done) {
+      while (!done.stop_requested()) {
+        if (stop_signalled.load()) {
+          stop.request_stop();
+          return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      }
+    });
+    try {
+      organizer.watch(jobs, stop.get_token(), [](std::uint64_t placed) {
+        std::cout << "Organized " << placed << " new samples." << std::endl;
+      });
+      std::cout << "Stopped watching." << std::endl;
+    } catch (const fs::filesystem_error& e) {
+      std::cerr << "\nError watching folders: " << e.what() << "\n";
+      failed = true;
+    }
+    relay.request_stop();
+    relay.join();
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+  }
+  stop_logging();
+
+  if (!failed) std::cout << "Splice Files organized successfully.\n";
+
+  if (interactive) {
+    std::cout << "Press Enter to exit...";
+    std::cin.ignore();  // Ignore the previous newline character
+    std::cin.get();     // Wait for the user to press Enter
+  }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,6750 @@
+// -----------------------------------------------------------------------------
+// Splice File Organizer library
+// -----------------------------------------------------------------------------
+// Description:
+// Implementation of splice_organizer.h. How a run lists, classifies and
+// places files is described at the top of splice_file_organizer.cpp.
+//
+// License: MIT, see splice_file_organizer.cpp.
+// -----------------------------------------------------------------------------
+
+#include "splice_organizer.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <intrin.h>
+#include <io.h>
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
+#endif
+
+#if defined(__SSE2__) && !defined(_MSC_VER)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
+
+namespace splice_organizer {
+
+// 64-bit FNV-1a hash of a byte range
+std::uint64_t hash_bytes(const void* data, std::size_t size) {
+  const auto* bytes = static_cast<const unsigned char*>(data);
+  std::uint64_t hash = 0xcbf29ce484222325ull;
+  for (std::size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Hash of a name as stored in a NameSet
+inline std::uint64_t hash_name(std::string_view name) {
+  return hash_bytes(name.data(), name.size());
+}
+
+// Open-addressing set of names. Each slot holds a name's 64-bit hash and its
+// place in a string pool, so a lookup usually touches one slot and the name
+// bytes are only compared when the hashes match.
+class NameSet {
+ public:
+  // Check if a name with the given hash is in the set
+  bool contains(std::string_view name, std::uint64_t hash) const {
+    if (slots_.empty()) return false;
+    return slots_[find_slot(name, hash)].hash != 0;
+  }
+
+  // Add a name with the given hash; returns false if it was already present
+  bool insert(std::string_view name, std::uint64_t hash) {
+    if ((size_ + 1) * 4 > slots_.size() * 3) grow();
+    Slot& slot = slots_[find_slot(name, hash)];
+    if (slot.hash != 0) return false;
+    slot = {stored_hash(hash), static_cast<std::uint32_t>(pool_.size()),
+            static_cast<std::uint32_t>(name.size())};
+    pool_.append(name);
+    ++size_;
+    return true;
+  }
+
+  bool contains(std::string_view name) const {
+    return contains(name, hash_name(name));
+  }
+  bool insert(std::string_view name) { return insert(name, hash_name(name)); }
+
+  std::size_t size() const { return size_; }
+
+ private:
+  struct Slot {
+    std::uint64_t hash;  // 0 marks an empty slot
+    std::uint32_t offset;
+    std::uint32_t length;
+  };
+
+  static constexpr std::size_t kInitialSlots = 64;
+
+  static std::uint64_t stored_hash(std::uint64_t hash) {
+    return hash != 0 ? hash : 1;
+  }
+
+  // Index of the slot holding the name, or of the empty slot ending its probe
+  std::size_t find_slot(std::string_view name, std::uint64_t hash) const {
+    hash = stored_hash(hash);
+    std::size_t mask = slots_.size() - 1;
+    for (std::size_t i = static_cast<std::size_t>(hash) & mask;;
+         i = (i + 1) & mask) {
+      const Slot& slot = slots_[i];
+      if (slot.hash == 0) return i;
+      if (slot.hash == hash &&
+          std::string_view(pool_.data() + slot.offset, slot.length) == name) {
+        return i;
+      }
+    }
+  }
+
+  // Double the table and reinsert every slot
+  void grow() {
+    std::vector<Slot> old = std::move(slots_);
+    slots_.assign(std::max(old.size() * 2, kInitialSlots), Slot{});
+    std::size_t mask = slots_.size() - 1;
+    for (const Slot& slot : old) {
+      if (slot.hash == 0) continue;
+      std::size_t i = static_cast<std::size_t>(slot.hash) & mask;
+      while (slots_[i].hash != 0) i = (i + 1) & mask;
+      slots_[i] = slot;
+    }
+  }
+
+  std::vector<Slot> slots_;
+  std::string pool_;
+  std::size_t size_ = 0;
+};
+
+// NameSet split into independently locked shards for concurrent workers.
+// The shard is picked from the top bits of the hash, the slot within it from
+// the low bits.
+class ShardedNameSet {
+ public:
+  bool contains(std::string_view name, std::uint64_t hash) const {
+    const Shard& shard = shards_[hash >> (64 - kShardBits)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.names.contains(name, hash);
+  }
+
+  bool insert(std::string_view name, std::uint64_t hash) {
+    Shard& shard = shards_[hash >> (64 - kShardBits)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.names.insert(name, hash);
+  }
+
+ private:
+  static constexpr int kShardBits = 4;
+
+  struct alignas(64) Shard {
+    mutable std::mutex mutex;
+    NameSet names;
+  };
+
+  std::array<Shard, std::size_t{1} << kShardBits> shards_;
+};
+
+// Native file name characters (wchar_t on Windows)
+using NativeChar = fs::path::value_type;
+using NativeStringView = std::basic_string_view<NativeChar>;
+
+// Check if a file name has an audio extension (wav or mp3), ignoring case
+bool has_audio_extension(NativeStringView name) {
+  if (name.size() <= 4 || name[name.size() - 4] != '.') return false;
+  NativeChar extension[3];
+  for (int i = 0; i < 3; ++i) {
+    NativeChar c = name[name.size() - 3 + i];
+    extension[i] = c >= 'A' && c <= 'Z' ? static_cast<NativeChar>(c + 32) : c;
+  }
+  return (extension[0] == 'w' && extension[1] == 'a' && extension[2] == 'v') ||
+         (extension[0] == 'm' && extension[1] == 'p' && extension[2] == '3');
+}
+
+// Check if a file is an audio file (wav or mp3)
+bool is_audio_file(const fs::path& file_path) {
+  return has_audio_extension(file_path.filename().native());
+}
+
+// View of the last component of a path, without allocating
+NativeStringView filename_view(const fs::path& path) {
+#ifdef _WIN32
+  constexpr NativeStringView kSeparators = L"\\/";
+#else
+  constexpr NativeStringView kSeparators = "/";
+#endif
+  NativeStringView native = path.native();
+  auto separator = native.find_last_of(kSeparators);
+  return separator == NativeStringView::npos ? native
+                                             : native.substr(separator + 1);
+}
+
+// Fold an ASCII letter to lowercase, leaving every other byte alone
+inline char ascii_lower(char c) {
+  return c >= 'A' && c <= 'Z' ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+// Fold the ASCII letters of size bytes of text to lowercase into out, which
+// may be text itself. Every byte of a multibyte UTF-8 sequence is 0x80 or
+// above and passes unchanged, so UTF-8 names are folded without decoding
+// them. Blocks of 32 bytes are folded at once with AVX2 and of 16 with SSE2
+// or NEON, the rest byte by byte.
+void fold_ascii(const char* text, std::size_t size, char* out) {
+  std::size_t i = 0;
+#ifdef __AVX2__
+  // 'A' to 'Z' moved to the bottom of the signed range, one compare away
+  const __m256i bias32 = _mm256_set1_epi8(static_cast<char>(0x80 - 'A'));
+  const __m256i limit32 = _mm256_set1_epi8(static_cast<char>(0x80 + 26));
+  const __m256i case32 = _mm256_set1_epi8(0x20);
+  for (; i + 32 <= size; i += 32) {
+    __m256i bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+    __m256i upper =
+        _mm256_cmpgt_epi8(limit32, _mm256_add_epi8(bytes, bias32));
+    __m256i lower = _mm256_or_si256(bytes, _mm256_and_si256(upper, case32));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), lower);
+  }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+  const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80 - 'A'));
+  const __m128i limit = _mm_set1_epi8(static_cast<char>(0x80 + 26));
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  for (; i + 16 <= size; i += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+    __m128i upper = _mm_cmpgt_epi8(limit, _mm_add_epi8(bytes, bias));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm_or_si128(bytes, _mm_and_si128(upper, case_bit)));
+  }
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+  const uint8x16_t first = vdupq_n_u8('A');
+  const uint8x16_t letters = vdupq_n_u8(26);
+  const uint8x16_t case_bit = vdupq_n_u8(0x20);
+  for (; i + 16 <= size; i += 16) {
+    uint8x16_t bytes =
+        vld1q_u8(reinterpret_cast<const std::uint8_t*>(text + i));
+    uint8x16_t upper = vcltq_u8(vsubq_u8(bytes, first), letters);
+    vst1q_u8(reinterpret_cast<std::uint8_t*>(out + i),
+             vorrq_u8(bytes, vandq_u8(upper, case_bit)));
+  }
+#endif
+  for (; i < size; ++i) out[i] = ascii_lower(text[i]);
+}
+
+// Append text to out with ASCII letters folded to lowercase
+void append_lower(std::string& out, std::string_view text) {
+  std::size_t start = out.size();
+  out.resize(start + text.size());
+  fold_ascii(text.data(), text.size(), out.data() + start);
+}
+
+// Append a native file name to out as UTF-8, optionally folding ASCII
+// letters to lowercase
+void append_utf8(std::string& out, NativeStringView name, bool fold_case) {
+#ifdef _WIN32
+  for (std::size_t i = 0; i < name.size(); ++i) {
+#if defined(_M_X64) || defined(__SSE2__)
+    // Runs of eight ASCII characters are narrowed and folded at once
+    if (i + 8 <= name.size()) {
+      __m128i chars =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(name.data() + i));
+      __m128i high = _mm_and_si128(chars, _mm_set1_epi16(-0x80));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) ==
+          0xFFFF) {
+        char narrow[16];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(narrow),
+                         _mm_packus_epi16(chars, chars));
+        if (fold_case) fold_ascii(narrow, 8, narrow);
+        out.append(narrow, 8);
+        i += 7;
+        continue;
+      }
+    }
+#endif
+    std::uint32_t c = name[i];
+    if (c >= 0xD800 && c < 0xDC00 && i + 1 < name.size() &&
+        name[i + 1] >= 0xDC00 && name[i + 1] < 0xE000) {
+      c = 0x10000 + ((c - 0xD800) << 10) + (name[++i] - 0xDC00);
+    }
+    if (c < 0x80) {
+      char ascii = static_cast<char>(c);
+      out.push_back(fold_case ? ascii_lower(ascii) : ascii);
+    } else if (c < 0x800) {
+      out.push_back(static_cast<char>(0xC0 | (c >> 6)));
+      out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    } else if (c < 0x10000) {
+      out.push_back(static_cast<char>(0xE0 | (c >> 12)));
+      out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    } else {
+      out.push_back(static_cast<char>(0xF0 | (c >> 18)));
+      out.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    }
+  }
+#else
+  if (!fold_case) {
+    out.append(name);
+  } else {
+    append_lower(out, name);
+  }
+#endif
+}
+
+// Events counted during a run
+enum class Counter {
+  kDirectories,  // Directories listed
+  kEnumerated,   // Audio files found in the sources
+  kClassified,   // Files matched against the category rules
+  kUnchanged,    // Files skipped because the index had them
+  kSkipped,      // Unreadable files and skipped duplicates
+  kTransferred,  // Files placed, or planned in a plan
+  kFailed,       // Files that could not be placed
+  kBytes,        // Bytes copied; links, clones and renames copy nothing
+  kSyscalls,     // File system calls made by the organizer itself
+  kErrors,       // Messages logged as errors
+  kCount
+};
+
+// Stages whose latency is measured, each timed per call
+enum class Stage {
+  kList,      // Listing a source directory
+  kHash,      // Hashing file contents for deduplication
+  kHeaders,   // Mapping and parsing audio headers
+  kClassify,  // Matching the rules, and the audio content if enabled
+  kPlace,     // Checking and claiming the destination name
+  kTransfer,  // Copying, moving or linking the file
+  kCount
+};
+
+// Names of the stages, indexed by Stage
+constexpr std::array<const char*, 6> kStageNames = {
+    "list", "hash", "headers", "classify", "place", "transfer"};
+
+constexpr std::size_t kCounterCount = static_cast<std::size_t>(Counter::kCount);
+constexpr std::size_t kStageCount = static_cast<std::size_t>(Stage::kCount);
+
+// Latency buckets; bucket b holds calls shorter than 2^b nanoseconds, the
+// last one everything longer
+constexpr std::size_t kLatencyBuckets = 40;
+
+// Totals of every thread at one point in time
+struct StatsSnapshot {
+  struct StageTotals {
+    std::uint64_t calls = 0;
+    std::uint64_t nanoseconds = 0;
+    std::array<std::uint64_t, kLatencyBuckets> buckets{};
+  };
+
+  std::uint64_t operator[](Counter counter) const {
+    return counters[static_cast<std::size_t>(counter)];
+  }
+  const StageTotals& operator[](Stage stage) const {
+    return stages[static_cast<std::size_t>(stage)];
+  }
+
+  // Upper bound of the latency below which a fraction of a stage's calls
+  // completed, in nanoseconds
+  std::uint64_t quantile(Stage stage, double fraction) const {
+    const StageTotals& totals = (*this)[stage];
+    auto wanted = static_cast<std::uint64_t>(
+        std::ceil(static_cast<double>(totals.calls) * fraction));
+    std::uint64_t seen = 0;
+    for (std::size_t b = 0; b < kLatencyBuckets; ++b) {
+      seen += totals.buckets[b];
+      if (seen >= wanted) return std::uint64_t{1} << b;
+    }
+    return std::uint64_t{1} << (kLatencyBuckets - 1);
+  }
+
+  std::array<std::uint64_t, kCounterCount> counters{};
+  std::array<StageTotals, kStageCount> stages{};
+};
+
+// Run statistics. Every thread counts into its own cache-line aligned block
+// that only it writes, so counting is a plain relaxed store with no locked
+// instruction or shared cache line; readers sum the blocks without locking.
+class RunStats {
+ public:
+  // Count events
+  void add(Counter counter, std::uint64_t amount = 1) {
+    bump(block().counters[static_cast<std::size_t>(counter)], amount);
+  }
+
+  // Record the duration of one call of a stage
+  void record(Stage stage, std::chrono::nanoseconds duration) {
+    Block::StageCounters& counters =
+        block().stages[static_cast<std::size_t>(stage)];
+    auto nanoseconds = static_cast<std::uint64_t>(
+        std::max<std::int64_t>(duration.count(), 0));
+    std::size_t bucket = std::min<std::size_t>(std::bit_width(nanoseconds),
+                                               kLatencyBuckets - 1);
+    bump(counters.calls, 1);
+    bump(counters.nanoseconds, nanoseconds);
+    bump(counters.buckets[bucket], 1);
+  }
+
+  // Sum the blocks of all threads
+  StatsSnapshot snapshot() const {
+    StatsSnapshot snapshot;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& block : blocks_) {
+      for (std::size_t c = 0; c < kCounterCount; ++c) {
+        snapshot.counters[c] +=
+            block->counters[c].load(std::memory_order_relaxed);
+      }
+      for (std::size_t s = 0; s < kStageCount; ++s) {
+        const Block::StageCounters& from = block->stages[s];
+        StatsSnapshot::StageTotals& to = snapshot.stages[s];
+        to.calls += from.calls.load(std::memory_order_relaxed);
+        to.nanoseconds += from.nanoseconds.load(std::memory_order_relaxed);
+        for (std::size_t b = 0; b < kLatencyBuckets; ++b) {
+          to.buckets[b] += from.buckets[b].load(std::memory_order_relaxed);
+        }
+      }
+    }
+    return snapshot;
+  }
+
+  // Mark whether a source tree is being listed, so progress knows whether
+  // its total is final
+  void set_listing(bool listing) { listing_ = listing; }
+  bool listing() const { return listing_; }
+
+ private:
+  struct alignas(64) Block {
+    struct StageCounters {
+      std::atomic<std::uint64_t> calls{0};
+      std::atomic<std::uint64_t> nanoseconds{0};
+      std::array<std::atomic<std::uint64_t>, kLatencyBuckets> buckets{};
+    };
+    std::array<std::atomic<std::uint64_t>, kCounterCount> counters{};
+    std::array<StageCounters, kStageCount> stages;
+  };
+
+  // Only the owning thread writes a block, so a load and a store suffice
+  static void bump(std::atomic<std::uint64_t>& value, std::uint64_t amount) {
+    value.store(value.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+  }
+
+  // The calling thread's block, registered on first use. Blocks outlive
+  // their threads so nothing counted is lost. A thread counting for several
+  // RunStats in turn keeps a block in each; the one used last is found
+  // without a search.
+  Block& block() {
+    struct Owned {
+      std::uint64_t owner;
+      std::weak_ptr<Block> block;
+    };
+    thread_local std::uint64_t last_owner = 0;
+    thread_local Block* last_block = nullptr;
+    thread_local std::vector<Owned> owned;
+    if (last_owner == id_) return *last_block;
+
+    std::erase_if(owned, [](const Owned& entry) {
+      return entry.block.expired();
+    });
+    std::shared_ptr<Block> block;
+    for (const Owned& entry : owned) {
+      if (entry.owner == id_) block = entry.block.lock();
+    }
+    if (!block) {
+      block = std::make_shared<Block>();
+      owned.push_back({id_, block});
+      std::lock_guard<std::mutex> lock(mutex_);
+      blocks_.push_back(block);
+    }
+    last_owner = id_;
+    last_block = block.get();
+    return *block;
+  }
+
+  static inline std::atomic<std::uint64_t> next_id_{1};
+  const std::uint64_t id_ = next_id_.fetch_add(1, std::memory_order_relaxed);
+  mutable std::mutex mutex_;  // Guards blocks_
+  std::vector<std::shared_ptr<Block>> blocks_;
+  std::atomic<bool> listing_{false};
+};
+
+struct Session;
+
+// Session the calling thread works for, set by a SessionScope
+thread_local Session* bound_session = nullptr;
+
+// Binds the calling thread to a session until the end of the scope
+class SessionScope {
+ public:
+  explicit SessionScope(Session& session) : previous_(bound_session) {
+    bound_session = &session;
+  }
+  ~SessionScope() { bound_session = previous_; }
+
+  SessionScope(const SessionScope&) = delete;
+  SessionScope& operator=(const SessionScope&) = delete;
+
+ private:
+  Session* previous_;
+};
+
+// Statistics of the session the calling thread works for
+RunStats& current_stats();
+
+// Times the enclosing scope as one call of a stage
+class StageTimer {
+ public:
+  explicit StageTimer(Stage stage)
+      : stage_(stage), start_(std::chrono::steady_clock::now()) {}
+  ~StageTimer() {
+    current_stats().record(stage_, std::chrono::steady_clock::now() - start_);
+  }
+
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+ private:
+  Stage stage_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Bytes a thread formats before waking the writer
+constexpr std::size_t kLogBufferSize = 64 * 1024;
+
+// Longest a message waits in a thread buffer before it is written
+constexpr std::chrono::milliseconds kLogFlushInterval(100);
+
+// A named value attached to a log message. Values are referenced, not
+// copied, so they only need to live until log() returns.
+struct LogField {
+  enum class Kind { kText, kPath, kNumber };
+
+  LogField(std::string_view key, std::string_view text)
+      : key(key), kind(Kind::kText), text(text) {}
+  LogField(std::string_view key, const char* text)
+      : LogField(key, std::string_view(text)) {}
+  LogField(std::string_view key, const std::string& text)
+      : LogField(key, std::string_view(text)) {}
+  LogField(std::string_view key, const fs::path& path)
+      : key(key), kind(Kind::kPath), path(&path) {}
+  LogField(std::string_view key, std::uint64_t number)
+      : key(key), kind(Kind::kNumber), number(number) {}
+
+  std::string_view key;
+  Kind kind;
+  std::string_view text;
+  const fs::path* path = nullptr;
+  std::uint64_t number = 0;
+};
+
+// Structured log sink. Workers format messages into their own buffers, and
+// a background thread collects the buffers and writes them in large blocks,
+// so logging never waits on the console or disk. There is one logger per
+// process; until start() is called it writes each message synchronously.
+class Logger {
+ public:
+  ~Logger() { stop(); }
+
+  // Start the background writer on a log file, or on stderr if the path is
+  // empty. Returns false if the file cannot be opened.
+  bool start(LogLevel level, LogFormat format, const std::string& path) {
+    stop();
+    std::FILE* out = stderr;
+    if (!path.empty()) {
+      out = std::fopen(path.c_str(), "ab");
+      if (out == nullptr) return false;
+    }
+    level_ = level;
+    format_ = format;
+    out_ = out;
+    stopping_ = false;
+    running_ = true;
+    writer_ = std::thread([this] { write_loop(); });
+    return true;
+  }
+
+  // Write out everything logged so far and stop the background writer
+  void stop() {
+    if (!running_) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    running_ = false;
+    if (out_ != stderr) std::fclose(out_);
+    out_ = stderr;
+  }
+
+  // Check if messages of a level are written
+  bool enabled(LogLevel level) const { return level <= level_; }
+
+  // Log an event with its fields
+  void log(LogLevel level, std::string_view event,
+           std::initializer_list<LogField> fields) {
+    if (level == LogLevel::kError) current_stats().add(Counter::kErrors);
+    if (!enabled(level)) return;
+    if (!running_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      thread_local std::string line;
+      line.clear();
+      format_message(line, level, event, fields);
+      std::fwrite(line.data(), 1, line.size(), out_);
+      return;
+    }
+
+    ThreadBuffer& buffer = thread_buffer();
+    bool wake;
+    {
+      std::lock_guard<std::mutex> lock(buffer.mutex);
+      format_message(buffer.text, level, event, fields);
+      wake = buffer.text.size() >= kLogBufferSize || level == LogLevel::kError;
+    }
+    if (wake) wake_.notify_one();
+  }
+
+ private:
+  struct ThreadBuffer {
+    std::mutex mutex;
+    std::string text;
+  };
+
+  // The calling thread's buffer, registered with the writer on first use.
+  // Buffers outlive their threads so nothing logged before exit is lost.
+  ThreadBuffer& thread_buffer() {
+    thread_local std::shared_ptr<ThreadBuffer> buffer;
+    if (!buffer) {
+      buffer = std::make_shared<ThreadBuffer>();
+      buffer->text.reserve(kLogBufferSize);
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffers_.push_back(buffer);
+    }
+    return *buffer;
+  }
+
+  // Collect every thread buffer when woken or once per flush interval
+  void write_loop() {
+    std::string block;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      wake_.wait_for(lock, kLogFlushInterval);
+      bool stopping = stopping_;
+      for (const auto& buffer : buffers_) {
+        std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+        block.append(buffer->text);
+        buffer->text.clear();
+      }
+      lock.unlock();
+      if (!block.empty()) {
+        std::fwrite(block.data(), 1, block.size(), out_);
+        std::fflush(out_);
+        block.clear();
+      }
+      lock.lock();
+      if (stopping) return;
+    }
+  }
+
+  // Append text as a JSON string literal
+  static void append_json(std::string& out, std::string_view text) {
+    static constexpr char kHex[] = "0123456789abcdef";
+    out.push_back('"');
+    for (char c : text) {
+      auto byte = static_cast<unsigned char>(c);
+      if (c == '"' || c == '\\') {
+        out.push_back('\\');
+        out.push_back(c);
+      } else if (byte < 0x20) {
+        out += "\\u00";
+        out.push_back(kHex[byte >> 4]);
+        out.push_back(kHex[byte & 0xF]);
+      } else {
+        out.push_back(c);
+      }
+    }
+    out.push_back('"');
+  }
+
+  // Append a text value, quoted only if it would not read back as one word
+  static void append_text(std::string& out, std::string_view text) {
+    bool plain = !text.empty() &&
+                 std::none_of(text.begin(), text.end(), [](char c) {
+                   return c == ' ' || c == '"' || c == '=' ||
+                          static_cast<unsigned char>(c) < 0x20;
+                 });
+    if (plain) {
+      out.append(text);
+    } else {
+      append_json(out, text);
+    }
+  }
+
+  // Format one message as a line in the configured format
+  void format_message(std::string& out, LogLevel level, std::string_view event,
+                      std::initializer_list<LogField> fields) const {
+    bool json = format_ == LogFormat::kJson;
+    const char* level_name = kLogLevelNames[static_cast<int>(level)];
+    if (json) {
+      out += "{\"level\":\"";
+      out += level_name;
+      out += "\",\"event\":";
+      append_json(out, event);
+    } else {
+      out += level_name;
+      out.push_back(' ');
+      out.append(event);
+    }
+
+    thread_local std::string path_text;
+    for (const LogField& field : fields) {
+      if (json) {
+        out += ",\"";
+        out.append(field.key);
+        out += "\":";
+      } else {
+        out.push_back(' ');
+        out.append(field.key);
+        out.push_back('=');
+      }
+      std::string_view value = field.text;
+      if (field.kind == LogField::Kind::kNumber) {
+        char digits[24];
+        auto result =
+            std::to_chars(digits, digits + sizeof(digits), field.number);
+        out.append(digits, result.ptr);
+        continue;
+      }
+      if (field.kind == LogField::Kind::kPath) {
+        path_text.clear();
+        append_utf8(path_text, field.path->native(), false);
+        value = path_text;
+      }
+      if (json) {
+        append_json(out, value);
+      } else {
+        append_text(out, value);
+      }
+    }
+    out += json ? "}\n" : "\n";
+  }
+
+  LogLevel level_ = LogLevel::kWarning;
+  LogFormat format_ = LogFormat::kText;
+  std::FILE* out_ = stderr;
+  std::atomic<bool> running_{false};
+  std::mutex mutex_;  // Guards buffers_ and stopping_
+  std::condition_variable wake_;
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+  bool stopping_ = false;
+  std::thread writer_;
+};
+
+// Log of the run, replacing direct console output from workers
+Logger logger;
+
+// Files with the same name land on the same destination, so deciding where
+// each of them goes is serialized through a fixed set of lock stripes keyed
+// by the lowercased name. Their transfers run in parallel.
+constexpr std::size_t kNameLockStripes = 64;
+using NameLocks = std::array<std::mutex, kNameLockStripes>;
+
+// Number of queued files allowed per worker before the walker blocks
+constexpr std::size_t kQueueDepthPerWorker = 64;
+
+// Fixed-size pool of worker threads consuming a task queue; the executor
+// of organizers that are not given one
+class WorkerPool : public Executor {
+ public:
+  explicit WorkerPool(unsigned worker_count) {
+    worker_count = std::max(worker_count, 1u);
+    threads_.reserve(worker_count);
+    for (unsigned i = 0; i < worker_count; ++i) {
+      threads_.emplace_back([this] { run(); });
+    }
+  }
+
+  ~WorkerPool() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    not_empty_.notify_all();
+    for (auto& thread : threads_) thread.join();
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  void execute(std::function<void()> task) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+    not_empty_.notify_one();
+  }
+
+  unsigned worker_count() const {
+    return static_cast<unsigned>(threads_.size());
+  }
+
+ private:
+  void run() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+        if (tasks_.empty()) return;
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::deque<std::function<void()>> tasks_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+// The tasks of one organizer on an executor that others may share. At most
+// capacity tasks wait, so a fast walker cannot queue a whole library, and
+// at most limit run at once: the group hands the executor up to limit
+// runners, each taking the group's tasks until none are left. Tasks run
+// bound to the organizer's session, and wait_idle waits only for them.
+class TaskGroup {
+ public:
+  TaskGroup(Executor& executor, Session& session, unsigned workers,
+            std::size_t capacity)
+      : executor_(executor),
+        session_(session),
+        workers_(std::max(workers, 1u)),
+        capacity_(std::max<std::size_t>(capacity, 1)),
+        limit_(workers_) {}
+
+  ~TaskGroup() { wait_idle(); }
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  // Queue a task, blocking while the queue is full
+  void submit(std::function<void()> task) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return tasks_.size() < capacity_; });
+    tasks_.push_back(std::move(task));
+    bool start = runners_ < limit_;
+    if (start) ++runners_;
+    lock.unlock();
+    if (start) executor_.execute([this] { run(); });
+  }
+
+  // Block until every submitted task has finished
+  void wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return tasks_.empty() && runners_ == 0; });
+  }
+
+  // Let at most limit tasks run at once; 0 allows one per worker. Runners
+  // over a lowered limit finish their current task first.
+  void set_limit(unsigned limit) {
+    std::size_t start = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      limit_ = limit == 0 ? workers_ : std::min(limit, workers_);
+      if (runners_ < limit_) {
+        start = std::min<std::size_t>(limit_ - runners_, tasks_.size());
+      }
+      runners_ += start;
+    }
+    for (std::size_t i = 0; i < start; ++i) {
+      executor_.execute([this] { run(); });
+    }
+  }
+
+ private:
+  void run() {
+    SessionScope scope(session_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!tasks_.empty() && runners_ <= limit_) {
+      std::function<void()> task = std::move(tasks_.front());
+      tasks_.pop_front();
+      lock.unlock();
+      not_full_.notify_one();
+
+      try {
+        task();
+      } catch (const std::exception& e) {
+        logger.log(LogLevel::kError, "worker-failed", {{"error", e.what()}});
+      }
+      lock.lock();
+    }
+    if (--runners_ == 0 && tasks_.empty()) idle_.notify_all();
+  }
+
+  Executor& executor_;
+  Session& session_;
+  const unsigned workers_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable idle_;
+  std::deque<std::function<void()>> tasks_;
+  std::size_t capacity_;
+  std::size_t runners_ = 0;  // Runners handed to the executor
+  std::size_t limit_;        // Runners allowed at once
+};
+
+// Number of copy workers used when none is requested
+unsigned default_worker_count() {
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// Convert a string to lowercase, folding ASCII letters only so the result
+// does not depend on the locale and UTF-8 passes unchanged
+std::string to_lower(const std::string& str) {
+  std::string lower_str;
+  append_lower(lower_str, str);
+  return lower_str;
+}
+
+// Check if a file with this lowercased name has already been processed
+bool file_already_processed(const ShardedNameSet& processed_files,
+                            std::string_view lower_filename,
+                            std::uint64_t name_hash) {
+  return processed_files.contains(lower_filename, name_hash);
+}
+
+// Record a file name as processed
+void mark_file_processed(ShardedNameSet& processed_files,
+                         std::string_view lower_filename,
+                         std::uint64_t name_hash) {
+  processed_files.insert(lower_filename, name_hash);
+}
+
+// Append an index to a filename
+fs::path append_index_to_filename(const fs::path& filename, int index) {
+  fs::path indexed = filename.stem();
+  indexed += "_" + std::to_string(index);
+  indexed += filename.extension();
+  return indexed;
+}
+
+#ifdef _WIN32
+// Clone a file with ReFS block cloning. Returns false when the volume does
+// not support it.
+bool reflink_file(const fs::path& source, const fs::path& destination) {
+  HANDLE src = CreateFileW(source.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                           nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                           nullptr);
+  if (src == INVALID_HANDLE_VALUE) return false;
+
+  DWORD volume_flags = 0;
+  DWORD returned = 0;
+  FILE_STANDARD_INFO standard_info;
+  FILE_BASIC_INFO basic_info;
+  FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity;
+  bool ok = GetVolumeInformationByHandleW(src, nullptr, 0, nullptr, nullptr,
+                                          &volume_flags, nullptr, 0) &&
+            (volume_flags & FILE_SUPPORTS_BLOCK_REFCOUNTING) &&
+            GetFileInformationByHandleEx(src, FileStandardInfo, &standard_info,
+                                         sizeof(standard_info)) &&
+            GetFileInformationByHandleEx(src, FileBasicInfo, &basic_info,
+                                         sizeof(basic_info)) &&
+            DeviceIoControl(src, FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0,
+                            &integrity, sizeof(integrity), &returned, nullptr);
+  if (!ok) {
+    CloseHandle(src);
+    return false;
+  }
+
+  HANDLE dst = CreateFileW(destination.c_str(),
+                           GENERIC_READ | GENERIC_WRITE | DELETE, 0, nullptr,
+                           CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (dst == INVALID_HANDLE_VALUE) {
+    CloseHandle(src);
+    return false;
+  }
+
+  // The clone target must match the source's sparseness, integrity settings
+  // and length before extents can be shared
+  if (basic_info.FileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) {
+    ok = DeviceIoControl(dst, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0,
+                         &returned, nullptr);
+  }
+  FSCTL_SET_INTEGRITY_INFORMATION_BUFFER set_integrity = {
+      integrity.ChecksumAlgorithm, 0, integrity.Flags};
+  FILE_END_OF_FILE_INFO end_of_file = {standard_info.EndOfFile};
+  ok = ok &&
+       DeviceIoControl(dst, FSCTL_SET_INTEGRITY_INFORMATION, &set_integrity,
+                       sizeof(set_integrity), nullptr, 0, &returned,
+                       nullptr) &&
+       SetFileInformationByHandle(dst, FileEndOfFileInfo, &end_of_file,
+                                  sizeof(end_of_file));
+
+  // Clone in cluster-aligned chunks below the 4 GB per-call limit
+  const LONGLONG cluster = integrity.ClusterSizeInBytes;
+  const LONGLONG chunk = LONGLONG{1} << 31;
+  const LONGLONG length = standard_info.EndOfFile.QuadPart;
+  for (LONGLONG offset = 0; ok && offset < length; offset += chunk) {
+    LONGLONG count = std::min(length - offset, chunk);
+    DUPLICATE_EXTENTS_DATA extents;
+    extents.FileHandle = src;
+    extents.SourceFileOffset.QuadPart = offset;
+    extents.TargetFileOffset.QuadPart = offset;
+    extents.ByteCount.QuadPart = (count + cluster - 1) / cluster * cluster;
+    ok = DeviceIoControl(dst, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents,
+                         sizeof(extents), nullptr, 0, &returned, nullptr);
+  }
+
+  if (!ok) {
+    FILE_DISPOSITION_INFO dispose = {TRUE};
+    SetFileInformationByHandle(dst, FileDispositionInfo, &dispose,
+                               sizeof(dispose));
+  }
+  CloseHandle(dst);
+  CloseHandle(src);
+  return ok;
+}
+#elif defined(__APPLE__)
+// Clone a file with APFS clonefile. Returns false when the volume does not
+// support it.
+bool reflink_file(const fs::path& source, const fs::path& destination) {
+  return clonefile(source.c_str(), destination.c_str(), 0) == 0;
+}
+#elif defined(FICLONE)
+// Clone a file with the FICLONE ioctl (Btrfs, XFS, bcachefs). Returns false
+// when the file system does not support it.
+bool reflink_file(const fs::path& source, const fs::path& destination) {
+  int src = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src < 0) return false;
+
+  struct stat info;
+  int dst = -1;
+  if (fstat(src, &info) == 0) {
+    dst = open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+               info.st_mode & 07777);
+  }
+  if (dst < 0) {
+    close(src);
+    return false;
+  }
+
+  bool ok = ioctl(dst, FICLONE, src) == 0;
+  close(dst);
+  close(src);
+  if (!ok) unlink(destination.c_str());
+  return ok;
+}
+#else
+bool reflink_file(const fs::path&, const fs::path&) { return false; }
+#endif
+
+// Files at least this large get their whole size allocated before the copy,
+// so the file system can lay them out in few extents
+constexpr std::uint64_t kPreallocateThreshold = 1 << 20;
+
+// Files at least this large bypass the system cache where the platform
+// allows; a long stem copied once would only push out the cache
+constexpr std::uint64_t kUnbufferedCopyThreshold = std::uint64_t{64} << 20;
+
+// Bytes moved per copy call when no chunk size is configured: small files
+// in one call, large ones in chunks big enough to keep the disk streaming
+constexpr std::size_t kSmallCopyChunk = 1 << 20;
+constexpr std::size_t kLargeCopyChunk = 16 << 20;
+
+// Bytes to move per copy call for a file of the given size
+std::size_t copy_chunk_size(std::uint64_t file_size, std::size_t configured) {
+  if (configured != 0) return configured;
+  return file_size < kUnbufferedCopyThreshold ? kSmallCopyChunk
+                                              : kLargeCopyChunk;
+}
+
+// Unused budget a token bucket saves up, as time at its rate
+constexpr double kThrottleBurstSeconds = 0.5;
+
+// Rate limit shared by every worker. A take that overdraws the budget
+// sleeps until it is paid back, so concurrent workers together stay at the
+// rate whatever amounts they take at a time.
+class TokenBucket {
+ public:
+  // Allow rate units per second from now on; 0 lifts the limit
+  void set_rate(double rate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    rate_ = std::max(rate, 0.0);
+    tokens_ = std::min(tokens_, rate_ * kThrottleBurstSeconds);
+    last_ = std::chrono::steady_clock::now();
+    limited_.store(rate_ > 0, std::memory_order_relaxed);
+  }
+
+  bool limited() const { return limited_.load(std::memory_order_relaxed); }
+
+  // Take amount units of the budget, sleeping while it is overdrawn
+  void take(double amount) {
+    if (!limited()) return;
+    double wait = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (rate_ <= 0) return;
+      auto now = std::chrono::steady_clock::now();
+      double elapsed = std::chrono::duration<double>(now - last_).count();
+      last_ = now;
+      tokens_ = std::min(tokens_ + elapsed * rate_,
+                         rate_ * kThrottleBurstSeconds) -
+                amount;
+      if (tokens_ < 0) wait = -tokens_ / rate_;
+    }
+    if (wait > 0) {
+      std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  std::atomic<bool> limited_{false};
+  double rate_ = 0;
+  double tokens_ = 0;
+  std::chrono::steady_clock::time_point last_;
+};
+
+// Budgets of a run, set by --max-rate and --max-files or a control file.
+// Copies take bytes as they go; every file placed takes one file.
+struct Throttle {
+  TokenBucket bytes;
+  TokenBucket files;
+};
+
+// The copy pipeline stages reads through one aligned ring of this size, in
+// reads and writes of up to kPipelineChunk. Writes start once the ring is
+// full or the reader runs out of work, so a spinning disk sees long runs of
+// reads and of writes instead of a seek between every chunk.
+constexpr std::size_t kPipelineCapacity = 32 << 20;
+constexpr std::size_t kPipelineChunk = 4 << 20;
+constexpr std::size_t kPipelineAlignment = 4096;
+
+// Position of a file on its volume as far as its ID tells. Inode numbers
+// roughly follow the disk layout; of an NTFS file reference only the low 48
+// bits, the MFT record, do, while the top 16 count reuses of the record.
+inline std::uint64_t disk_locality(std::uint64_t file_id) {
+#ifdef _WIN32
+  return file_id & 0xFFFFFFFFFFFFull;
+#else
+  return file_id;
+#endif
+}
+
+#ifdef _WIN32
+using NativeFile = HANDLE;
+#else
+using NativeFile = int;
+#endif
+
+// Read up to size bytes at offset. Returns the count, which is short only at
+// the end of the file or on an error.
+std::size_t read_at(NativeFile file, char* data, std::size_t size,
+                    std::uint64_t offset, std::error_code& error) {
+  std::size_t done = 0;
+  while (done < size) {
+    current_stats().add(Counter::kSyscalls);
+#ifdef _WIN32
+    OVERLAPPED position = {};
+    position.Offset = static_cast<DWORD>(offset + done);
+    position.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+    DWORD moved = 0;
+    if (!ReadFile(file, data + done, static_cast<DWORD>(size - done), &moved,
+                  &position)) {
+      DWORD code = GetLastError();
+      if (code != ERROR_HANDLE_EOF) {
+        error.assign(static_cast<int>(code), std::system_category());
+      }
+      break;
+    }
+#else
+    ssize_t moved = pread(file, data + done, size - done,
+                          static_cast<off_t>(offset + done));
+    if (moved < 0) {
+      if (errno == EINTR) continue;
+      error.assign(errno, std::generic_category());
+      break;
+    }
+#endif
+    if (moved == 0) break;
+    done += static_cast<std::size_t>(moved);
+  }
+  return done;
+}
+
+// Write size bytes at offset
+void write_at(NativeFile file, const char* data, std::size_t size,
+              std::uint64_t offset, std::error_code& error) {
+  std::size_t done = 0;
+  while (done < size) {
+    current_stats().add(Counter::kSyscalls);
+#ifdef _WIN32
+    OVERLAPPED position = {};
+    position.Offset = static_cast<DWORD>(offset + done);
+    position.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+    DWORD moved = 0;
+    if (!WriteFile(file, data + done, static_cast<DWORD>(size - done), &moved,
+                   &position)) {
+      error.assign(static_cast<int>(GetLastError()), std::system_category());
+      return;
+    }
+#else
+    ssize_t moved = pwrite(file, data + done, size - done,
+                           static_cast<off_t>(offset + done));
+    if (moved < 0) {
+      if (errno == EINTR) continue;
+      error.assign(errno, std::generic_category());
+      return;
+    }
+#endif
+    done += static_cast<std::size_t>(moved);
+  }
+}
+
+// Copy engine with one reader and one writer thread sharing a fixed ring of
+// aligned memory. Workers hand it open files and wait; the reader takes
+// their requests in order of on-disk location and reads ahead into the ring
+// while the writer drains earlier data to the destinations, so the reads of
+// the next file overlap the writes of the current one.
+class CopyPipeline {
+ public:
+  ~CopyPipeline() { stop(); }
+
+  // Allocate the ring and start both threads, which count into session
+  void start(Session& session) {
+    if (running()) return;
+    ring_ = static_cast<char*>(::operator new(
+        kPipelineCapacity, std::align_val_t{kPipelineAlignment}));
+    head_ = tail_ = 0;
+    stopping_ = reader_idle_ = reader_exited_ = false;
+    reader_ = std::thread([this, &session] {
+      SessionScope scope(session);
+      read_loop();
+    });
+    writer_ = std::thread([this, &session] {
+      SessionScope scope(session);
+      write_loop();
+    });
+  }
+
+  // Finish every request already handed in, then stop both threads
+  void stop() {
+    if (!running()) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    reader_wake_.notify_one();
+    reader_.join();
+    writer_.join();
+    ::operator delete(ring_, std::align_val_t{kPipelineAlignment});
+    ring_ = nullptr;
+  }
+
+  bool running() const { return reader_.joinable(); }
+
+  // Copy size bytes from in to out, taking what is read from budget.
+  // Requests waiting for the reader are taken in order of locality, the
+  // file's inode or file index. Blocks until everything read has been
+  // written and stores that count in copied.
+  std::error_code copy(NativeFile in, NativeFile out, std::uint64_t size,
+                       std::uint64_t locality, TokenBucket& budget,
+                       std::uint64_t& copied) {
+    Request request{in, out, size, locality, &budget, 0, {}, {}, false};
+    std::unique_lock<std::mutex> lock(mutex_);
+    pending_.push_back(&request);
+    reader_wake_.notify_one();
+    done_wake_.wait(lock, [&] { return request.done; });
+    copied = request.written;
+    return request.write_error ? request.write_error : request.read_error;
+  }
+
+ private:
+  struct Request {
+    NativeFile in;
+    NativeFile out;
+    std::uint64_t size;
+    std::uint64_t locality;
+    TokenBucket* budget;
+    std::uint64_t written = 0;   // Owned by the writer
+    std::error_code read_error;  // Set before the last block is queued
+    std::error_code write_error;  // Owned by the writer
+    bool done = false;
+  };
+
+  // A run of one file's bytes staged in the ring
+  struct Block {
+    Request* request;
+    std::uint64_t start;   // Ring position of the data
+    std::uint64_t end;     // Ring position after it and its padding
+    std::uint64_t offset;  // Position in the file
+    std::size_t length;
+    bool last;             // Final block of the request
+  };
+
+  void read_loop() {
+    std::uint64_t position = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      reader_idle_ = true;
+      writer_wake_.notify_one();
+      reader_wake_.wait(lock, [&] { return stopping_ || !pending_.empty(); });
+      if (pending_.empty()) break;
+      reader_idle_ = false;
+
+      // Sweep upwards through the waiting requests, then start over at the
+      // lowest, like a disk elevator
+      auto next = std::min_element(
+          pending_.begin(), pending_.end(),
+          [position](const Request* a, const Request* b) {
+            return std::pair(a->locality < position, a->locality) <
+                   std::pair(b->locality < position, b->locality);
+          });
+      Request* request = *next;
+      pending_.erase(next);
+      position = request->locality;
+
+      std::uint64_t offset = 0;
+      for (bool last = false; !last;) {
+        std::size_t room;
+        reader_wake_.wait(lock, [&] {
+          room = static_cast<std::size_t>(
+              std::min(kPipelineCapacity - (head_ - tail_),
+                       kPipelineCapacity - head_ % kPipelineCapacity));
+          reader_waiting_ = room == 0;
+          if (reader_waiting_) writer_wake_.notify_one();
+          return room != 0;
+        });
+        std::uint64_t start = head_;
+        auto want = static_cast<std::size_t>(std::min<std::uint64_t>(
+            {request->size - offset, kPipelineChunk, room}));
+        lock.unlock();
+        request->budget->take(static_cast<double>(want));
+        std::error_code error;
+        std::size_t length =
+            read_at(request->in, ring_ + start % kPipelineCapacity, want,
+                    offset, error);
+        lock.lock();
+
+        // Keep every block aligned in the ring
+        head_ = start + (length + kPipelineAlignment - 1) /
+                            kPipelineAlignment * kPipelineAlignment;
+        head_ = std::min(head_, start + room);
+        last = error || length < want || offset + length == request->size;
+        if (error) request->read_error = error;
+        queued_.push_back({request, start, head_, offset, length, last});
+        offset += length;
+      }
+    }
+    reader_exited_ = true;
+    writer_wake_.notify_one();
+  }
+
+  void write_loop() {
+    std::vector<Block> batch;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      writer_wake_.wait(lock, [&] {
+        return reader_exited_ ||
+               (!queued_.empty() && (reader_idle_ || reader_waiting_ ||
+                                     head_ - tail_ == kPipelineCapacity));
+      });
+      if (queued_.empty()) break;  // Only once the reader has exited
+      batch.swap(queued_);
+      lock.unlock();
+
+      for (std::size_t i = 0; i < batch.size(); ++i) {
+        Block& block = batch[i];
+        Request& request = *block.request;
+        if (!request.write_error && block.length > 0) {
+          write_at(request.out, ring_ + block.start % kPipelineCapacity,
+                   block.length, block.offset, request.write_error);
+          if (!request.write_error) request.written += block.length;
+        }
+
+        // Hand the space back right away so the reader keeps going
+        lock.lock();
+        tail_ = block.end;
+        if (block.last) {
+          request.done = true;
+          done_wake_.notify_all();
+        }
+        reader_wake_.notify_one();
+        lock.unlock();
+      }
+      batch.clear();
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable reader_wake_;
+  std::condition_variable writer_wake_;
+  std::condition_variable done_wake_;
+  std::vector<Request*> pending_;  // Waiting for the reader
+  std::vector<Block> queued_;      // Read, waiting for the writer
+  char* ring_ = nullptr;
+  std::uint64_t head_ = 0;  // Ring positions; the reader fills from head_
+  std::uint64_t tail_ = 0;  // and the writer frees up to tail_
+  bool stopping_ = false;
+  bool reader_idle_ = false;
+  bool reader_waiting_ = false;  // Reader is blocked on a full ring
+  bool reader_exited_ = false;
+  std::thread reader_;
+  std::thread writer_;
+};
+
+// What the threads of one organizer share while it runs: statistics,
+// budgets and the copy pipeline. Code deep inside a run reaches it through
+// the SessionScope of the calling thread, so organizers running side by
+// side in one process never mix their counters or budgets.
+struct Session {
+  RunStats stats;
+  Throttle throttle;
+  CopyPipeline pipeline;  // Running with OrganizeOptions::pipeline
+};
+
+// Session of the calling thread. Work outside any organizer, such as the
+// separate stages of the benchmark, counts into a session of its own.
+Session& current_session() {
+  if (bound_session != nullptr) return *bound_session;
+  static Session unbound;
+  return unbound;
+}
+
+RunStats& current_stats() { return current_session().stats; }
+
+#ifdef _WIN32
+// Copy a file through the copy pipeline, preallocating the destination
+// and carrying over the modification time the way CopyFileExW does
+void copy_file_through_pipeline(const fs::path& source,
+                                const fs::path& destination) {
+  auto fail = [&](const char* what, DWORD error) {
+    throw fs::filesystem_error(
+        what, source, destination,
+        std::error_code(static_cast<int>(error), std::system_category()));
+  };
+
+  HANDLE in = CreateFileW(source.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                          nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                          nullptr);
+  if (in == INVALID_HANDLE_VALUE) fail("cannot open source", GetLastError());
+  BY_HANDLE_FILE_INFORMATION info;
+  if (!GetFileInformationByHandle(in, &info)) {
+    DWORD error = GetLastError();
+    CloseHandle(in);
+    fail("cannot read source", error);
+  }
+  HANDLE out = CreateFileW(destination.c_str(), GENERIC_WRITE, 0, nullptr,
+                           CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (out == INVALID_HANDLE_VALUE) {
+    DWORD error = GetLastError();
+    CloseHandle(in);
+    fail("cannot create destination", error);
+  }
+  // Two opens, the query and two closes
+  current_stats().add(Counter::kSyscalls, 5);
+
+  std::uint64_t size =
+      (std::uint64_t{info.nFileSizeHigh} << 32) | info.nFileSizeLow;
+  if (size >= kPreallocateThreshold) {
+    // Best effort; the allocation past the data written is freed on close
+    FILE_ALLOCATION_INFO allocation;
+    allocation.AllocationSize.QuadPart = static_cast<LONGLONG>(size);
+    current_stats().add(Counter::kSyscalls);
+    SetFileInformationByHandle(out, FileAllocationInfo, &allocation,
+                               sizeof(allocation));
+  }
+
+  std::uint64_t copied = 0;
+  std::uint64_t locality = disk_locality(
+      (std::uint64_t{info.nFileIndexHigh} << 32) | info.nFileIndexLow);
+  std::error_code error = current_session().pipeline.copy(
+      in, out, size, locality, current_session().throttle.bytes, copied);
+  current_stats().add(Counter::kSyscalls);
+  SetFileTime(out, nullptr, nullptr, &info.ftLastWriteTime);
+  if (!CloseHandle(out) && !error) {
+    error.assign(static_cast<int>(GetLastError()), std::system_category());
+  }
+  CloseHandle(in);
+  if (error) {
+    DeleteFileW(destination.c_str());
+    fail("cannot copy", static_cast<DWORD>(error.value()));
+  }
+}
+
+// Progress callback of CopyFileExW that takes what was copied since the
+// last call from the byte budget, pausing the copy while it is overdrawn
+DWORD CALLBACK take_copied_bytes(LARGE_INTEGER, LARGE_INTEGER transferred,
+                                 LARGE_INTEGER, LARGE_INTEGER, DWORD, DWORD,
+                                 HANDLE, HANDLE, LPVOID data) {
+  auto* taken = static_cast<std::uint64_t*>(data);
+  auto copied = static_cast<std::uint64_t>(transferred.QuadPart);
+  current_session().throttle.bytes.take(static_cast<double>(copied - *taken));
+  *taken = copied;
+  return PROGRESS_CONTINUE;
+}
+
+// Copy a file with CopyFileExW, unbuffered for large files, or through the
+// copy pipeline when it runs. CopyFileExW sets the destination's size
+// before writing, so it needs no preallocation, and picks its own chunk
+// size.
+void copy_file_contents(const fs::path& source, const fs::path& destination,
+                        std::size_t) {
+  Session& session = current_session();
+  if (session.pipeline.running()) {
+    copy_file_through_pipeline(source, destination);
+    return;
+  }
+  WIN32_FILE_ATTRIBUTE_DATA attributes;
+  DWORD flags = COPY_FILE_FAIL_IF_EXISTS;
+  if (GetFileAttributesExW(source.c_str(), GetFileExInfoStandard,
+                           &attributes) &&
+      ((std::uint64_t{attributes.nFileSizeHigh} << 32) |
+       attributes.nFileSizeLow) >= kUnbufferedCopyThreshold) {
+    flags |= COPY_FILE_NO_BUFFERING;
+  }
+  current_stats().add(Counter::kSyscalls, 2);
+  std::uint64_t taken = 0;
+  if (!CopyFileExW(source.c_str(), destination.c_str(),
+                   session.throttle.bytes.limited() ? take_copied_bytes
+                                                    : nullptr,
+                   &taken, nullptr, flags)) {
+    throw fs::filesystem_error(
+        "cannot copy", source, destination,
+        std::error_code(static_cast<int>(GetLastError()),
+                        std::system_category()));
+  }
+}
+#elif defined(__linux__)
+// Copy a file inside the kernel with copy_file_range, falling back to
+// sendfile and then to a read/write loop where a file system or kernel
+// does not support it, or through the copy pipeline when it runs. Large
+// destinations are preallocated with fallocate.
+void copy_file_contents(const fs::path& source, const fs::path& destination,
+                        std::size_t chunk_size) {
+  auto fail = [&](const char* what, int error) {
+    throw fs::filesystem_error(what, source, destination,
+                               std::error_code(error, std::generic_category()));
+  };
+
+  int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) fail("cannot open source", errno);
+  struct stat info;
+  if (fstat(in, &info) != 0) {
+    int error = errno;
+    close(in);
+    fail("cannot read source", error);
+  }
+  int out = open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                 info.st_mode & 07777);
+  if (out < 0) {
+    int error = errno;
+    close(in);
+    fail("cannot create destination", error);
+  }
+  // Two opens, fstat and two closes
+  current_stats().add(Counter::kSyscalls, 5);
+
+  auto size = static_cast<std::uint64_t>(info.st_size);
+  if (size >= kPreallocateThreshold) {
+    // Best effort; file systems without fallocate simply grow the file
+    current_stats().add(Counter::kSyscalls);
+    fallocate(out, 0, 0, static_cast<off_t>(size));
+  }
+
+  std::uint64_t copied = 0;
+  int error = 0;
+  Session& session = current_session();
+  if (session.pipeline.running()) {
+    error = session.pipeline
+                .copy(in, out, size, disk_locality(info.st_ino),
+                      session.throttle.bytes, copied)
+                .value();
+  } else {
+    enum class Method { kCopyRange, kSendfile, kReadWrite };
+    Method method = Method::kCopyRange;
+    std::size_t chunk = copy_chunk_size(size, chunk_size);
+    thread_local std::vector<char> buffer;
+    while (copied < size) {
+      auto want = static_cast<std::size_t>(
+          std::min<std::uint64_t>(chunk, size - copied));
+      session.throttle.bytes.take(static_cast<double>(want));
+      ssize_t moved;
+      current_stats().add(Counter::kSyscalls);
+      if (method == Method::kCopyRange) {
+        moved = copy_file_range(in, nullptr, out, nullptr, want, 0);
+        if (moved < 0 && copied == 0 &&
+            (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+             errno == EINVAL)) {
+          method = Method::kSendfile;
+          continue;
+        }
+      } else if (method == Method::kSendfile) {
+        moved = sendfile(out, in, nullptr, want);
+        if (moved < 0 && copied == 0 && (errno == EINVAL || errno == ENOSYS)) {
+          method = Method::kReadWrite;
+          continue;
+        }
+      } else {
+        buffer.resize(std::max(buffer.size(), want));
+        moved = read(in, buffer.data(), want);
+        for (ssize_t written = 0; moved > 0 && written < moved;) {
+          current_stats().add(Counter::kSyscalls);
+          ssize_t result = write(out, buffer.data() + written,
+                                 static_cast<std::size_t>(moved - written));
+          if (result < 0 && errno != EINTR) {
+            moved = -1;
+            break;
+          }
+          if (result > 0) written += result;
+        }
+      }
+      if (moved < 0) {
+        if (errno == EINTR) continue;
+        error = errno;
+        break;
+      }
+      if (moved == 0) {
+        // Some file systems report the end early through the in-kernel calls;
+        // only read() is trusted to mean the source shrank while copying
+        if (method == Method::kReadWrite) break;
+        method = Method::kReadWrite;
+        continue;
+      }
+      copied += static_cast<std::uint64_t>(moved);
+    }
+  }
+
+  // A preallocated file is as long as the source was when the copy started
+  if (error == 0 && copied < size &&
+      ftruncate(out, static_cast<off_t>(copied)) != 0) {
+    error = errno;
+  }
+  if (close(out) != 0 && error == 0) error = errno;
+  close(in);
+  if (error != 0) {
+    unlink(destination.c_str());
+    fail("cannot copy", error);
+  }
+}
+#else
+// Copy a file with the standard library, which uses copyfile on macOS
+void copy_file_contents(const fs::path& source, const fs::path& destination,
+                        std::size_t) {
+  TokenBucket& budget = current_session().throttle.bytes;
+  if (budget.limited()) {
+    current_stats().add(Counter::kSyscalls);
+    budget.take(static_cast<double>(fs::file_size(source)));
+  }
+  current_stats().add(Counter::kSyscalls);
+  fs::copy_file(source, destination);
+}
+#endif
+
+// Place a file at its destination using the requested mode. Renames, links
+// and clones only work within one volume, so each falls back to a copy
+// (followed by removing the source for a move). Returns the mode that was
+// actually used. Copies move chunk_size bytes per call, or an amount chosen
+// by file size if it is 0.
+TransferMode transfer_file(const fs::path& source,
+                           const fs::path& destination, TransferMode mode,
+                           std::size_t chunk_size) {
+  std::error_code error;
+  if (mode != TransferMode::kCopy) current_stats().add(Counter::kSyscalls);
+  switch (mode) {
+    case TransferMode::kMove:
+      fs::rename(source, destination, error);
+      if (error) {
+        copy_file_contents(source, destination, chunk_size);
+        current_stats().add(Counter::kSyscalls);
+        fs::remove(source);
+      }
+      return TransferMode::kMove;
+    case TransferMode::kHardlink:
+      fs::create_hard_link(source, destination, error);
+      if (!error) return TransferMode::kHardlink;
+      break;
+    case TransferMode::kReflink:
+      if (reflink_file(source, destination)) return TransferMode::kReflink;
+      break;
+    case TransferMode::kCopy:
+      break;
+  }
+  copy_file_contents(source, destination, chunk_size);
+  return TransferMode::kCopy;
+}
+
+// Log information about a file move
+void print_file_move_info(const fs::path& source, const fs::path& destination,
+                          TransferMode mode) {
+  logger.log(LogLevel::kInfo, "transferred",
+             {{"mode", kTransferModeNames[static_cast<int>(mode)]},
+              {"source", source},
+              {"destination", destination}});
+}
+
+// A destination folder and the filename keywords that select it. When
+// several categories match, the one with the highest priority wins.
+struct Category {
+  std::string path;
+  std::vector<std::string> keywords;
+  int priority = 0;
+};
+
+// A built-in category, with its keywords separated by spaces as in a rules
+// file
+struct BuiltInCategory {
+  std::string_view path;
+  std::string_view keywords;
+  int priority;
+};
+
+// Built-in categories used when no rules file is present, in priority order
+// like compiled rules. The last one, without keywords, catches everything
+// else.
+constexpr std::array<BuiltInCategory, 8> kBuiltInCategories = {{
+    {"Drums/808", "808", 80},
+    {"Drums/Snare", "snare _snr snr_", 70},
+    {"Drums/Kick", "kick _kck kck_", 60},
+    {"Drums/Clap", "clap _clp clp_", 50},
+    {"Drums/Hat", "hat ht_ _ht", 40},
+    {"Drums/Other", "drum _drm drm_", 30},
+    {"Other/Loop", "loop", 20},
+    {"Other/Other", "", 0},
+}};
+
+// Call fn with each keyword of a built-in category
+template <typename Fn>
+constexpr void for_each_keyword(std::string_view keywords, Fn fn) {
+  while (!keywords.empty()) {
+    std::size_t end = std::min(keywords.find(' '), keywords.size());
+    if (end > 0) fn(keywords.substr(0, end));
+    keywords.remove_prefix(std::min(end + 1, keywords.size()));
+  }
+}
+
+// Check that built-in categories are in the order compile_rules would put
+// them in, with lowercase keywords and only the last one without any
+template <std::size_t N>
+consteval bool built_in_categories_valid(
+    const std::array<BuiltInCategory, N>& categories) {
+  for (std::size_t i = 0; i < N; ++i) {
+    bool has_keywords = false;
+    bool lowercase = true;
+    for_each_keyword(categories[i].keywords, [&](std::string_view keyword) {
+      has_keywords = true;
+      for (char c : keyword) lowercase = lowercase && !(c >= 'A' && c <= 'Z');
+    });
+    if (!lowercase || has_keywords != (i + 1 < N)) return false;
+    if (i > 0 && categories[i].priority > categories[i - 1].priority) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static_assert(built_in_categories_valid(kBuiltInCategories));
+
+// Number of keyword trie states: the root and one per distinct keyword
+// prefix
+template <std::size_t N>
+consteval std::size_t trie_state_count(
+    const std::array<BuiltInCategory, N>& categories) {
+  std::size_t count = 1;
+  std::size_t position = 0;
+  for (const auto& category : categories) {
+    for_each_keyword(category.keywords, [&](std::string_view keyword) {
+      for (std::size_t length = 1; length <= keyword.size(); ++length) {
+        // Counted already if an earlier keyword starts the same way
+        std::string_view prefix = keyword.substr(0, length);
+        bool seen = false;
+        std::size_t earlier = 0;
+        for (const auto& other : categories) {
+          for_each_keyword(other.keywords, [&](std::string_view candidate) {
+            if (earlier++ < position && candidate.starts_with(prefix)) {
+              seen = true;
+            }
+          });
+        }
+        if (!seen) ++count;
+      }
+      ++position;
+    });
+  }
+  return count;
+}
+
+// Number of byte classes: one per byte used in a keyword, and one for the
+// rest
+template <std::size_t N>
+consteval std::size_t byte_class_count(
+    const std::array<BuiltInCategory, N>& categories) {
+  std::array<bool, 256> used{};
+  std::size_t count = 1;
+  for (const auto& category : categories) {
+    for_each_keyword(category.keywords, [&](std::string_view keyword) {
+      for (unsigned char c : keyword) {
+        if (!used[c]) ++count;
+        used[c] = true;
+      }
+    });
+  }
+  return count;
+}
+
+// Identifies the compiled rules cache and its layout version
+constexpr std::uint32_t kRulesCacheMagic = 0x524C5053;  // "SPLR"
+constexpr std::uint32_t kRulesCacheVersion = 1;
+
+// Write a trivially copyable value to a binary stream
+template <typename T>
+void write_pod(std::ostream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Read a trivially copyable value from a binary stream
+template <typename T>
+bool read_pod(std::istream& in, T& value) {
+  return static_cast<bool>(
+      in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+// Write a length-prefixed vector of trivially copyable values
+template <typename T>
+void write_vector(std::ostream& out, const std::vector<T>& values) {
+  write_pod(out, static_cast<std::uint64_t>(values.size()));
+  out.write(reinterpret_cast<const char*>(values.data()),
+            static_cast<std::streamsize>(values.size() * sizeof(T)));
+}
+
+// Read a length-prefixed vector, refusing lengths above max_size
+template <typename T>
+bool read_vector(std::istream& in, std::vector<T>& values,
+                 std::uint64_t max_size) {
+  std::uint64_t size;
+  if (!read_pod(in, size) || size > max_size) return false;
+  values.resize(static_cast<std::size_t>(size));
+  return static_cast<bool>(
+      in.read(reinterpret_cast<char*>(values.data()),
+              static_cast<std::streamsize>(size * sizeof(T))));
+}
+
+// Aho-Corasick automaton over every category keyword. Bytes are mapped to
+// equivalence classes and the failure links are folded into a dense
+// transition table, so classifying a filename is one table lookup per byte.
+class KeywordMatcher {
+ public:
+  explicit KeywordMatcher(const std::vector<Category>& categories)
+      : fallback_(static_cast<std::uint32_t>(categories.size() - 1)) {
+    // Every byte that appears in a keyword gets its own class, the rest
+    // share class 0
+    byte_class_.fill(0);
+    class_count_ = 1;
+    for (const auto& category : categories) {
+      for (const auto& keyword : category.keywords) {
+        for (unsigned char c : keyword) {
+          if (byte_class_[c] == 0) byte_class_[c] = class_count_++;
+        }
+      }
+    }
+
+    // Build the keyword trie; each state remembers the best category ending
+    // there
+    std::vector<std::vector<std::uint32_t>> children(
+        1, std::vector<std::uint32_t>(class_count_, 0));
+    matches_.assign(1, fallback_);
+    for (std::uint32_t index = 0; index < categories.size(); ++index) {
+      for (const auto& keyword : categories[index].keywords) {
+        std::uint32_t state = 0;
+        for (unsigned char c : keyword) {
+          std::uint32_t& next = children[state][byte_class_[c]];
+          if (next == 0) {
+            next = static_cast<std::uint32_t>(children.size());
+            children.emplace_back(class_count_, 0);
+            matches_.push_back(fallback_);
+          }
+          state = next;
+        }
+        matches_[state] = std::min(matches_[state], index);
+      }
+    }
+
+    // Breadth-first pass resolving failure links into direct transitions
+    const std::size_t state_count = children.size();
+    transitions_.assign(state_count * class_count_, 0);
+    std::vector<std::uint32_t> failure(state_count, 0);
+    std::deque<std::uint32_t> pending;
+    for (std::uint32_t c = 0; c < class_count_; ++c) {
+      if (std::uint32_t child = children[0][c]) {
+        transitions_[c] = child;
+        pending.push_back(child);
+      }
+    }
+    while (!pending.empty()) {
+      std::uint32_t state = pending.front();
+      pending.pop_front();
+      matches_[state] = std::min(matches_[state], matches_[failure[state]]);
+      for (std::uint32_t c = 0; c < class_count_; ++c) {
+        std::uint32_t fallback_next =
+            transitions_[failure[state] * class_count_ + c];
+        if (std::uint32_t child = children[state][c]) {
+          failure[child] = fallback_next;
+          transitions_[state * class_count_ + c] = child;
+          pending.push_back(child);
+        } else {
+          transitions_[state * class_count_ + c] = fallback_next;
+        }
+      }
+    }
+  }
+
+  // Serialize the compiled tables
+  void save(std::ostream& out) const {
+    write_pod(out, class_count_);
+    write_pod(out, fallback_);
+    write_pod(out, byte_class_);
+    write_vector(out, transitions_);
+    write_vector(out, matches_);
+  }
+
+  // Deserialize tables written by save, validating every index
+  static std::optional<KeywordMatcher> load(std::istream& in) {
+    KeywordMatcher matcher;
+    constexpr std::uint64_t kMaxEntries = std::uint64_t{1} << 28;
+    if (!read_pod(in, matcher.class_count_) ||
+        !read_pod(in, matcher.fallback_) ||
+        !read_pod(in, matcher.byte_class_) ||
+        !read_vector(in, matcher.transitions_, kMaxEntries) ||
+        !read_vector(in, matcher.matches_, kMaxEntries)) {
+      return std::nullopt;
+    }
+
+    const std::size_t state_count = matcher.matches_.size();
+    if (matcher.class_count_ == 0 || state_count == 0 ||
+        matcher.transitions_.size() != state_count * matcher.class_count_) {
+      return std::nullopt;
+    }
+    for (std::uint32_t c : matcher.byte_class_) {
+      if (c >= matcher.class_count_) return std::nullopt;
+    }
+    for (std::uint32_t next : matcher.transitions_) {
+      if (next >= state_count) return std::nullopt;
+    }
+    for (std::uint32_t match : matcher.matches_) {
+      if (match > matcher.fallback_) return std::nullopt;
+    }
+    return matcher;
+  }
+
+  // Number of categories, including the fallback
+  std::size_t category_count() const { return fallback_ + std::size_t{1}; }
+
+  // Index of the highest-priority category with a keyword in the text
+  std::size_t classify(std::string_view text) const {
+    std::uint32_t best = fallback_;
+    std::uint32_t state = 0;
+    for (unsigned char c : text) {
+      state = transitions_[state * class_count_ + byte_class_[c]];
+      best = std::min(best, matches_[state]);
+      if (best == 0) break;
+    }
+    return best;
+  }
+
+ private:
+  KeywordMatcher() = default;
+
+  std::array<std::uint32_t, 256> byte_class_;
+  std::uint32_t class_count_ = 0;
+  std::uint32_t fallback_ = 0;
+  std::vector<std::uint32_t> transitions_;
+  std::vector<std::uint32_t> matches_;
+};
+
+// The KeywordMatcher of a fixed set of categories, built by the compiler.
+// Table sizes are constants and entries are bytes when they fit, so the
+// whole automaton of the built-in rules takes a few hundred bytes of
+// read-only data and needs no work at startup.
+template <std::size_t kCategoryCount, std::size_t kStates,
+          std::size_t kClasses>
+class StaticKeywordMatcher {
+  using Entry = std::conditional_t<
+      std::max({kCategoryCount, kStates, kClasses}) <= 256, std::uint8_t,
+      std::uint32_t>;
+
+ public:
+  consteval explicit StaticKeywordMatcher(
+      const std::array<BuiltInCategory, kCategoryCount>& categories) {
+    std::size_t class_count = 1;
+    for (const auto& category : categories) {
+      for_each_keyword(category.keywords, [&](std::string_view keyword) {
+        for (unsigned char c : keyword) {
+          if (byte_class_[c] == 0) {
+            byte_class_[c] = static_cast<Entry>(class_count++);
+          }
+        }
+      });
+    }
+
+    // Keyword trie, with 0 for a missing child since the root is never one
+    std::array<Entry, kStates * kClasses> children{};
+    matches_.fill(kFallback);
+    std::size_t state_count = 1;
+    for (std::size_t index = 0; index < kCategoryCount; ++index) {
+      auto add_keyword = [&](std::string_view keyword) {
+        std::size_t state = 0;
+        for (unsigned char c : keyword) {
+          Entry& next = children[state * kClasses + byte_class_[c]];
+          if (next == 0) next = static_cast<Entry>(state_count++);
+          state = next;
+        }
+        matches_[state] = std::min(matches_[state], static_cast<Entry>(index));
+      };
+      for_each_keyword(categories[index].keywords, add_keyword);
+    }
+
+    // Breadth-first pass resolving failure links, as in KeywordMatcher
+    std::array<Entry, kStates> failure{};
+    std::array<Entry, kStates> pending{};
+    std::size_t head = 0;
+    std::size_t tail = 0;
+    for (std::size_t c = 0; c < kClasses; ++c) {
+      if (Entry child = children[c]) {
+        transitions_[c] = child;
+        pending[tail++] = child;
+      }
+    }
+    while (head < tail) {
+      std::size_t state = pending[head++];
+      matches_[state] = std::min(matches_[state], matches_[failure[state]]);
+      for (std::size_t c = 0; c < kClasses; ++c) {
+        Entry fallback_next = transitions_[failure[state] * kClasses + c];
+        if (Entry child = children[state * kClasses + c]) {
+          failure[child] = fallback_next;
+          transitions_[state * kClasses + c] = child;
+          pending[tail++] = child;
+        } else {
+          transitions_[state * kClasses + c] = fallback_next;
+        }
+      }
+    }
+  }
+
+  // Index of the highest-priority category with a keyword in the text
+  std::size_t classify(std::string_view text) const {
+    Entry best = kFallback;
+    std::size_t state = 0;
+    for (unsigned char c : text) {
+      state = transitions_[state * kClasses + byte_class_[c]];
+      best = std::min(best, matches_[state]);
+      if (best == 0) break;
+    }
+    return best;
+  }
+
+ private:
+  static constexpr Entry kFallback = static_cast<Entry>(kCategoryCount - 1);
+
+  std::array<Entry, 256> byte_class_{};
+  std::array<Entry, kStates * kClasses> transitions_{};
+  std::array<Entry, kStates> matches_{};
+};
+
+// Matcher of the built-in categories, compiled with the program
+constexpr StaticKeywordMatcher<kBuiltInCategories.size(),
+                               trie_state_count(kBuiltInCategories),
+                               byte_class_count(kBuiltInCategories)>
+    kBuiltInMatcher(kBuiltInCategories);
+
+// Category folders in priority order, with the fallback category last, and
+// the matcher compiled from their keywords. The built-in rules have no
+// matcher of their own and use kBuiltInMatcher.
+struct CompiledRules {
+  std::vector<std::string> category_paths;
+  std::optional<KeywordMatcher> matcher;
+
+  // Index of the highest-priority category with a keyword in the text
+  std::size_t classify(std::string_view text) const {
+    return matcher ? matcher->classify(text)
+                   : kBuiltInMatcher.classify(text);
+  }
+};
+
+// The built-in categories, which need nothing compiled at run time
+CompiledRules built_in_rules() {
+  CompiledRules rules;
+  for (const auto& category : kBuiltInCategories) {
+    rules.category_paths.emplace_back(category.path);
+  }
+  return rules;
+}
+
+// Order categories by priority and compile their keywords into one matcher
+CompiledRules compile_rules(std::vector<Category> categories) {
+  auto fallback = std::find_if(categories.begin(), categories.end(),
+                               [](const Category& category) {
+                                 return category.keywords.empty();
+                               });
+  Category fallback_category =
+      fallback != categories.end() ? *fallback : Category{"Other/Other", {}};
+  if (fallback != categories.end()) categories.erase(fallback);
+  if (std::any_of(categories.begin(), categories.end(),
+                  [](const Category& category) {
+                    return category.keywords.empty();
+                  })) {
+    throw std::runtime_error("only one category may have no keywords");
+  }
+
+  std::stable_sort(categories.begin(), categories.end(),
+                   [](const Category& a, const Category& b) {
+                     return a.priority > b.priority;
+                   });
+  categories.push_back(std::move(fallback_category));
+
+  std::vector<std::string> paths;
+  paths.reserve(categories.size());
+  for (const auto& category : categories) paths.push_back(category.path);
+  return {std::move(paths), KeywordMatcher(categories)};
+}
+
+// Parse a rules file. Each rule is a line of the form
+//   <priority> <category path> : <keyword> <keyword> ...
+// Blank lines and lines starting with '#' are ignored.
+std::vector<Category> parse_rules_file(const fs::path& rules_path) {
+  std::ifstream in(rules_path);
+  if (!in) throw std::runtime_error("cannot open " + rules_path.string());
+
+  std::vector<Category> categories;
+  std::string line;
+  for (int line_number = 1; std::getline(in, line); ++line_number) {
+    auto first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#') continue;
+
+    auto separator = line.find(':');
+    std::istringstream head(line.substr(0, separator));
+    Category category;
+    if (separator == std::string::npos || !(head >> category.priority)) {
+      throw std::runtime_error(rules_path.string() + ":" +
+                               std::to_string(line_number) +
+                               ": expected <priority> <path> : <keywords>");
+    }
+    std::getline(head >> std::ws, category.path);
+    category.path.erase(category.path.find_last_not_of(" \t\r") + 1);
+    if (category.path.empty()) {
+      throw std::runtime_error(rules_path.string() + ":" +
+                               std::to_string(line_number) +
+                               ": missing category path");
+    }
+
+    std::istringstream keywords(line.substr(separator + 1));
+    for (std::string keyword; keywords >> keyword;) {
+      category.keywords.push_back(to_lower(keyword));
+    }
+    categories.push_back(std::move(category));
+  }
+  return categories;
+}
+
+// Size and modification time of the rules file a cache was built from
+struct RulesStamp {
+  std::uint64_t size = 0;
+  std::int64_t mtime = 0;
+};
+
+RulesStamp rules_stamp(const fs::path& rules_path) {
+  return {static_cast<std::uint64_t>(fs::file_size(rules_path)),
+          static_cast<std::int64_t>(
+              fs::last_write_time(rules_path).time_since_epoch().count())};
+}
+
+// Load compiled rules from the cache if it was built from this rules file
+std::optional<CompiledRules> load_rules_cache(const fs::path& cache_path,
+                                              const RulesStamp& stamp) {
+  std::ifstream in(cache_path, std::ios::binary);
+  std::uint32_t magic, version;
+  RulesStamp cached;
+  std::uint64_t path_count;
+  if (!in || !read_pod(in, magic) || magic != kRulesCacheMagic ||
+      !read_pod(in, version) || version != kRulesCacheVersion ||
+      !read_pod(in, cached.size) || !read_pod(in, cached.mtime) ||
+      cached.size != stamp.size || cached.mtime != stamp.mtime ||
+      !read_pod(in, path_count) || path_count > (1u << 20)) {
+    return std::nullopt;
+  }
+
+  std::vector<std::string> paths(static_cast<std::size_t>(path_count));
+  for (auto& path : paths) {
+    std::vector<char> bytes;
+    if (!read_vector(in, bytes, 1u << 16)) return std::nullopt;
+    path.assign(bytes.begin(), bytes.end());
+  }
+
+  auto matcher = KeywordMatcher::load(in);
+  if (!matcher || matcher->category_count() != paths.size()) {
+    return std::nullopt;
+  }
+  return CompiledRules{std::move(paths), std::move(*matcher)};
+}
+
+// Write compiled rules next to the rules file. The cache is only an
+// optimization, so failures are ignored.
+void save_rules_cache(const fs::path& cache_path, const RulesStamp& stamp,
+                      const CompiledRules& rules) {
+  std::ofstream out(cache_path, std::ios::binary | std::ios::trunc);
+  if (!out) return;
+  write_pod(out, kRulesCacheMagic);
+  write_pod(out, kRulesCacheVersion);
+  write_pod(out, stamp.size);
+  write_pod(out, stamp.mtime);
+  write_pod(out, static_cast<std::uint64_t>(rules.category_paths.size()));
+  for (const auto& path : rules.category_paths) {
+    write_vector(out, std::vector<char>(path.begin(), path.end()));
+  }
+  rules.matcher->save(out);
+}
+
+// Load the rules file, reusing the compiled cache ("<rules>.bin") when it is
+// up to date and rebuilding it otherwise
+CompiledRules load_rules(const fs::path& rules_path) {
+  fs::path cache_path = rules_path;
+  cache_path += ".bin";
+  RulesStamp stamp = rules_stamp(rules_path);
+
+  if (auto cached = load_rules_cache(cache_path, stamp)) return *cached;
+
+  CompiledRules rules = compile_rules(parse_rules_file(rules_path));
+  save_rules_cache(cache_path, stamp, rules);
+  return rules;
+}
+
+// Normalize a lowercased UTF-8 path into a tag key: one '/' between
+// components, whatever the platform separator
+void normalize_tag_key(std::string& key) {
+  std::size_t out = 0;
+  for (char c : key) {
+#ifdef _WIN32
+    if (c == '\\') c = '/';
+#endif
+    if (c == '/' && out > 0 && key[out - 1] == '/') continue;
+    key[out++] = c;
+  }
+  key.resize(out);
+}
+
+// Tag key of a path from a tag export. Exports usually hold absolute
+// paths without "." components; only other paths are resolved against the
+// working directory.
+void tag_key_of_export_path(std::string& key, std::string_view path) {
+  key.clear();
+  append_lower(key, path);
+  normalize_tag_key(key);
+#ifdef _WIN32
+  bool absolute = key.size() > 2 && key[1] == ':' && key[2] == '/';
+#else
+  bool absolute = !key.empty() && key[0] == '/';
+#endif
+  if (absolute && key.find("/.") == std::string::npos) return;
+
+  fs::path sample(std::u8string(path.begin(), path.end()));
+  key.clear();
+  append_utf8(key, fs::absolute(sample).lexically_normal().native(), true);
+  normalize_tag_key(key);
+}
+
+// Hash of a tag key. The FNV hash is mixed once more so its top bits, which
+// pick the bucket, are spread evenly.
+inline std::uint64_t hash_tag_key(std::string_view key) {
+  std::uint64_t hash = hash_bytes(key.data(), key.size());
+  hash ^= hash >> 32;
+  return hash * 0x9e3779b97f4a7c15ull;
+}
+
+// Tags of one sample, resolved against the category rules
+struct SampleTag {
+  static constexpr std::uint32_t kNoCategory = ~std::uint32_t{0};
+
+  std::uint64_t hash = 0;                // hash_tag_key of its path
+  std::uint32_t category = kNoCategory;  // Matched category, if any
+  std::uint16_t tempo = 0;               // Rounded BPM, 0 when unknown
+  bool looped = false;                   // Tagged as a loop
+};
+
+// One sample as read from a tag export, before it is resolved
+struct TagRecord {
+  std::string path;  // UTF-8, as written in the export
+  std::string text;  // Instrument and type tags, separated by spaces
+  double tempo = 0;
+
+  void clear() {
+    path.clear();
+    text.clear();
+    tempo = 0;
+  }
+};
+
+// What a column of a tag export holds
+enum class TagColumn { kIgnored, kPath, kText, kTempo };
+
+// Role of a column given its lowercased name. Genre is left out on purpose:
+// names like "drum & bass" would match instrument keywords.
+TagColumn tag_column(std::string_view name) {
+  for (std::string_view path : {"path", "local_path", "file_path", "file"}) {
+    if (name == path) return TagColumn::kPath;
+  }
+  for (std::string_view text : {"instrument", "instruments", "type",
+                                "sample_type", "tags", "category"}) {
+    if (name == text) return TagColumn::kText;
+  }
+  if (name == "bpm" || name == "tempo") return TagColumn::kTempo;
+  return TagColumn::kIgnored;
+}
+
+// Store one field of a tag export in the record
+void add_tag_field(TagRecord& record, TagColumn column,
+                   std::string_view value) {
+  switch (column) {
+    case TagColumn::kPath:
+      record.path.assign(value);
+      break;
+    case TagColumn::kText:
+      if (!record.text.empty()) record.text.push_back(' ');
+      append_lower(record.text, value);
+      break;
+    case TagColumn::kTempo:
+      std::from_chars(value.data(), value.data() + value.size(),
+                      record.tempo);
+      break;
+    case TagColumn::kIgnored:
+      break;
+  }
+}
+
+// Parse a CSV tag export: a header row naming the columns, then one sample
+// per row. Fields may be quoted, with "" standing for a quote.
+void parse_tag_csv(std::string_view text, const std::string& source,
+                   const std::function<void(const TagRecord&)>& on_record) {
+  std::vector<TagColumn> columns;
+  std::string field;
+  TagRecord record;
+  std::size_t column = 0;
+  bool header = true;
+  bool row_empty = true;
+  auto end_field = [&] {
+    if (header) {
+      std::string name;
+      append_lower(name, field);
+      name.erase(0, name.find_first_not_of(' '));
+      name.erase(name.find_last_not_of(' ') + 1);
+      columns.push_back(tag_column(name));
+    } else if (column < columns.size()) {
+      add_tag_field(record, columns[column], field);
+    }
+    if (!field.empty()) row_empty = false;
+    field.clear();
+    ++column;
+  };
+  auto end_row = [&] {
+    end_field();
+    if (header) {
+      if (std::find(columns.begin(), columns.end(), TagColumn::kPath) ==
+          columns.end()) {
+        throw std::runtime_error(source + ": no path column");
+      }
+      header = false;
+    } else if (!row_empty && !record.path.empty()) {
+      on_record(record);
+    }
+    record.clear();
+    column = 0;
+    row_empty = true;
+  };
+
+  for (std::size_t i = 0; i < text.size(); ++i) {
+    char c = text[i];
+    if (c == '"' && field.empty()) {
+      // Quoted field, up to the closing quote
+      for (++i;; ++i) {
+        if (i >= text.size()) {
+          throw std::runtime_error(source + ": unterminated quote");
+        }
+        if (text[i] == '"') {
+          if (i + 1 < text.size() && text[i + 1] == '"') {
+            ++i;
+          } else {
+            break;
+          }
+        }
+        field.push_back(text[i]);
+      }
+    } else if (c == ',') {
+      end_field();
+    } else if (c == '\n') {
+      end_row();
+    } else if (c != '\r') {
+      field.push_back(c);
+    }
+  }
+  if (!field.empty() || column > 0 || header) end_row();
+}
+
+// Minimal reader for JSON tag exports: objects of strings, numbers and
+// arrays of strings. Anything else is skipped.
+class TagJsonReader {
+ public:
+  TagJsonReader(std::string_view text, const std::string& source)
+      : text_(text), source_(source) {}
+
+  // Read every sample, either from a top-level array of objects or from
+  // objects following each other (one per line)
+  void read(const std::function<void(const TagRecord&)>& on_record) {
+    skip_space();
+    bool in_array = peek() == '[';
+    if (in_array) ++pos_;
+    for (;;) {
+      skip_space();
+      if (pos_ >= text_.size()) {
+        if (in_array) fail("unterminated array");
+        return;
+      }
+      if (in_array && peek() == ']') return;
+      read_object(on_record);
+      skip_space();
+      if (in_array && peek() == ',') ++pos_;
+    }
+  }
+
+ private:
+  char peek() const { return pos_ < text_.size() ? text_[pos_] : '\0'; }
+
+  [[noreturn]] void fail(const char* what) const {
+    throw std::runtime_error(source_ + ": " + what + " at byte " +
+                             std::to_string(pos_));
+  }
+
+  void expect(char c) {
+    skip_space();
+    if (peek() != c) fail("invalid JSON");
+    ++pos_;
+  }
+
+  void skip_space() {
+    while (pos_ < text_.size() &&
+           (text_[pos_] == ' ' || text_[pos_] == '\t' ||
+            text_[pos_] == '\n' || text_[pos_] == '\r')) {
+      ++pos_;
+    }
+  }
+
+  // Four hex digits of a \u escape
+  std::uint32_t read_hex() {
+    if (pos_ + 4 > text_.size()) fail("truncated escape");
+    std::uint32_t value = 0;
+    auto result = std::from_chars(text_.data() + pos_,
+                                  text_.data() + pos_ + 4, value, 16);
+    if (result.ptr != text_.data() + pos_ + 4) fail("invalid escape");
+    pos_ += 4;
+    return value;
+  }
+
+  void read_string(std::string& out) {
+    out.clear();
+    expect('"');
+    for (;;) {
+      if (pos_ >= text_.size()) fail("unterminated string");
+      char c = text_[pos_++];
+      if (c == '"') return;
+      if (c != '\\') {
+        out.push_back(c);
+        continue;
+      }
+      char escape = peek();
+      ++pos_;
+      switch (escape) {
+        case 'b': out.push_back('\b'); break;
+        case 'f': out.push_back('\f'); break;
+        case 'n': out.push_back('\n'); break;
+        case 'r': out.push_back('\r'); break;
+        case 't': out.push_back('\t'); break;
+        case 'u': {
+          std::uint32_t c32 = read_hex();
+          if (c32 >= 0xD800 && c32 < 0xDC00 &&
+              text_.substr(pos_, 2) == "\\u") {
+            pos_ += 2;
+            c32 = 0x10000 + ((c32 - 0xD800) << 10) + (read_hex() - 0xDC00);
+          }
+          append_code_point(out, c32);
+          break;
+        }
+        default: out.push_back(escape); break;  // " \ and /
+      }
+    }
+  }
+
+  static void append_code_point(std::string& out, std::uint32_t c) {
+    if (c < 0x80) {
+      out.push_back(static_cast<char>(c));
+    } else if (c < 0x800) {
+      out.push_back(static_cast<char>(0xC0 | (c >> 6)));
+      out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    } else if (c < 0x10000) {
+      out.push_back(static_cast<char>(0xE0 | (c >> 12)));
+      out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    } else {
+      out.push_back(static_cast<char>(0xF0 | (c >> 18)));
+      out.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+      out.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+    }
+  }
+
+  // Skip a value of any type, including nested objects and arrays
+  void skip_value() {
+    skip_space();
+    char c = peek();
+    if (c == '"') {
+      read_string(scratch_);
+    } else if (c == '{' || c == '[') {
+      char close = c == '{' ? '}' : ']';
+      ++pos_;
+      skip_space();
+      if (peek() == close) {
+        ++pos_;
+        return;
+      }
+      for (;;) {
+        if (close == '}') {
+          read_string(scratch_);
+          expect(':');
+        }
+        skip_value();
+        skip_space();
+        if (peek() == close) {
+          ++pos_;
+          return;
+        }
+        expect(',');
+      }
+    } else {
+      // Number, true, false or null
+      std::size_t start = pos_;
+      while (pos_ < text_.size() &&
+             std::strchr(",]} \t\r\n", text_[pos_]) == nullptr) {
+        ++pos_;
+      }
+      if (pos_ == start) fail("invalid JSON");
+    }
+  }
+
+  void read_object(const std::function<void(const TagRecord&)>& on_record) {
+    TagRecord record;
+    std::string key;
+    expect('{');
+    skip_space();
+    if (peek() == '}') {
+      ++pos_;
+      return;
+    }
+    for (;;) {
+      read_string(key);
+      std::string lower_key;
+      append_lower(lower_key, key);
+      TagColumn column = tag_column(lower_key);
+      expect(':');
+      skip_space();
+      char c = peek();
+      if (column == TagColumn::kIgnored) {
+        skip_value();
+      } else if (c == '"') {
+        read_string(scratch_);
+        add_tag_field(record, column, scratch_);
+      } else if (c == '[') {
+        // Array of tags; only its strings count
+        ++pos_;
+        skip_space();
+        while (peek() != ']') {
+          if (peek() == '"') {
+            read_string(scratch_);
+            add_tag_field(record, column, scratch_);
+          } else {
+            skip_value();
+          }
+          skip_space();
+          if (peek() == ',') {
+            ++pos_;
+            skip_space();
+          } else if (peek() != ']') {
+            fail("invalid JSON");
+          }
+        }
+        ++pos_;
+      } else {
+        std::size_t start = pos_;
+        skip_value();
+        add_tag_field(record, column, text_.substr(start, pos_ - start));
+      }
+      skip_space();
+      if (peek() == '}') {
+        ++pos_;
+        break;
+      }
+      expect(',');
+    }
+    if (!record.path.empty()) on_record(record);
+  }
+
+  std::string_view text_;
+  const std::string& source_;
+  std::size_t pos_ = 0;
+  std::string scratch_;
+};
+
+// Frozen table of sample tags read from a Splice export. The entries are
+// sorted by path hash and indexed by its top bits, with about one entry per
+// bucket, so a lookup is a probe of the bucket index and usually a single
+// entry, and the whole table stays at 16 bytes and 4 bytes of index per
+// sample.
+class TagTable {
+ public:
+  // Read a CSV or JSON export and resolve each sample's tags to a category
+  // of the rules. Throws std::runtime_error if it cannot be read.
+  static TagTable load(const fs::path& path, const CompiledRules& rules) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) throw std::runtime_error("cannot open " + path.string());
+    std::string text((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+
+    TagTable table;
+    std::string key;
+    std::size_t fallback = rules.category_paths.size() - 1;
+    auto on_record = [&](const TagRecord& record) {
+      tag_key_of_export_path(key, record.path);
+      SampleTag tag;
+      tag.hash = hash_tag_key(key);
+      std::size_t category = rules.classify(record.text);
+      if (category != fallback) {
+        tag.category = static_cast<std::uint32_t>(category);
+      }
+      if (record.tempo > 0 && record.tempo < 1000) {
+        tag.tempo = static_cast<std::uint16_t>(std::lround(record.tempo));
+      }
+      tag.looped = record.text.find("loop") != std::string::npos;
+      table.entries_.push_back(tag);
+    };
+
+    auto extension = to_lower(path.extension().string());
+    auto first = text.find_first_not_of(" \t\r\n");
+    bool json = extension == ".json" || extension == ".jsonl" ||
+                (extension != ".csv" && first != std::string::npos &&
+                 (text[first] == '{' || text[first] == '['));
+    if (json) {
+      TagJsonReader(text, path.string()).read(on_record);
+    } else {
+      parse_tag_csv(text, path.string(), on_record);
+    }
+    table.freeze();
+    return table;
+  }
+
+  // Number of tagged samples
+  std::size_t size() const { return entries_.size(); }
+
+  // Tags of the sample with this key (see normalize_tag_key), or nullptr
+  const SampleTag* find(std::string_view key) const {
+    std::uint64_t hash = hash_tag_key(key);
+    std::size_t bucket = static_cast<std::size_t>(hash >> shift_);
+    for (std::uint32_t i = buckets_[bucket]; i != buckets_[bucket + 1]; ++i) {
+      if (entries_[i].hash == hash) return &entries_[i];
+    }
+    return nullptr;
+  }
+
+ private:
+  TagTable() = default;
+
+  // Sort the entries and build the bucket index. A path listed twice keeps
+  // its last tags.
+  void freeze() {
+    std::stable_sort(entries_.begin(), entries_.end(),
+                     [](const SampleTag& a, const SampleTag& b) {
+                       return a.hash < b.hash;
+                     });
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < entries_.size(); ++i) {
+      if (i + 1 < entries_.size() && entries_[i + 1].hash == entries_[i].hash) {
+        continue;
+      }
+      entries_[kept++] = entries_[i];
+    }
+    entries_.resize(kept);
+    entries_.shrink_to_fit();
+    if (entries_.size() >= ~std::uint32_t{0}) {
+      throw std::runtime_error("too many tagged samples");
+    }
+
+    int bits = std::max(1, static_cast<int>(std::bit_width(entries_.size())));
+    shift_ = 64 - bits;
+    buckets_.assign((std::size_t{1} << bits) + 1, 0);
+    std::uint32_t i = 0;
+    for (std::size_t bucket = 0; bucket + 1 < buckets_.size(); ++bucket) {
+      buckets_[bucket] = i;
+      while (i < entries_.size() && (entries_[i].hash >> shift_) == bucket) {
+        ++i;
+      }
+    }
+    buckets_.back() = i;
+  }
+
+  std::vector<SampleTag> entries_;
+  std::vector<std::uint32_t> buckets_;
+  int shift_ = 63;
+};
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+ public:
+  MappedFile() = default;
+
+  // Map the file at path. A missing or empty file gives an empty mapping.
+  explicit MappedFile(const fs::path& path) {
+#ifdef _WIN32
+    file_ = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                        OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+    current_stats().add(Counter::kSyscalls, 4);  // Open, size, map and view
+    LARGE_INTEGER size;
+    if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size) ||
+        size.QuadPart == 0) {
+      reset();
+      return;
+    }
+    mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping_ != nullptr) {
+      data_ = static_cast<const char*>(
+          MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    }
+    if (data_ == nullptr) {
+      reset();
+      return;
+    }
+    size_ = static_cast<std::size_t>(size.QuadPart);
+#else
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    current_stats().add(Counter::kSyscalls, 4);  // open, fstat, mmap and close
+    if (fd < 0) return;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+      void* data = mmap(nullptr, static_cast<std::size_t>(info.st_size),
+                        PROT_READ, MAP_SHARED, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = static_cast<const char*>(data);
+        size_ = static_cast<std::size_t>(info.st_size);
+      }
+    }
+    close(fd);
+#endif
+  }
+
+  ~MappedFile() { reset(); }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+  // Unmap the file so it can be replaced
+  void reset() {
+#ifdef _WIN32
+    if (data_ != nullptr) UnmapViewOfFile(data_);
+    if (mapping_ != nullptr) CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+    mapping_ = nullptr;
+    file_ = INVALID_HANDLE_VALUE;
+#else
+    if (data_ != nullptr) munmap(const_cast<char*>(data_), size_);
+#endif
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+ private:
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#endif
+  const char* data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+// Bytes searched after any ID3v2 tag for the first MPEG audio frame
+constexpr std::size_t kMp3SyncWindow = 4096;
+
+// Container of an audio file, recognized from its first bytes
+enum class AudioContainer { kUnknown, kWav, kMp3 };
+
+// What the headers of an audio file say about its contents
+struct AudioInfo {
+  AudioContainer container = AudioContainer::kUnknown;
+  unsigned format = 0;       // WAVE format tag, 0 for MP3
+  unsigned sample_rate = 0;
+  unsigned channels = 0;
+  unsigned bits = 0;         // Bits per sample, 0 for MP3
+  unsigned block_align = 0;  // Bytes per WAV frame, 0 for MP3
+  double duration = 0;       // Seconds
+  double tempo = 0;          // Beats per minute, 0 when unknown
+  bool looped = false;       // Marked as a loop by ACID or sampler chunks
+  int root_note = -1;        // MIDI note from an ACID chunk, -1 when unknown
+  std::size_t data_offset = 0;  // Start of the WAV sample data
+  std::size_t data_size = 0;    // Bytes of WAV sample data
+};
+
+// Read a little-endian unsigned integer
+template <typename T>
+T load_le(const unsigned char* bytes) {
+  T value = 0;
+  for (std::size_t i = 0; i < sizeof(T); ++i) {
+    value |= static_cast<T>(static_cast<T>(bytes[i]) << (8 * i));
+  }
+  return value;
+}
+
+// Read a big-endian 32-bit integer
+inline std::uint32_t load_be32(const unsigned char* bytes) {
+  return std::uint32_t{bytes[0]} << 24 | std::uint32_t{bytes[1]} << 16 |
+         std::uint32_t{bytes[2]} << 8 | bytes[3];
+}
+
+// Read a 28-bit ID3v2 "syncsafe" integer, or -1 if it is malformed
+inline std::int64_t load_syncsafe(const unsigned char* bytes) {
+  if ((bytes[0] | bytes[1] | bytes[2] | bytes[3]) & 0x80) return -1;
+  return std::int64_t{bytes[0]} << 21 | std::int64_t{bytes[1]} << 14 |
+         std::int64_t{bytes[2]} << 7 | bytes[3];
+}
+
+// Accept a tempo only within the range samples are made at
+inline double plausible_tempo(double tempo) {
+  return std::isfinite(tempo) && tempo >= 30.0 && tempo <= 400.0 ? tempo : 0;
+}
+
+// Walk the chunks of a RIFF/WAVE file. Only chunk headers and the small
+// fmt, acid and smpl chunks are read; the sample data is skipped over, so a
+// mapped file only faults in the pages around them. Returns false unless a
+// usable fmt chunk and a complete, non-empty data chunk are present.
+bool parse_wav_header(const unsigned char* bytes, std::size_t size,
+                      AudioInfo& info) {
+  if (size < 12 || std::memcmp(bytes, "RIFF", 4) != 0 ||
+      std::memcmp(bytes + 8, "WAVE", 4) != 0) {
+    return false;
+  }
+  info.container = AudioContainer::kWav;
+  std::uint64_t riff_size = load_le<std::uint32_t>(bytes + 4);
+  std::uint64_t end = std::min<std::uint64_t>(size, 8 + riff_size);
+  std::uint32_t byte_rate = 0;
+  bool have_format = false;
+  bool have_data = false;
+
+  for (std::uint64_t offset = 12; offset + 8 <= end;) {
+    const unsigned char* chunk = bytes + offset;
+    std::uint64_t chunk_size = load_le<std::uint32_t>(chunk + 4);
+    const unsigned char* body = chunk + 8;
+    std::uint64_t available = end - offset - 8;
+    std::uint64_t readable = std::min(chunk_size, available);
+
+    if (std::memcmp(chunk, "fmt ", 4) == 0 && readable >= 16) {
+      info.format = load_le<std::uint16_t>(body);
+      info.channels = load_le<std::uint16_t>(body + 2);
+      info.sample_rate = load_le<std::uint32_t>(body + 4);
+      byte_rate = load_le<std::uint32_t>(body + 8);
+      info.block_align = load_le<std::uint16_t>(body + 12);
+      info.bits = load_le<std::uint16_t>(body + 14);
+      if (info.format == 0xFFFE && readable >= 26) {
+        info.format = load_le<std::uint16_t>(body + 24);  // Extensible
+      }
+      have_format = true;
+    } else if (std::memcmp(chunk, "data", 4) == 0) {
+      if (chunk_size > available) return false;  // Truncated
+      info.data_offset = static_cast<std::size_t>(offset + 8);
+      info.data_size = static_cast<std::size_t>(chunk_size);
+      have_data = true;
+    } else if (std::memcmp(chunk, "acid", 4) == 0 && readable >= 24) {
+      std::uint32_t flags = load_le<std::uint32_t>(body);
+      if (flags & 0x02) info.root_note = load_le<std::uint16_t>(body + 4);
+      float tempo;
+      std::memcpy(&tempo, body + 20, sizeof(tempo));
+      info.tempo = plausible_tempo(tempo);
+      info.looped = info.looped || !(flags & 0x01);  // Not a one-shot
+    } else if (std::memcmp(chunk, "smpl", 4) == 0 && readable >= 36) {
+      info.looped = info.looped || load_le<std::uint32_t>(body + 28) > 0;
+    }
+    offset += 8 + chunk_size + (chunk_size & 1);
+  }
+
+  if (!have_format || !have_data || info.data_size == 0 ||
+      info.channels == 0 || info.sample_rate == 0 || info.block_align == 0) {
+    return false;
+  }
+  if (byte_rate == 0) {
+    byte_rate = info.sample_rate * info.block_align;
+  }
+  info.duration = static_cast<double>(info.data_size) / byte_rate;
+  return true;
+}
+
+// Find the TBPM frame of an ID3v2.3 or v2.4 tag and return its tempo
+double id3_tempo(const unsigned char* tag, std::size_t size) {
+  unsigned version = tag[3];
+  if (version < 3 || version > 4 || (tag[5] & 0x80)) {
+    return 0;  // v2.2 frame layout or unsynchronized frames
+  }
+  std::size_t offset = 10;
+  if (tag[5] & 0x40) {
+    // Skip the extended header
+    if (size < 14) return 0;
+    std::int64_t extended = version == 4
+                                ? load_syncsafe(tag + 10)
+                                : 4 + std::int64_t{load_be32(tag + 10)};
+    if (extended < 0 || static_cast<std::uint64_t>(extended) > size - 10) {
+      return 0;
+    }
+    offset += static_cast<std::size_t>(extended);
+  }
+  while (offset + 10 <= size && tag[offset] != 0) {
+    const unsigned char* frame = tag + offset;
+    std::int64_t frame_size = version == 4
+                                  ? load_syncsafe(frame + 4)
+                                  : std::int64_t{load_be32(frame + 4)};
+    if (frame_size < 0 ||
+        static_cast<std::uint64_t>(frame_size) > size - offset - 10) {
+      return 0;
+    }
+    if (std::memcmp(frame, "TBPM", 4) == 0) {
+      // Text frame: an encoding byte, then digits in Latin-1 or UTF-16
+      double tempo = 0;
+      bool digits = false;
+      for (std::int64_t i = 1; i < frame_size; ++i) {
+        unsigned char c = frame[10 + i];
+        if (c >= '0' && c <= '9') {
+          tempo = tempo * 10 + (c - '0');
+          digits = true;
+        } else if (c == 0 || c == 0xFE || c == 0xFF) {
+          continue;  // UTF-16 padding and byte order marks
+        } else if (digits) {
+          break;
+        }
+      }
+      return plausible_tempo(tempo);
+    }
+    offset += 10 + static_cast<std::size_t>(frame_size);
+  }
+  return 0;
+}
+
+// Fields of an MPEG audio frame header
+struct MpegFrame {
+  unsigned bitrate = 0;  // Bits per second
+  unsigned sample_rate = 0;
+  unsigned channels = 0;
+  unsigned samples = 0;  // Samples per channel in the frame
+  std::size_t length = 0;
+  std::size_t side_info = 0;  // Layer III side information bytes
+};
+
+// Decode the MPEG audio frame header at bytes, or return false if these
+// four bytes are not one
+bool parse_mpeg_frame(const unsigned char* bytes, MpegFrame& frame) {
+  static constexpr unsigned short kBitrates[5][16] = {
+      {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+      {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+      {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+      {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+      {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+  };
+  static constexpr unsigned kSampleRates[3] = {44100, 48000, 32000};
+
+  if (bytes[0] != 0xFF || (bytes[1] & 0xE0) != 0xE0) return false;
+  unsigned version = (bytes[1] >> 3) & 3;  // 0: 2.5, 2: 2, 3: 1
+  unsigned layer = 4 - ((bytes[1] >> 1) & 3);
+  unsigned bitrate_index = bytes[2] >> 4;
+  unsigned rate_index = (bytes[2] >> 2) & 3;
+  if (version == 1 || layer == 4 || bitrate_index == 0 ||
+      bitrate_index == 15 || rate_index == 3) {
+    return false;
+  }
+  bool mpeg1 = version == 3;
+  unsigned table = mpeg1 ? layer - 1 : (layer == 1 ? 3 : 4);
+  frame.bitrate = kBitrates[table][bitrate_index] * 1000u;
+  unsigned rate_shift = mpeg1 ? 0 : (version == 2 ? 1 : 2);
+  frame.sample_rate = kSampleRates[rate_index] >> rate_shift;
+  frame.channels = (bytes[3] >> 6) == 3 ? 1 : 2;
+  unsigned padding = (bytes[2] >> 1) & 1;
+  if (layer == 1) {
+    frame.samples = 384;
+    frame.length = (12 * frame.bitrate / frame.sample_rate + padding) * 4;
+  } else {
+    frame.samples = layer == 3 && !mpeg1 ? 576 : 1152;
+    frame.length = frame.samples / 8 * frame.bitrate / frame.sample_rate +
+                   padding;
+  }
+  frame.side_info = layer != 3 ? 0
+                    : mpeg1    ? (frame.channels == 1 ? 17 : 32)
+                               : (frame.channels == 1 ? 9 : 17);
+  return true;
+}
+
+// Read the ID3v2 tag and the first MPEG audio frame of an MP3 file. The
+// duration comes from a Xing/Info or VBRI header when the encoder wrote one
+// and from the bitrate otherwise. Returns false if no frame is found within
+// kMp3SyncWindow bytes of the tag.
+bool parse_mp3_header(const unsigned char* bytes, std::size_t size,
+                      AudioInfo& info) {
+  std::size_t audio_start = 0;
+  if (size >= 10 && std::memcmp(bytes, "ID3", 3) == 0) {
+    std::int64_t tag_size = load_syncsafe(bytes + 6);
+    if (tag_size < 0) return false;
+    std::size_t tag_end = 10 + static_cast<std::size_t>(tag_size) +
+                          ((bytes[5] & 0x10) ? 10 : 0);  // Footer
+    if (tag_end > size) return false;
+    info.tempo = id3_tempo(bytes, tag_end);
+    info.looped = info.tempo > 0;  // MP3 has no loop markers; tempo implies one
+    audio_start = tag_end;
+  }
+
+  std::size_t audio_end = size;
+  if (size >= audio_start + 128 &&
+      std::memcmp(bytes + size - 128, "TAG", 3) == 0) {
+    audio_end -= 128;  // ID3v1 tag
+  }
+
+  std::size_t search_end = std::min(audio_end, audio_start + kMp3SyncWindow);
+  MpegFrame frame;
+  std::size_t offset = audio_start;
+  for (; offset + 4 <= search_end; ++offset) {
+    if (!parse_mpeg_frame(bytes + offset, frame)) continue;
+    // Require another frame, or the end of the audio, right after it
+    MpegFrame next;
+    std::size_t next_offset = offset + frame.length;
+    if (next_offset == audio_end ||
+        (next_offset + 4 <= audio_end &&
+         parse_mpeg_frame(bytes + next_offset, next))) {
+      break;
+    }
+  }
+  if (offset + 4 > search_end) return false;
+
+  info.container = AudioContainer::kMp3;
+  info.sample_rate = frame.sample_rate;
+  info.channels = frame.channels;
+
+  const unsigned char* first = bytes + offset;
+  std::size_t frame_end = std::min(audio_end, offset + frame.length);
+  std::size_t xing = offset + 4 + frame.side_info;
+  std::uint32_t frames = 0;
+  if (xing + 12 <= frame_end && (std::memcmp(bytes + xing, "Xing", 4) == 0 ||
+                                 std::memcmp(bytes + xing, "Info", 4) == 0)) {
+    if (load_be32(bytes + xing + 4) & 1) frames = load_be32(bytes + xing + 8);
+  } else if (offset + 36 + 18 <= frame_end &&
+             std::memcmp(first + 36, "VBRI", 4) == 0) {
+    frames = load_be32(first + 36 + 14);
+  }
+  if (frames > 0) {
+    info.duration =
+        static_cast<double>(frames) * frame.samples / frame.sample_rate;
+  } else {
+    info.duration =
+        static_cast<double>(audio_end - offset) * 8 / frame.bitrate;
+  }
+  return info.duration > 0;
+}
+
+// Read the headers of a mapped WAV or MP3 file. Returns false for empty,
+// unrecognized, truncated or otherwise unusable files.
+bool read_audio_info(const MappedFile& file, AudioInfo& info) {
+  info = AudioInfo{};
+  const auto* bytes = reinterpret_cast<const unsigned char*>(file.data());
+  std::size_t size = file.size();
+  if (size < 12) return false;
+  if (std::memcmp(bytes, "RIFF", 4) == 0) {
+    return parse_wav_header(bytes, size, info);
+  }
+  return parse_mp3_header(bytes, size, info);
+}
+
+// Seconds of audio in a file by its headers, 0 if they do not say
+double audio_duration(const fs::path& path) {
+  StageTimer timer(Stage::kHeaders);
+  MappedFile file(path);
+  AudioInfo info;
+  return read_audio_info(file, info) ? info.duration : 0;
+}
+
+// Longest stretch of audio decoded from the start of a file to classify it
+// by its content
+constexpr double kProbeSeconds = 0.3;
+
+// Samples in the block whose spectrum is analysed, a power of two
+constexpr std::size_t kSpectrumSize = 1024;
+
+// Start of a file's audio, mixed down to mono
+struct AudioProbe {
+  std::vector<float> samples;
+  unsigned sample_rate = 0;
+  double duration = 0;  // Seconds of audio in the whole file
+};
+
+// Mix interleaved PCM or float frames down to mono samples in [-1, 1].
+// Returns false for sample formats that are not supported.
+bool decode_frames(const unsigned char* data, std::size_t frames,
+                   unsigned format, unsigned channels, unsigned bits,
+                   unsigned block_align, std::vector<float>& samples) {
+  unsigned sample_bytes = bits / 8;
+  if (sample_bytes == 0 || bits % 8 != 0 ||
+      sample_bytes * channels > block_align) {
+    return false;
+  }
+  samples.assign(frames, 0.0f);
+  float* out = samples.data();
+  float gain = 1.0f / static_cast<float>(channels);
+
+  // One pass per channel keeps the format switch out of the sample loop
+  for (unsigned channel = 0; channel < channels; ++channel) {
+    const unsigned char* in = data + channel * sample_bytes;
+    auto accumulate = [&](auto convert) {
+      for (std::size_t i = 0; i < frames; ++i) {
+        out[i] += convert(in + i * block_align);
+      }
+    };
+    if (format == 1 && bits == 8) {
+      float scale = gain / 128.0f;
+      accumulate([scale](const unsigned char* p) {
+        return (static_cast<float>(*p) - 128.0f) * scale;
+      });
+    } else if (format == 1 && bits == 16) {
+      float scale = gain / 32768.0f;
+      accumulate([scale](const unsigned char* p) {
+        return static_cast<float>(
+                   static_cast<std::int16_t>(load_le<std::uint16_t>(p))) *
+               scale;
+      });
+    } else if (format == 1 && bits == 24) {
+      float scale = gain / 8388608.0f;
+      accumulate([scale](const unsigned char* p) {
+        std::uint32_t raw = static_cast<std::uint32_t>(p[0]) << 8 |
+                            static_cast<std::uint32_t>(p[1]) << 16 |
+                            static_cast<std::uint32_t>(p[2]) << 24;
+        return static_cast<float>(static_cast<std::int32_t>(raw) >> 8) *
+               scale;
+      });
+    } else if (format == 1 && bits == 32) {
+      float scale = gain / 2147483648.0f;
+      accumulate([scale](const unsigned char* p) {
+        return static_cast<float>(
+                   static_cast<std::int32_t>(load_le<std::uint32_t>(p))) *
+               scale;
+      });
+    } else if (format == 3 && bits == 32) {
+      accumulate([gain](const unsigned char* p) {
+        float value;
+        std::memcpy(&value, p, sizeof(value));
+        return std::isfinite(value) ? value * gain : 0.0f;
+      });
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Decode up to kProbeSeconds from the start of a mapped WAV file. Returns
+// false for MP3 files and for sample formats that are not supported.
+bool decode_probe(const MappedFile& file, const AudioInfo& info,
+                  AudioProbe& probe) {
+  if (info.container != AudioContainer::kWav) return false;
+  probe.sample_rate = info.sample_rate;
+  probe.duration = info.duration;
+  std::size_t frames = std::min<std::size_t>(
+      info.data_size / info.block_align,
+      static_cast<std::size_t>(kProbeSeconds * info.sample_rate));
+  return decode_frames(
+      reinterpret_cast<const unsigned char*>(file.data()) + info.data_offset,
+      frames, info.format, info.channels, info.bits, info.block_align,
+      probe.samples);
+}
+
+// Hann window, twiddle factors and bit-reversal permutation of the spectrum
+struct SpectrumTables {
+  SpectrumTables() {
+    const double kPi = 3.14159265358979323846;
+    for (std::size_t i = 0; i < kSpectrumSize; ++i) {
+      window[i] = static_cast<float>(
+          0.5 - 0.5 * std::cos(2 * kPi * i / (kSpectrumSize - 1)));
+      std::size_t reversed = 0;
+      for (std::size_t bit = 1, mirror = kSpectrumSize >> 1;
+           bit < kSpectrumSize; bit <<= 1, mirror >>= 1) {
+        if (i & bit) reversed |= mirror;
+      }
+      bit_reverse[i] = static_cast<std::uint16_t>(reversed);
+    }
+    for (std::size_t i = 0; i < kSpectrumSize / 2; ++i) {
+      twiddle_re[i] = static_cast<float>(std::cos(2 * kPi * i / kSpectrumSize));
+      twiddle_im[i] =
+          static_cast<float>(-std::sin(2 * kPi * i / kSpectrumSize));
+    }
+  }
+
+  std::array<float, kSpectrumSize> window;
+  std::array<float, kSpectrumSize / 2> twiddle_re;
+  std::array<float, kSpectrumSize / 2> twiddle_im;
+  std::array<std::uint16_t, kSpectrumSize> bit_reverse;
+};
+
+// Magnitude-weighted mean frequency of a Hann-windowed block, in FFT bins.
+// The block is zero-padded to kSpectrumSize samples and transformed with an
+// iterative radix-2 FFT over split real and imaginary arrays.
+float spectral_centroid_bins(const float* samples, std::size_t count) {
+  static const SpectrumTables tables;
+  thread_local std::array<float, kSpectrumSize> re;
+  thread_local std::array<float, kSpectrumSize> im;
+  count = std::min(count, kSpectrumSize);
+  for (std::size_t i = 0; i < kSpectrumSize; ++i) {
+    float sample = i < count ? samples[i] : 0.0f;
+    re[tables.bit_reverse[i]] = sample * tables.window[i];
+  }
+  im.fill(0.0f);
+
+  for (std::size_t half = 1; half < kSpectrumSize; half <<= 1) {
+    std::size_t stride = kSpectrumSize / (2 * half);
+    for (std::size_t start = 0; start < kSpectrumSize; start += 2 * half) {
+      float* re_a = re.data() + start;
+      float* im_a = im.data() + start;
+      float* re_b = re_a + half;
+      float* im_b = im_a + half;
+      for (std::size_t k = 0; k < half; ++k) {
+        float w_re = tables.twiddle_re[k * stride];
+        float w_im = tables.twiddle_im[k * stride];
+        float t_re = re_b[k] * w_re - im_b[k] * w_im;
+        float t_im = re_b[k] * w_im + im_b[k] * w_re;
+        re_b[k] = re_a[k] - t_re;
+        im_b[k] = im_a[k] - t_im;
+        re_a[k] += t_re;
+        im_a[k] += t_im;
+      }
+    }
+  }
+
+  float weighted = 0.0f;
+  float total = 0.0f;
+  for (std::size_t k = 1; k < kSpectrumSize / 2; ++k) {
+    float magnitude = std::sqrt(re[k] * re[k] + im[k] * im[k]);
+    weighted += static_cast<float>(k) * magnitude;
+    total += magnitude;
+  }
+  return total > 0.0f ? weighted / total : 0.0f;
+}
+
+// Cheap descriptors of how a sample starts and sounds
+struct AudioFeatures {
+  double duration = 0;           // Seconds of audio in the whole file
+  float peak_time = 0;           // Seconds until the loudest envelope window
+  float decay_time = 0;          // Seconds from the peak until 20 dB below it
+  bool sustained = false;        // Still within 20 dB at the end of the probe
+  int onsets = 0;                // Renewed attacks after the peak
+  float zero_crossing_rate = 0;  // Sign changes per sample
+  float spectral_centroid = 0;   // Hz, measured from the peak on
+};
+
+// Measure the features of a decoded probe. Returns false for silence.
+bool analyze_audio(const AudioProbe& probe, AudioFeatures& features) {
+  const std::vector<float>& samples = probe.samples;
+  std::size_t window = std::max<std::size_t>(probe.sample_rate / 200, 1);
+  std::size_t window_count = samples.size() / window;
+  if (window_count == 0) return false;
+
+  // RMS envelope over 5 ms windows
+  thread_local std::vector<float> envelope;
+  envelope.resize(window_count);
+  for (std::size_t w = 0; w < window_count; ++w) {
+    const float* block = samples.data() + w * window;
+    float energy = 0.0f;
+    for (std::size_t i = 0; i < window; ++i) energy += block[i] * block[i];
+    envelope[w] = std::sqrt(energy / static_cast<float>(window));
+  }
+  std::size_t peak = static_cast<std::size_t>(
+      std::max_element(envelope.begin(), envelope.end()) - envelope.begin());
+  float peak_level = envelope[peak];
+  if (peak_level < 1e-4f) return false;
+
+  float seconds_per_window =
+      static_cast<float>(window) / static_cast<float>(probe.sample_rate);
+  features.duration = probe.duration;
+  features.peak_time = static_cast<float>(peak) * seconds_per_window;
+  features.sustained = true;
+  features.decay_time =
+      static_cast<float>(window_count - peak) * seconds_per_window;
+  features.onsets = 0;
+  float quietest = peak_level;
+  for (std::size_t w = peak + 1; w < window_count; ++w) {
+    if (features.sustained && envelope[w] < peak_level * 0.1f) {
+      features.sustained = false;
+      features.decay_time = static_cast<float>(w - peak) * seconds_per_window;
+    }
+    quietest = std::min(quietest, envelope[w]);
+    if (envelope[w] > quietest * 4.0f && envelope[w] > peak_level * 0.1f) {
+      ++features.onsets;
+      quietest = envelope[w];
+    }
+  }
+
+  std::size_t crossings = 0;
+  for (std::size_t i = 1; i < samples.size(); ++i) {
+    crossings += (samples[i - 1] < 0.0f) != (samples[i] < 0.0f);
+  }
+  features.zero_crossing_rate =
+      static_cast<float>(crossings) / static_cast<float>(samples.size());
+
+  std::size_t start = peak * window;
+  features.spectral_centroid =
+      spectral_centroid_bins(samples.data() + start, samples.size() - start) *
+      static_cast<float>(probe.sample_rate) / kSpectrumSize;
+  return true;
+}
+
+// Sounds the content classifier recognizes, each sorted into the category
+// with the same path when the rules have one
+enum class ContentClass { k808, kKick, kSnare, kHat, kLoop, kCount };
+
+constexpr std::size_t kContentClassCount =
+    static_cast<std::size_t>(ContentClass::kCount);
+constexpr std::array<const char*, kContentClassCount> kContentCategories = {
+    "Drums/808", "Drums/Kick", "Drums/Snare", "Drums/Hat", "Other/Loop"};
+
+// Pick a content class from the features, if any fits
+std::optional<ContentClass> classify_features(const AudioFeatures& features) {
+  bool percussive = features.peak_time < 0.05f && features.onsets == 0;
+  if (features.duration >= 2.0 && !percussive) return ContentClass::kLoop;
+  if (!percussive) return std::nullopt;
+  if (features.spectral_centroid < 500.0f &&
+      features.zero_crossing_rate < 0.03f) {
+    return features.decay_time > 0.25f ? ContentClass::k808
+                                       : ContentClass::kKick;
+  }
+  if (features.spectral_centroid > 8000.0f &&
+      features.zero_crossing_rate > 0.2f && features.decay_time < 0.2f) {
+    return ContentClass::kHat;
+  }
+  if (features.spectral_centroid > 1000.0f &&
+      features.zero_crossing_rate > 0.05f && features.decay_time < 0.3f) {
+    return ContentClass::kSnare;
+  }
+  return std::nullopt;
+}
+
+// Sorts files that match no keyword by how their first few hundred
+// milliseconds sound. Only WAV files are decoded.
+class ContentClassifier {
+ public:
+  explicit ContentClassifier(const std::vector<std::string>& category_paths) {
+    for (std::size_t i = 0; i < kContentCategories.size(); ++i) {
+      auto found = std::find(category_paths.begin(), category_paths.end(),
+                             kContentCategories[i]);
+      categories_[i] = found != category_paths.end()
+                           ? static_cast<std::size_t>(
+                                 found - category_paths.begin())
+                           : kNoCategory;
+    }
+  }
+
+  // Category index for a mapped file, or fallback when its content is not
+  // recognized or has no category
+  std::size_t classify(const MappedFile& file, const AudioInfo& info,
+                       std::size_t fallback) const {
+    thread_local AudioProbe probe;
+    AudioFeatures features;
+    if (!decode_probe(file, info, probe) || !analyze_audio(probe, features)) {
+      return fallback;
+    }
+    std::optional<ContentClass> content = classify_features(features);
+    if (!content) return fallback;
+    std::size_t category = categories_[static_cast<std::size_t>(*content)];
+    return category != kNoCategory ? category : fallback;
+  }
+
+ private:
+  static constexpr std::size_t kNoCategory = SIZE_MAX;
+
+  std::array<std::size_t, kContentClassCount> categories_;
+};
+
+// Hash of a path's native representation
+std::uint64_t hash_path(const fs::path& path) {
+  const auto& native = path.native();
+  return hash_bytes(native.data(), native.size() * sizeof(native[0]));
+}
+
+// Full 64x64->128 bit multiply folded back to 64 bits
+inline std::uint64_t multiply_fold(std::uint64_t a, std::uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+  return static_cast<std::uint64_t>(product) ^
+         static_cast<std::uint64_t>(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  std::uint64_t high;
+  std::uint64_t low = _umul128(a, b, &high);
+  return low ^ high;
+#else
+  std::uint64_t a_lo = a & 0xffffffff, a_hi = a >> 32;
+  std::uint64_t b_lo = b & 0xffffffff, b_hi = b >> 32;
+  std::uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo;
+  std::uint64_t lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+  std::uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+  std::uint64_t high = hi_hi + (hi_lo >> 32) + (cross >> 32);
+  std::uint64_t low = (cross << 32) | (lo_lo & 0xffffffff);
+  return low ^ high;
+#endif
+}
+
+// Load 8 little-endian bytes
+inline std::uint64_t load_u64(const unsigned char* bytes) {
+  std::uint64_t value;
+  std::memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+// Fast non-cryptographic hash for file contents, in the style of xxh3 and
+// wyhash: four independent multiply-fold lanes over 32-byte stripes. Each
+// word is added back after its multiply, so a word equal to its lane's
+// state cannot reset the lane and erase what was hashed before. The seed
+// lets a file be hashed chunk by chunk. Equal hashes only make files
+// candidates; duplicates are confirmed byte by byte.
+std::uint64_t content_hash(const void* data, std::size_t size,
+                           std::uint64_t seed) {
+  constexpr std::uint64_t kSecret[4] = {
+      0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull,
+      0x589965cc75374cc3ull};
+  const auto* bytes = static_cast<const unsigned char*>(data);
+  std::uint64_t lanes[4] = {seed ^ kSecret[0], seed ^ kSecret[1],
+                            seed ^ kSecret[2], seed ^ kSecret[3]};
+
+  std::size_t offset = 0;
+  for (; offset + 32 <= size; offset += 32) {
+    for (int lane = 0; lane < 4; ++lane) {
+      std::uint64_t word = load_u64(bytes + offset + lane * 8);
+      lanes[lane] = multiply_fold(lanes[lane] ^ word, kSecret[lane]) + word;
+    }
+  }
+
+  unsigned char tail[32] = {};
+  std::memcpy(tail, bytes + offset, size - offset);
+  for (int lane = 0; lane < 4; ++lane) {
+    lanes[lane] = multiply_fold(lanes[lane] ^ load_u64(tail + lane * 8),
+                                kSecret[lane] ^ size);
+  }
+  return multiply_fold(lanes[0] ^ lanes[2], lanes[1] ^ lanes[3] ^ size);
+}
+
+// Hash the first limit bytes of a file (all of it when limit is 0), reading
+// in large chunks
+std::uint64_t hash_file_content(const fs::path& path, std::uint64_t limit) {
+  constexpr std::size_t kChunkSize = 1 << 20;
+  std::ifstream in(path, std::ios::binary);
+  current_stats().add(Counter::kSyscalls, 2);  // Open and close
+  if (!in) {
+    throw fs::filesystem_error("cannot open for hashing", path,
+                               std::make_error_code(std::errc::io_error));
+  }
+
+  thread_local std::vector<char> buffer(kChunkSize);
+  std::uint64_t hash = 0;
+  std::uint64_t remaining = limit == 0 ? UINT64_MAX : limit;
+  while (remaining > 0 && in) {
+    std::size_t want = static_cast<std::size_t>(
+        std::min<std::uint64_t>(remaining, buffer.size()));
+    in.read(buffer.data(), static_cast<std::streamsize>(want));
+    current_stats().add(Counter::kSyscalls);
+    std::size_t got = static_cast<std::size_t>(in.gcount());
+    if (got == 0) break;
+    hash = content_hash(buffer.data(), got, hash);
+    remaining -= got;
+  }
+  if (in.bad()) {
+    throw fs::filesystem_error("cannot read for hashing", path,
+                               std::make_error_code(std::errc::io_error));
+  }
+  return hash;
+}
+
+// Compare the contents of two files of the same size, reading both in large
+// chunks
+bool same_content(const fs::path& a, const fs::path& b) {
+  constexpr std::size_t kChunkSize = 1 << 20;
+  std::ifstream in_a(a, std::ios::binary);
+  std::ifstream in_b(b, std::ios::binary);
+  current_stats().add(Counter::kSyscalls, 4);  // Opens and closes
+  if (!in_a || !in_b) {
+    throw fs::filesystem_error("cannot open for comparing", a, b,
+                               std::make_error_code(std::errc::io_error));
+  }
+
+  thread_local std::vector<char> buffer_a(kChunkSize);
+  thread_local std::vector<char> buffer_b(kChunkSize);
+  for (;;) {
+    in_a.read(buffer_a.data(), static_cast<std::streamsize>(kChunkSize));
+    in_b.read(buffer_b.data(), static_cast<std::streamsize>(kChunkSize));
+    current_stats().add(Counter::kSyscalls, 2);
+    auto got = in_a.gcount();
+    if (got != in_b.gcount() ||
+        std::memcmp(buffer_a.data(), buffer_b.data(),
+                    static_cast<std::size_t>(got)) != 0) {
+      return false;
+    }
+    if (got < static_cast<std::streamsize>(kChunkSize)) break;
+  }
+  if (in_a.bad() || in_b.bad()) {
+    throw fs::filesystem_error("cannot read for comparing", a, b,
+                               std::make_error_code(std::errc::io_error));
+  }
+  return true;
+}
+
+// Flush a written file to stable storage
+void sync_file(const fs::path& path) {
+#ifdef _WIN32
+  HANDLE file = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) return;
+  FlushFileBuffers(file);
+  CloseHandle(file);
+#else
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return;
+  fsync(fd);
+  close(fd);
+#endif
+  current_stats().add(Counter::kSyscalls, 3);
+}
+
+// Index file kept in the destination root
+constexpr const char* kIndexFileName = ".splice_index";
+
+// Identifies the index file and its layout version
+constexpr std::uint32_t kIndexMagic = 0x494C5053;  // "SPLI"
+constexpr std::uint32_t kIndexVersion = 1;
+
+// Index file layout: the header, the entries sorted by source hash, the
+// sorted hashes of every lowercased destination path, then the destination
+// paths (relative to the destination root, UTF-8) the entries point into
+struct IndexHeader {
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::uint64_t entry_count;
+  std::uint64_t name_count;
+  std::uint64_t strings_size;
+};
+
+struct IndexEntry {
+  std::uint64_t source_hash;
+  std::uint64_t size;
+  std::int64_t mtime;
+  std::uint32_t destination_offset;
+  std::uint32_t destination_length;
+};
+
+// Persistent record of where each source file was placed. The previous
+// run's index is memory-mapped and searched in place; the placements made
+// by this run are collected and merged into it on save.
+class SampleIndex {
+ public:
+  explicit SampleIndex(fs::path path) : path_(std::move(path)), file_(path_) {
+    if (file_.size() < sizeof(IndexHeader)) return;
+    IndexHeader header;
+    std::memcpy(&header, file_.data(), sizeof(header));
+    std::uint64_t expected = sizeof(IndexHeader) +
+                             header.entry_count * sizeof(IndexEntry) +
+                             header.name_count * sizeof(std::uint64_t) +
+                             header.strings_size;
+    if (header.magic != kIndexMagic || header.version != kIndexVersion ||
+        header.entry_count > file_.size() || header.name_count > file_.size() ||
+        header.strings_size > file_.size() || expected != file_.size()) {
+      return;
+    }
+
+    const char* cursor = file_.data() + sizeof(IndexHeader);
+    entries_ = reinterpret_cast<const IndexEntry*>(cursor);
+    entry_count_ = static_cast<std::size_t>(header.entry_count);
+    cursor += entry_count_ * sizeof(IndexEntry);
+    names_ = reinterpret_cast<const std::uint64_t*>(cursor);
+    name_count_ = static_cast<std::size_t>(header.name_count);
+    cursor += name_count_ * sizeof(std::uint64_t);
+    strings_ = std::string_view(cursor,
+                                static_cast<std::size_t>(header.strings_size));
+  }
+
+  SampleIndex(const SampleIndex&) = delete;
+  SampleIndex& operator=(const SampleIndex&) = delete;
+
+  // Entry recorded for a source path by a previous run, if any
+  const IndexEntry* find(std::uint64_t source_hash) const {
+    const IndexEntry* end = entries_ + entry_count_;
+    const IndexEntry* entry = std::lower_bound(
+        entries_, end, source_hash,
+        [](const IndexEntry& e, std::uint64_t hash) {
+          return e.source_hash < hash;
+        });
+    if (entry == end || entry->source_hash != source_hash) return nullptr;
+    if (std::uint64_t{entry->destination_offset} +
+            entry->destination_length > strings_.size()) {
+      return nullptr;
+    }
+    return entry;
+  }
+
+  // Destination path of an entry, relative to the destination root
+  std::string_view destination_of(const IndexEntry& entry) const {
+    return strings_.substr(entry.destination_offset, entry.destination_length);
+  }
+
+  // True if a previous run placed a file at this destination path
+  bool owns_destination(std::string_view lower_relative_path) const {
+    std::uint64_t hash =
+        hash_bytes(lower_relative_path.data(), lower_relative_path.size());
+    return std::binary_search(names_, names_ + name_count_, hash);
+  }
+
+  // Record a file placed or confirmed by this run. Destinations are
+  // appended to one string pool, so recording does not allocate per file.
+  void record(std::uint64_t source_hash, std::uint64_t size, std::int64_t mtime,
+              std::string_view destination) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    records_.push_back({source_hash, size, mtime,
+                        static_cast<std::uint32_t>(record_strings_.size()),
+                        static_cast<std::uint32_t>(destination.size())});
+    record_strings_.append(destination);
+  }
+
+  // Merge this run's records over the previous index and replace the file
+  void save() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::sort(records_.begin(), records_.end(),
+              [](const IndexEntry& a, const IndexEntry& b) {
+                return a.source_hash < b.source_hash;
+              });
+
+    std::string strings;
+    std::vector<IndexEntry> entries;
+    std::vector<std::uint64_t> names;
+    entries.reserve(records_.size() + entry_count_);
+    names.reserve(records_.size() + entry_count_);
+    std::string lower;
+    auto emit = [&](const IndexEntry& entry, std::string_view destination) {
+      entries.push_back({entry.source_hash, entry.size, entry.mtime,
+                         static_cast<std::uint32_t>(strings.size()),
+                         static_cast<std::uint32_t>(destination.size())});
+      strings.append(destination);
+      lower.clear();
+      append_lower(lower, destination);
+      names.push_back(hash_bytes(lower.data(), lower.size()));
+    };
+    auto emit_record = [&](const IndexEntry& record) {
+      emit(record, std::string_view(record_strings_)
+                       .substr(record.destination_offset,
+                               record.destination_length));
+    };
+
+    auto record = records_.begin();
+    for (std::size_t i = 0; i < entry_count_; ++i) {
+      const IndexEntry& entry = entries_[i];
+      while (record != records_.end() &&
+             record->source_hash < entry.source_hash) {
+        emit_record(*record++);
+      }
+      if (record != records_.end() &&
+          record->source_hash == entry.source_hash) {
+        continue;  // Superseded by this run
+      }
+      emit(entry, destination_of(entry));
+    }
+    for (; record != records_.end(); ++record) emit_record(*record);
+
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+
+    // Unmap before replacing; Windows cannot rename over a mapped file
+    file_.reset();
+    entries_ = nullptr;
+    entry_count_ = 0;
+    names_ = nullptr;
+    name_count_ = 0;
+    strings_ = {};
+
+    fs::path temp_path = path_;
+    temp_path += ".tmp";
+    {
+      std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+      IndexHeader header = {kIndexMagic, kIndexVersion, entries.size(),
+                            names.size(), strings.size()};
+      write_pod(out, header);
+      out.write(reinterpret_cast<const char*>(entries.data()),
+                static_cast<std::streamsize>(entries.size() *
+                                             sizeof(IndexEntry)));
+      out.write(reinterpret_cast<const char*>(names.data()),
+                static_cast<std::streamsize>(names.size() *
+                                             sizeof(std::uint64_t)));
+      out.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+      if (!out) {
+        throw fs::filesystem_error(
+            "cannot write index", temp_path,
+            std::make_error_code(std::errc::io_error));
+      }
+    }
+    sync_file(temp_path);
+    fs::rename(temp_path, path_);
+  }
+
+ private:
+  fs::path path_;
+  MappedFile file_;
+  const IndexEntry* entries_ = nullptr;
+  std::size_t entry_count_ = 0;
+  const std::uint64_t* names_ = nullptr;
+  std::size_t name_count_ = 0;
+  std::string_view strings_;
+
+  std::mutex mutex_;
+  std::vector<IndexEntry> records_;  // Offsets point into record_strings_
+  std::string record_strings_;
+};
+
+// Journal kept in the destination root while a run is in progress
+constexpr const char* kJournalFileName = ".splice_journal";
+
+// Journal records written and synced together
+constexpr std::size_t kJournalBatch = 256;
+
+// Longest a record waits before its batch is written anyway
+constexpr std::chrono::seconds kJournalInterval(1);
+
+// Append-only journal of transfers, so a run that dies before saving the
+// index can be resumed. Each transfer writes an intent record before it
+// starts and a completion record once the file is in place; records are
+// written and synced in batches, costing one fsync per batch instead of one
+// per file. The files of a batch's completions are synced before it is
+// written, with one syncfs of the destination volume on Linux, so no
+// completion outlives a power loss that its file's data did not. A run that
+// finishes saves the index and deletes the journal.
+//
+// Records are tab-separated lines:
+//   I <source hash> <size> <mtime> <destination>
+//   C <source hash>
+class Journal {
+ public:
+  // Start an empty journal at path
+  explicit Journal(fs::path path) : path_(std::move(path)) {
+#ifdef _WIN32
+    out_ = _wfopen(path_.c_str(), L"wb");
+#else
+    out_ = std::fopen(path_.c_str(), "wb");
+#endif
+    if (out_ == nullptr) {
+      throw fs::filesystem_error("cannot create journal", path_,
+                                 std::error_code(errno,
+                                                 std::generic_category()));
+    }
+    last_flush_ = std::chrono::steady_clock::now();
+  }
+
+  ~Journal() {
+    if (out_ != nullptr) std::fclose(out_);
+  }
+
+  Journal(const Journal&) = delete;
+  Journal& operator=(const Journal&) = delete;
+
+  // Record that a file is about to be placed at destination, relative to
+  // the root. Returns false for destinations a line cannot hold, which are
+  // then not journaled.
+  bool intent(std::uint64_t source_hash, std::uint64_t size,
+              std::int64_t mtime, std::string_view destination) {
+    if (destination.find_first_of("\t\r\n") != std::string_view::npos) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ += "I\t";
+    append_number(source_hash);
+    pending_ += '\t';
+    append_number(size);
+    pending_ += '\t';
+    append_number(mtime);
+    pending_ += '\t';
+    pending_.append(destination);
+    pending_ += '\n';
+    added();
+    return true;
+  }
+
+  // Record that the file of an intent is in place at destination
+  void commit(std::uint64_t source_hash, const fs::path& destination) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ += "C\t";
+    append_number(source_hash);
+    pending_ += '\n';
+#ifndef __linux__
+    unsynced_.push_back(destination);
+#else
+    (void)destination;
+    unsynced_ = true;
+#endif
+    added();
+  }
+
+  // Close the journal and delete it; called once the index is saved
+  void discard() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (out_ != nullptr) std::fclose(out_);
+    out_ = nullptr;
+    std::error_code error;
+    fs::remove(path_, error);
+  }
+
+  // Record in the index every transfer a journal shows as completed.
+  // Intents without a completion are left to the next run, since a file of
+  // the right size at their destination may be the copy they were about to
+  // replace; their leftover temporary files are removed. Returns the number
+  // of transfers recovered.
+  static std::size_t replay(const fs::path& path, const fs::path& root,
+                            SampleIndex& index) {
+    std::ifstream in(path, std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+
+    struct Intent {
+      std::uint64_t size;
+      std::int64_t mtime;
+      std::string_view destination;
+      bool done = false;
+    };
+    std::unordered_map<std::uint64_t, Intent> intents;
+    std::size_t start = 0;
+    for (std::size_t end; (end = text.find('\n', start)) != text.npos;
+         start = end + 1) {
+      // A line cut off by the crash has no newline and is never read
+      std::string_view line(text.data() + start, end - start);
+      std::string_view fields[5];
+      std::size_t count = 0;
+      for (std::size_t from = 0; count < 5;) {
+        std::size_t tab = count == 4 ? line.npos : line.find('\t', from);
+        fields[count++] = line.substr(from, tab - from);
+        if (tab == line.npos) break;
+        from = tab + 1;
+      }
+      std::uint64_t hash = 0;
+      if (count < 2 || !parse_number(fields[1], hash)) continue;
+      if (fields[0] == "I" && count == 5) {
+        Intent intent{0, 0, fields[4]};
+        if (parse_number(fields[2], intent.size) &&
+            parse_number(fields[3], intent.mtime) &&
+            !intent.destination.empty()) {
+          intents[hash] = intent;
+        }
+      } else if (fields[0] == "C" && count == 2) {
+        auto found = intents.find(hash);
+        if (found != intents.end()) found->second.done = true;
+      }
+    }
+
+    std::size_t recovered = 0;
+    for (auto& [hash, intent] : intents) {
+      fs::path destination =
+          root / fs::path(std::u8string(intent.destination.begin(),
+                                        intent.destination.end()));
+      if (!intent.done) {
+        std::error_code error;
+        fs::remove(temporary_path(destination), error);
+        continue;
+      }
+      index.record(hash, intent.size, intent.mtime, intent.destination);
+      ++recovered;
+    }
+    return recovered;
+  }
+
+  // Name a file is written under next to its destination before it is
+  // renamed into place
+  static fs::path temporary_path(const fs::path& destination) {
+    fs::path::string_type name = destination.filename().native();
+    name.insert(name.begin(), '.');
+    fs::path temporary = destination.parent_path() / name;
+    temporary += ".part";
+    return temporary;
+  }
+
+ private:
+  template <typename T>
+  void append_number(T value) {
+    char digits[24];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    pending_.append(digits, result.ptr);
+  }
+
+  template <typename T>
+  static bool parse_number(std::string_view text, T& value) {
+    auto result =
+        std::from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == std::errc() && result.ptr == text.data() + text.size();
+  }
+
+  // Write and sync the pending records once a batch is full or old enough
+  void added() {
+    ++pending_records_;
+    auto now = std::chrono::steady_clock::now();
+    if (pending_records_ < kJournalBatch &&
+        now - last_flush_ < kJournalInterval) {
+      return;
+    }
+    last_flush_ = now;
+    pending_records_ = 0;
+    if (out_ == nullptr) return;
+    // Completed files reach the disk before their completions do
+#ifdef __linux__
+    if (unsynced_) {
+      syncfs(fileno(out_));
+      current_stats().add(Counter::kSyscalls);
+      unsynced_ = false;
+    }
+#else
+    for (const auto& path : unsynced_) sync_file(path);
+    unsynced_.clear();
+#endif
+    std::fwrite(pending_.data(), 1, pending_.size(), out_);
+    std::fflush(out_);
+#ifdef _WIN32
+    _commit(_fileno(out_));
+#else
+    fsync(fileno(out_));
+#endif
+    current_stats().add(Counter::kSyscalls, 2);
+    pending_.clear();
+  }
+
+  fs::path path_;
+  std::mutex mutex_;  // Guards everything below
+  std::FILE* out_ = nullptr;
+  std::string pending_;
+  std::size_t pending_records_ = 0;
+#ifdef __linux__
+  bool unsynced_ = false;  // Completions pending since the last syncfs
+#else
+  std::vector<fs::path> unsynced_;  // Files of the pending completions
+#endif
+  std::chrono::steady_clock::time_point last_flush_;
+};
+
+// Catalog of the samples in a destination (see CatalogHeader), so tools can
+// list and search it without walking folders of tens of thousands of files.
+// Like the index, the previous run's catalog is mapped and this run's
+// placements are merged over it on save. Paths are matched ignoring ASCII
+// case, like folder listings, and an entry is replaced when a file is placed
+// at its destination again.
+class Catalog {
+ public:
+  explicit Catalog(fs::path path) : path_(std::move(path)) { map(); }
+
+  Catalog(const Catalog&) = delete;
+  Catalog& operator=(const Catalog&) = delete;
+
+  // True if the previous catalog lists a sample at this destination path,
+  // relative to the root
+  bool contains(std::string_view relative_path) const {
+    thread_local std::string lower_path;
+    lower_path.clear();
+    append_lower(lower_path, relative_path);
+    return previous_.contains(lower_path);
+  }
+
+  // Record a sample placed at a destination path relative to the root.
+  // Paths are appended to one string pool, so recording does not allocate
+  // per file.
+  void record(std::string_view relative_path, std::uint64_t size,
+              std::int64_t mtime, double duration) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    records_.push_back({static_cast<std::uint32_t>(record_strings_.size()),
+                        static_cast<std::uint32_t>(relative_path.size()), size,
+                        mtime, duration_ms(duration)});
+    record_strings_.append(relative_path);
+  }
+
+  // Merge this run's records over the previous catalog, replace the file
+  // and map the new one in place of the previous. Given the index saved in
+  // the same place, previous entries it does not own, whose files were
+  // superseded or placed elsewhere, are dropped.
+  void save(const SampleIndex* index) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Every sample once, taking the latest record of a path first and the
+    // previous catalog last
+    struct Sample {
+      std::string_view folder;
+      std::string_view name;
+      std::uint64_t size;
+      std::int64_t mtime;
+      std::uint32_t duration_ms;
+    };
+    std::vector<Sample> samples;
+    samples.reserve(records_.size() + entries_.size());
+    NameSet seen;
+    std::string lower_path;
+    auto add = [&](const Sample& sample, bool previous) {
+      lower_path_of(sample.folder, sample.name, lower_path);
+      if (previous && index != nullptr &&
+          !index->owns_destination(lower_path)) {
+        return;
+      }
+      if (seen.insert(lower_path)) samples.push_back(sample);
+    };
+    for (auto record = records_.rbegin(); record != records_.rend();
+         ++record) {
+      std::string_view path = std::string_view(record_strings_)
+                                  .substr(record->path_offset,
+                                          record->path_length);
+      auto [folder, name] = split_path(path);
+      add({folder, name, record->size, record->mtime, record->duration_ms},
+          false);
+    }
+    for (const auto& entry : entries_) {
+      add({folder_path_of(folders_[entry.folder]), name_of(entry), entry.size,
+           entry.mtime, entry.duration_ms},
+          true);
+    }
+    std::sort(samples.begin(), samples.end(),
+              [](const Sample& a, const Sample& b) {
+                return std::tie(a.folder, a.name) <
+                       std::tie(b.folder, b.name);
+              });
+
+    std::vector<CatalogFolder> folders;
+    std::vector<CatalogEntry> entries;
+    std::string strings;
+    std::string lower;
+    entries.reserve(samples.size());
+    for (const auto& sample : samples) {
+      if (folders.empty() ||
+          std::string_view(strings).substr(folders.back().path_offset,
+                                           folders.back().path_length) !=
+              sample.folder) {
+        folders.push_back({static_cast<std::uint32_t>(strings.size()),
+                           static_cast<std::uint32_t>(sample.folder.size()),
+                           static_cast<std::uint32_t>(entries.size()), 0});
+        strings.append(sample.folder);
+      }
+      ++folders.back().entry_count;
+      lower.clear();
+      append_lower(lower, sample.name);
+      entries.push_back({sample.size, sample.mtime,
+                         hash_bytes(lower.data(), lower.size()),
+                         static_cast<std::uint32_t>(strings.size()),
+                         static_cast<std::uint32_t>(sample.name.size()),
+                         static_cast<std::uint32_t>(folders.size() - 1),
+                         sample.duration_ms});
+      strings.append(sample.name);
+    }
+    std::vector<std::uint32_t> by_name(entries.size());
+    for (std::size_t i = 0; i < by_name.size(); ++i) {
+      by_name[i] = static_cast<std::uint32_t>(i);
+    }
+    std::sort(by_name.begin(), by_name.end(),
+              [&entries](std::uint32_t a, std::uint32_t b) {
+                return entries[a].name_hash < entries[b].name_hash;
+              });
+
+    // Unmap before replacing; Windows cannot rename over a mapped file
+    file_.reset();
+    folders_ = {};
+    entries_ = {};
+    strings_ = {};
+    previous_ = NameSet();
+
+    fs::path temp_path = path_;
+    temp_path += ".tmp";
+    {
+      std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+      CatalogHeader header = {kCatalogMagic, kCatalogVersion, folders.size(),
+                              entries.size(), strings.size()};
+      write_pod(out, header);
+      out.write(reinterpret_cast<const char*>(folders.data()),
+                static_cast<std::streamsize>(folders.size() *
+                                             sizeof(CatalogFolder)));
+      out.write(reinterpret_cast<const char*>(entries.data()),
+                static_cast<std::streamsize>(entries.size() *
+                                             sizeof(CatalogEntry)));
+      out.write(reinterpret_cast<const char*>(by_name.data()),
+                static_cast<std::streamsize>(by_name.size() *
+                                             sizeof(std::uint32_t)));
+      out.write(strings.data(), static_cast<std::streamsize>(strings.size()));
+      if (!out) {
+        throw fs::filesystem_error(
+            "cannot write catalog", temp_path,
+            std::make_error_code(std::errc::io_error));
+      }
+    }
+    sync_file(temp_path);
+    fs::rename(temp_path, path_);
+    records_.clear();
+    record_strings_.clear();
+    map();
+  }
+
+ private:
+  // A placement of this run; the path points into record_strings_
+  struct Record {
+    std::uint32_t path_offset;
+    std::uint32_t path_length;
+    std::uint64_t size;
+    std::int64_t mtime;
+    std::uint32_t duration_ms;
+  };
+
+  // Folder and name of a relative path
+  static std::pair<std::string_view, std::string_view> split_path(
+      std::string_view relative_path) {
+    auto slash = relative_path.rfind('/');
+    if (slash == std::string_view::npos) return {{}, relative_path};
+    return {relative_path.substr(0, slash), relative_path.substr(slash + 1)};
+  }
+
+  // Map the catalog file, and use it if it is valid
+  void map() {
+    file_.emplace(path_);
+    if (file_->size() < sizeof(CatalogHeader)) return;
+    CatalogHeader header;
+    std::memcpy(&header, file_->data(), sizeof(header));
+    if (header.magic != kCatalogMagic || header.version != kCatalogVersion ||
+        header.folder_count > file_->size() ||
+        header.entry_count > file_->size() ||
+        header.strings_size > file_->size() ||
+        sizeof(CatalogHeader) + header.folder_count * sizeof(CatalogFolder) +
+                header.entry_count *
+                    (sizeof(CatalogEntry) + sizeof(std::uint32_t)) +
+                header.strings_size !=
+            file_->size()) {
+      return;
+    }
+
+    const char* cursor = file_->data() + sizeof(CatalogHeader);
+    const auto* folders = reinterpret_cast<const CatalogFolder*>(cursor);
+    cursor += header.folder_count * sizeof(CatalogFolder);
+    const auto* entries = reinterpret_cast<const CatalogEntry*>(cursor);
+    cursor += header.entry_count *
+              (sizeof(CatalogEntry) + sizeof(std::uint32_t));
+    std::string_view strings(cursor,
+                             static_cast<std::size_t>(header.strings_size));
+
+    // Use nothing from a catalog that points outside itself
+    auto in_strings = [&](std::uint32_t offset, std::uint32_t length) {
+      return std::uint64_t{offset} + length <= strings.size();
+    };
+    for (std::uint64_t i = 0; i < header.folder_count; ++i) {
+      const CatalogFolder& folder = folders[i];
+      if (!in_strings(folder.path_offset, folder.path_length) ||
+          std::uint64_t{folder.first_entry} + folder.entry_count >
+              header.entry_count) {
+        return;
+      }
+    }
+    for (std::uint64_t i = 0; i < header.entry_count; ++i) {
+      const CatalogEntry& entry = entries[i];
+      if (!in_strings(entry.name_offset, entry.name_length) ||
+          entry.folder >= header.folder_count) {
+        return;
+      }
+    }
+    folders_ = {folders, static_cast<std::size_t>(header.folder_count)};
+    entries_ = {entries, static_cast<std::size_t>(header.entry_count)};
+    strings_ = strings;
+
+    std::string lower_path;
+    for (const auto& entry : entries_) {
+      lower_path_of(folder_path_of(folders_[entry.folder]), name_of(entry),
+                    lower_path);
+      previous_.insert(lower_path);
+    }
+  }
+
+  // Lowercased relative path of a name in a folder, as folders match names
+  static void lower_path_of(std::string_view folder, std::string_view name,
+                            std::string& lower_path) {
+    lower_path.clear();
+    append_lower(lower_path, folder);
+    if (!folder.empty()) lower_path.push_back('/');
+    append_lower(lower_path, name);
+  }
+
+  // Whole milliseconds of a duration in seconds, 0 when unknown
+  static std::uint32_t duration_ms(double seconds) {
+    if (!(seconds > 0)) return 0;
+    return static_cast<std::uint32_t>(
+        std::min<long long>(std::llround(seconds * 1000), UINT32_MAX));
+  }
+
+  std::string_view folder_path_of(const CatalogFolder& folder) const {
+    return strings_.substr(folder.path_offset, folder.path_length);
+  }
+  std::string_view name_of(const CatalogEntry& entry) const {
+    return strings_.substr(entry.name_offset, entry.name_length);
+  }
+
+  fs::path path_;
+  std::optional<MappedFile> file_;
+  std::span<const CatalogFolder> folders_;
+  std::span<const CatalogEntry> entries_;
+  std::string_view strings_;
+  NameSet previous_;  // Lowercased paths of the entries
+
+  std::mutex mutex_;
+  std::vector<Record> records_;
+  std::string record_strings_;
+};
+
+// Open the index of a destination. A journal left by an interrupted run is
+// first folded into the index, which is saved right away, so the files that
+// run placed are skipped as unchanged. Unless planning, a new journal is
+// started for this run.
+void open_index(const fs::path& root, bool planning,
+                std::optional<SampleIndex>& index,
+                std::optional<Journal>& journal) {
+  fs::path index_path = root / kIndexFileName;
+  fs::path journal_path = root / kJournalFileName;
+  index.emplace(index_path);
+  if (planning) return;
+  if (fs::exists(journal_path)) {
+    std::size_t recovered = Journal::replay(journal_path, root, *index);
+    index->save();
+    index.emplace(index_path);
+    logger.log(LogLevel::kInfo, "journal-replayed",
+               {{"destination", root}, {"recovered", recovered}});
+  }
+  journal.emplace(journal_path);
+}
+
+// What a directory entry refers to
+enum class EntryType { kFile, kDirectory, kOther };
+
+// One entry of a directory listing. Size, modification time (in
+// fs::file_time_type ticks) and file ID (inode or NTFS file reference) are
+// filled in for files whose metadata was requested.
+struct ListedEntry {
+  NativeStringView name;
+  EntryType type = EntryType::kOther;
+  std::uint64_t size = 0;
+  std::int64_t mtime = 0;
+  std::uint64_t file_id = 0;
+};
+
+// A source file found by walk_directory, with its listed metadata
+struct SourceFile {
+  fs::path path;
+  std::uint64_t size = 0;
+  std::int64_t mtime = 0;
+  std::uint64_t file_id = 0;
+};
+
+// Size of the buffer each batch of directory entries is read into
+constexpr std::size_t kListingBufferSize = 64 * 1024;
+
+using EntryCallback = std::function<void(const ListedEntry&)>;
+using MetadataFilter = std::function<bool(NativeStringView)>;
+
+#ifdef _WIN32
+// Modification time in fs::file_time_type ticks; both count 100 ns
+// intervals since 1601
+std::int64_t file_time_ticks(const LARGE_INTEGER& time) {
+  return time.QuadPart;
+}
+
+// List a directory with FindFirstFileExW, for file systems that do not
+// support by-handle directory queries
+void list_directory_find(const fs::path& dir, const EntryCallback& on_entry,
+                         std::error_code& error) {
+  WIN32_FIND_DATAW data;
+  HANDLE find = FindFirstFileExW((dir / L"*").c_str(), FindExInfoBasic, &data,
+                                 FindExSearchNameMatch, nullptr,
+                                 FIND_FIRST_EX_LARGE_FETCH);
+  if (find == INVALID_HANDLE_VALUE) {
+    error.assign(static_cast<int>(GetLastError()), std::system_category());
+    return;
+  }
+  current_stats().add(Counter::kSyscalls, 2);  // FindFirstFileExW and FindClose
+  do {
+    NativeStringView name(data.cFileName);
+    if (name == L"." || name == L"..") continue;
+    ListedEntry entry;
+    entry.name = name;
+    entry.type = data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY
+                     ? EntryType::kDirectory
+                     : EntryType::kFile;
+    entry.size = (std::uint64_t{data.nFileSizeHigh} << 32) | data.nFileSizeLow;
+    LARGE_INTEGER time;
+    time.LowPart = data.ftLastWriteTime.dwLowDateTime;
+    time.HighPart = static_cast<LONG>(data.ftLastWriteTime.dwHighDateTime);
+    entry.mtime = file_time_ticks(time);
+    on_entry(entry);
+  } while (FindNextFileW(find, &data));
+  DWORD last_error = GetLastError();
+  if (last_error != ERROR_NO_MORE_FILES) {
+    error.assign(static_cast<int>(last_error), std::system_category());
+  }
+  FindClose(find);
+}
+
+// List a directory in large batches with
+// GetFileInformationByHandleEx(FileIdBothDirectoryInfo), which returns name,
+// attributes, size, times and file ID for every entry without further calls
+void list_directory(const fs::path& dir, const EntryCallback& on_entry,
+                    const MetadataFilter&, std::error_code& error) {
+  HANDLE handle =
+      CreateFileW(dir.c_str(), FILE_LIST_DIRECTORY,
+                  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                  nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    error.assign(static_cast<int>(GetLastError()), std::system_category());
+    return;
+  }
+  current_stats().add(Counter::kSyscalls, 2);  // CreateFileW and CloseHandle
+
+  thread_local std::vector<std::uint64_t> storage(kListingBufferSize / 8);
+  char* buffer = reinterpret_cast<char*>(storage.data());
+  FILE_INFO_BY_HANDLE_CLASS info_class = FileIdBothDirectoryRestartInfo;
+  for (;;) {
+    current_stats().add(Counter::kSyscalls);
+    if (!GetFileInformationByHandleEx(handle, info_class, buffer,
+                                      kListingBufferSize)) {
+      DWORD last_error = GetLastError();
+      CloseHandle(handle);
+      if (last_error == ERROR_NO_MORE_FILES) return;
+      if (info_class == FileIdBothDirectoryRestartInfo &&
+          (last_error == ERROR_INVALID_PARAMETER ||
+           last_error == ERROR_NOT_SUPPORTED)) {
+        list_directory_find(dir, on_entry, error);
+        return;
+      }
+      error.assign(static_cast<int>(last_error), std::system_category());
+      return;
+    }
+    info_class = FileIdBothDirectoryInfo;
+
+    for (std::size_t offset = 0;;) {
+      const auto* info =
+          reinterpret_cast<const FILE_ID_BOTH_DIR_INFO*>(buffer + offset);
+      NativeStringView name(info->FileName,
+                            info->FileNameLength / sizeof(WCHAR));
+      if (name != L"." && name != L"..") {
+        ListedEntry entry;
+        entry.name = name;
+        entry.type = info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY
+                         ? EntryType::kDirectory
+                         : EntryType::kFile;
+        entry.size = static_cast<std::uint64_t>(info->EndOfFile.QuadPart);
+        entry.mtime = file_time_ticks(info->LastWriteTime);
+        entry.file_id = static_cast<std::uint64_t>(info->FileId.QuadPart);
+        on_entry(entry);
+      }
+      if (info->NextEntryOffset == 0) break;
+      offset += info->NextEntryOffset;
+    }
+  }
+}
+#elif defined(__linux__)
+// Record layout returned by getdents64
+struct LinuxDirent64 {
+  std::uint64_t d_ino;
+  std::int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[256];
+};
+
+// Modification time in fs::file_time_type ticks
+std::int64_t file_time_ticks(const struct stat& info) {
+  auto since_epoch = std::chrono::seconds(info.st_mtim.tv_sec) +
+                     std::chrono::nanoseconds(info.st_mtim.tv_nsec);
+  auto system_time = std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          since_epoch));
+  return static_cast<std::int64_t>(std::chrono::file_clock::from_sys(
+                                       system_time)
+                                       .time_since_epoch()
+                                       .count());
+}
+
+// List a directory in large batches with getdents64. Entry types come from
+// d_type; only entries of unknown type or symlinks, and files passing the
+// metadata filter, cost an fstatat relative to the open directory.
+void list_directory(const fs::path& dir, const EntryCallback& on_entry,
+                    const MetadataFilter& wants_metadata,
+                    std::error_code& error) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    error.assign(errno, std::generic_category());
+    return;
+  }
+  current_stats().add(Counter::kSyscalls, 2);  // open and close
+
+  thread_local std::vector<std::uint64_t> storage(kListingBufferSize / 8);
+  char* buffer = reinterpret_cast<char*>(storage.data());
+  for (;;) {
+    current_stats().add(Counter::kSyscalls);
+    long count = syscall(SYS_getdents64, fd, buffer, kListingBufferSize);
+    if (count < 0) {
+      error.assign(errno, std::generic_category());
+      break;
+    }
+    if (count == 0) break;
+
+    for (long offset = 0; offset < count;) {
+      const auto* record =
+          reinterpret_cast<const LinuxDirent64*>(buffer + offset);
+      offset += record->d_reclen;
+      NativeStringView name(record->d_name);
+      if (name == "." || name == "..") continue;
+
+      ListedEntry entry;
+      entry.name = name;
+      entry.file_id = record->d_ino;
+      entry.type = record->d_type == DT_DIR   ? EntryType::kDirectory
+                   : record->d_type == DT_REG ? EntryType::kFile
+                                              : EntryType::kOther;
+
+      bool unknown = record->d_type == DT_UNKNOWN || record->d_type == DT_LNK;
+      if (unknown || (entry.type == EntryType::kFile && wants_metadata &&
+                      wants_metadata(name))) {
+        struct stat info;
+        current_stats().add(Counter::kSyscalls);
+        if (fstatat(fd, record->d_name, &info, 0) != 0) continue;
+        entry.type = S_ISDIR(info.st_mode)   ? EntryType::kDirectory
+                     : S_ISREG(info.st_mode) ? EntryType::kFile
+                                             : EntryType::kOther;
+        entry.size = static_cast<std::uint64_t>(info.st_size);
+        entry.mtime = file_time_ticks(info);
+        entry.file_id = info.st_ino;
+      }
+      on_entry(entry);
+    }
+  }
+  close(fd);
+}
+#else
+// Portable listing through std::filesystem
+void list_directory(const fs::path& dir, const EntryCallback& on_entry,
+                    const MetadataFilter& wants_metadata,
+                    std::error_code& error) {
+  current_stats().add(Counter::kSyscalls);
+  for (fs::directory_iterator it(dir, error), end; !error && it != end;
+       it.increment(error)) {
+    const fs::path& path = it->path();
+    ListedEntry entry;
+    entry.name = path.filename().native();
+    std::error_code status_error;
+    entry.type = it->is_directory(status_error)      ? EntryType::kDirectory
+                 : it->is_regular_file(status_error) ? EntryType::kFile
+                                                     : EntryType::kOther;
+    if (entry.type == EntryType::kFile && wants_metadata &&
+        wants_metadata(entry.name)) {
+      entry.size = it->file_size(status_error);
+      entry.mtime = static_cast<std::int64_t>(
+          it->last_write_time(status_error).time_since_epoch().count());
+    }
+    on_entry(entry);
+  }
+}
+#endif
+
+// Walk a directory tree and pass every audio file to the callback. Each
+// directory is listed in one batch pass, and subdirectories are visited
+// after their parent's listing is closed. Files are handed on after the
+// listing too, so time spent waiting on a full queue is not counted as
+// listing time.
+void walk_directory(const fs::path& source,
+                    const std::function<void(SourceFile&&)>& on_file) {
+  std::vector<fs::path> subdirectories;
+  std::vector<SourceFile> files;
+  std::error_code error;
+  {
+    StageTimer timer(Stage::kList);
+    list_directory(
+        source,
+        [&](const ListedEntry& entry) {
+          if (entry.type == EntryType::kDirectory) {
+            subdirectories.push_back(source / entry.name);
+          } else if (entry.type == EntryType::kFile &&
+                     has_audio_extension(entry.name)) {
+            files.push_back({source / entry.name, entry.size, entry.mtime,
+                             entry.file_id});
+          }
+        },
+        has_audio_extension, error);
+  }
+  current_stats().add(Counter::kDirectories);
+  current_stats().add(Counter::kEnumerated, files.size());
+  for (auto& file : files) on_file(std::move(file));
+  if (error) {
+    logger.log(LogLevel::kError, "list-failed",
+               {{"path", source}, {"error", error.message()}});
+  }
+
+  for (const auto& subdirectory : subdirectories) {
+    walk_directory(subdirectory, on_file);
+  }
+}
+
+// Read the metadata of one source file the way a listing reports it.
+// Returns false if the path is not a regular file.
+bool stat_source_file(const fs::path& path, SourceFile& file) {
+  file.path = path;
+  current_stats().add(Counter::kSyscalls);
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data) ||
+      (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+    return false;
+  }
+  file.size = (std::uint64_t{data.nFileSizeHigh} << 32) | data.nFileSizeLow;
+  LARGE_INTEGER time;
+  time.LowPart = data.ftLastWriteTime.dwLowDateTime;
+  time.HighPart = static_cast<LONG>(data.ftLastWriteTime.dwHighDateTime);
+  file.mtime = file_time_ticks(time);
+  file.file_id = 0;
+#elif defined(__linux__)
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) return false;
+  file.size = static_cast<std::uint64_t>(info.st_size);
+  file.mtime = file_time_ticks(info);
+  file.file_id = info.st_ino;
+#else
+  std::error_code error;
+  if (!fs::is_regular_file(path, error)) return false;
+  file.size = fs::file_size(path, error);
+  file.mtime = static_cast<std::int64_t>(
+      fs::last_write_time(path, error).time_since_epoch().count());
+  file.file_id = 0;
+  if (error) return false;
+#endif
+  return true;
+}
+
+// A burst of changes is handed on once no change has come for
+// kWatchSettle, or kWatchMaxDelay after its first change at the latest
+constexpr std::chrono::milliseconds kWatchSettle(2000);
+constexpr std::chrono::seconds kWatchMaxDelay(30);
+
+// Platforms without change notifications rescan this often
+constexpr std::chrono::seconds kWatchPollInterval(10);
+
+// How often a watch waiting for changes checks whether to stop
+constexpr std::chrono::milliseconds kWatchStopInterval(1000);
+
+// A change seen by a SourceWatcher: a file or folder under the source of a
+// job that appeared or was written, or, after notifications were lost, the
+// whole source folder
+struct WatchedChange {
+  std::size_t job;
+  fs::path path;
+  bool rescan = false;  // path is the job's source folder
+};
+
+// Watches the source folders of jobs for files that appear or change, with
+// inotify on Linux and ReadDirectoryChangesW on Windows. Elsewhere it falls
+// back to rescanning, which the index keeps cheap for unchanged files.
+// Folders under a job's destination are not watched, so placing files never
+// triggers more work.
+class SourceWatcher {
+ public:
+  SourceWatcher() {
+#ifdef __linux__
+    fd_ = inotify_init1(IN_CLOEXEC);
+    if (fd_ < 0) {
+      throw fs::filesystem_error(
+          "cannot watch folders",
+          std::error_code(errno, std::generic_category()));
+    }
+#endif
+  }
+
+  ~SourceWatcher() {
+#ifdef _WIN32
+    for (auto& root : roots_) {
+      CancelIoEx(root->handle, &root->overlapped);
+      DWORD bytes;
+      GetOverlappedResult(root->handle, &root->overlapped, &bytes, TRUE);
+      CloseHandle(root->handle);
+      CloseHandle(root->overlapped.hEvent);
+    }
+#elif defined(__linux__)
+    close(fd_);
+#endif
+  }
+
+  SourceWatcher(const SourceWatcher&) = delete;
+  SourceWatcher& operator=(const SourceWatcher&) = delete;
+
+  // Watch the source folder of a job. Throws fs::filesystem_error if it
+  // cannot be watched.
+  void add_root(const fs::path& source, const fs::path& destination,
+                std::size_t job) {
+    sources_.push_back({job, source, true});
+    excluded_.push_back(fs::absolute(destination).lexically_normal());
+#ifdef _WIN32
+    auto root = std::make_unique<WatchedRoot>();
+    root->source = source;
+    root->job = job;
+    root->handle = CreateFileW(
+        source.c_str(), FILE_LIST_DIRECTORY,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+        OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+        nullptr);
+    if (root->handle == INVALID_HANDLE_VALUE) {
+      throw fs::filesystem_error(
+          "cannot watch", source,
+          std::error_code(static_cast<int>(GetLastError()),
+                          std::system_category()));
+    }
+    root->overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    root->buffer.resize(kListingBufferSize / sizeof(DWORD));
+    arm(*root);
+    roots_.push_back(std::move(root));
+#elif defined(__linux__)
+    watch_tree(source, job);
+#endif
+  }
+
+  // Block until changes arrive, then until they settle, and return them.
+  // Returns early, possibly with nothing, once stop is requested.
+  std::vector<WatchedChange> next_batch(const std::stop_token& stop) {
+    std::vector<WatchedChange> changes;
+    while (changes.empty() && !stop.stop_requested()) {
+      collect(changes, kWatchStopInterval);
+    }
+    auto first = std::chrono::steady_clock::now();
+    while (!stop.stop_requested() &&
+           std::chrono::steady_clock::now() - first < kWatchMaxDelay &&
+           collect(changes, kWatchSettle)) {
+    }
+    return changes;
+  }
+
+  // Check if a path is inside the destination of one of the jobs
+  bool excluded(const fs::path& path) const {
+    fs::path normal = fs::absolute(path).lexically_normal();
+    for (const auto& destination : excluded_) {
+      auto mismatch = std::mismatch(normal.begin(), normal.end(),
+                                    destination.begin(), destination.end());
+      if (mismatch.second == destination.end()) return true;
+    }
+    return false;
+  }
+
+ private:
+#ifdef _WIN32
+  // A watched source folder with its pending overlapped read
+  struct WatchedRoot {
+    fs::path source;
+    std::size_t job = 0;
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    OVERLAPPED overlapped = {};
+    std::vector<DWORD> buffer;
+  };
+
+  // Queue the next read of changes anywhere under a root
+  void arm(WatchedRoot& root) {
+    ResetEvent(root.overlapped.hEvent);
+    current_stats().add(Counter::kSyscalls);
+    if (!ReadDirectoryChangesW(
+            root.handle, root.buffer.data(),
+            static_cast<DWORD>(root.buffer.size() * sizeof(DWORD)), TRUE,
+            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+                FILE_NOTIFY_CHANGE_LAST_WRITE,
+            nullptr, &root.overlapped, nullptr)) {
+      throw fs::filesystem_error(
+          "cannot watch", root.source,
+          std::error_code(static_cast<int>(GetLastError()),
+                          std::system_category()));
+    }
+  }
+
+  // Wait up to timeout for changes and add them. Returns false if none
+  // came.
+  bool collect(std::vector<WatchedChange>& changes,
+               std::chrono::milliseconds timeout) {
+    std::vector<HANDLE> events;
+    for (auto& root : roots_) events.push_back(root->overlapped.hEvent);
+    DWORD wait = WaitForMultipleObjects(
+        static_cast<DWORD>(events.size()), events.data(), FALSE,
+        static_cast<DWORD>(timeout.count()));
+    if (wait < WAIT_OBJECT_0 || wait >= WAIT_OBJECT_0 + events.size()) {
+      return false;
+    }
+    WatchedRoot& root = *roots_[wait - WAIT_OBJECT_0];
+    DWORD bytes = 0;
+    if (!GetOverlappedResult(root.handle, &root.overlapped, &bytes, FALSE) ||
+        bytes == 0) {
+      // The buffer overflowed and the changes are lost
+      changes.push_back({root.job, root.source, true});
+    } else {
+      const char* data = reinterpret_cast<const char*>(root.buffer.data());
+      for (DWORD offset = 0;;) {
+        const auto* info =
+            reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(data + offset);
+        if (info->Action == FILE_ACTION_ADDED ||
+            info->Action == FILE_ACTION_MODIFIED ||
+            info->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+          changes.push_back(
+              {root.job,
+               root.source / std::wstring_view(info->FileName,
+                                               info->FileNameLength /
+                                                   sizeof(WCHAR))});
+        }
+        if (info->NextEntryOffset == 0) break;
+        offset += info->NextEntryOffset;
+      }
+    }
+    arm(root);
+    return true;
+  }
+
+  std::vector<std::unique_ptr<WatchedRoot>> roots_;
+#elif defined(__linux__)
+  // A watched folder
+  struct WatchedFolder {
+    fs::path path;
+    std::size_t job;
+  };
+
+  static constexpr std::uint32_t kWatchMask =
+      IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR;
+
+  // Watch a folder and every folder below it, except destinations
+  void watch_tree(const fs::path& folder, std::size_t job) {
+    if (excluded(folder)) return;
+    current_stats().add(Counter::kSyscalls);
+    int wd = inotify_add_watch(fd_, folder.c_str(), kWatchMask);
+    if (wd < 0) {
+      // Usually fs.inotify.max_user_watches running out
+      logger.log(LogLevel::kWarning, "watch-failed",
+                 {{"path", folder},
+                  {"error", std::generic_category().message(errno)}});
+      return;
+    }
+    watched_[wd] = {folder, job};
+
+    std::vector<fs::path> subdirectories;
+    std::error_code error;
+    list_directory(
+        folder,
+        [&](const ListedEntry& entry) {
+          if (entry.type == EntryType::kDirectory) {
+            subdirectories.push_back(folder / entry.name);
+          }
+        },
+        nullptr, error);
+    for (const auto& subdirectory : subdirectories) {
+      watch_tree(subdirectory, job);
+    }
+  }
+
+  // Wait up to timeout for changes and add them. Returns false if none
+  // came.
+  bool collect(std::vector<WatchedChange>& changes,
+               std::chrono::milliseconds timeout) {
+    pollfd ready = {fd_, POLLIN, 0};
+    if (poll(&ready, 1, static_cast<int>(timeout.count())) <= 0) return false;
+    alignas(inotify_event) char buffer[kListingBufferSize];
+    current_stats().add(Counter::kSyscalls);
+    ssize_t length = read(fd_, buffer, sizeof(buffer));
+    if (length <= 0) return false;
+
+    for (ssize_t offset = 0; offset < length;) {
+      const auto* event =
+          reinterpret_cast<const inotify_event*>(buffer + offset);
+      offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+      if (event->mask & IN_Q_OVERFLOW) {
+        changes.insert(changes.end(), sources_.begin(), sources_.end());
+        continue;
+      }
+      auto found = watched_.find(event->wd);
+      if (found == watched_.end()) continue;
+      if (event->mask & IN_IGNORED) {
+        watched_.erase(found);
+        continue;
+      }
+      if (event->len == 0) continue;
+
+      WatchedFolder folder = found->second;
+      fs::path path = folder.path / event->name;
+      if (event->mask & IN_ISDIR) {
+        // A new folder may have filled up before its watch was added; it is
+        // listed as a whole
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+          watch_tree(path, folder.job);
+          changes.push_back({folder.job, std::move(path)});
+        }
+      } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        changes.push_back({folder.job, std::move(path)});
+      }
+    }
+    return true;
+  }
+
+  int fd_ = -1;
+  std::unordered_map<int, WatchedFolder> watched_;
+#else
+  // Without notifications, every source is rescanned now and then. Waits
+  // up to timeout for the next rescan; returns false if it is not due yet.
+  bool collect(std::vector<WatchedChange>& changes,
+               std::chrono::milliseconds timeout) {
+    auto due = last_scan_ + kWatchPollInterval;
+    auto now = std::chrono::steady_clock::now();
+    if (now < due) {
+      std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(
+          timeout, due - now));
+      if (std::chrono::steady_clock::now() < due) return false;
+    }
+    last_scan_ = std::chrono::steady_clock::now();
+    changes.insert(changes.end(), sources_.begin(), sources_.end());
+    return true;
+  }
+
+  std::chrono::steady_clock::time_point last_scan_ =
+      std::chrono::steady_clock::now();
+#endif
+
+  std::vector<WatchedChange> sources_;  // A rescan of each job's source
+  std::vector<fs::path> excluded_;      // Absolute destinations
+};
+
+// Names present and claimed in one destination folder. The folder is listed
+// once when first used; from then on whether a name exists and the next free
+// "_<n>" suffix of every stem are known, so checking a destination and
+// resolving a collision cost no file system calls.
+class FolderNames {
+ public:
+  explicit FolderNames(const fs::path& folder) : path_(folder) {
+    std::error_code error;
+    std::string lower_name;
+    list_directory(
+        folder,
+        [&](const ListedEntry& entry) {
+          lower_name.clear();
+          append_utf8(lower_name, entry.name, true);
+          existing_.insert(lower_name);
+          note_suffix(lower_name);
+        },
+        nullptr, error);
+    created_ = !error;
+  }
+
+  FolderNames(const FolderNames&) = delete;
+  FolderNames& operator=(const FolderNames&) = delete;
+
+  // Create the folder and its parents unless it was listed or created
+  // before
+  void create() {
+    if (created_) return;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (created_) return;
+    current_stats().add(Counter::kSyscalls);
+    fs::create_directories(path_);
+    created_ = true;
+  }
+
+  // Number of distinct names listed in the folder or claimed by this run
+  std::size_t size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return existing_.size() + added_;
+  }
+
+  // Path of the folder, as it was first asked for
+  const fs::path& path() const { return path_; }
+
+  // Check if a lowercased name was in the folder when it was listed
+  bool listed(std::string_view lower_name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return existing_.contains(lower_name);
+  }
+
+  // Check if a lowercased name is in the folder, either listed or claimed by
+  // this run
+  bool contains(std::string_view lower_name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return existing_.contains(lower_name) || claimed_.contains(lower_name);
+  }
+
+  // Claim a lowercased name for a file placed by this run. Returns false if
+  // another file of this run already claimed it.
+  bool claim(std::string_view lower_name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!claimed_.insert(lower_name)) return false;
+    if (!existing_.contains(lower_name)) ++added_;
+    note_suffix(lower_name);
+    return true;
+  }
+
+  // Claim and return the first free "<stem>_<n><ext>" name for a filename
+  fs::path claim_indexed(const fs::path& filename) {
+    std::string key;
+    append_utf8(key, filename.stem().native(), true);
+    key += '/';
+    append_utf8(key, filename.extension().native(), true);
+    std::string lower_name;
+    std::lock_guard<std::mutex> lock(mutex_);
+    int& next = next_suffix_[key];
+    for (;;) {
+      fs::path indexed = append_index_to_filename(filename, next++);
+      lower_name.clear();
+      append_utf8(lower_name, indexed.native(), true);
+      if (claimed_.insert(lower_name)) {
+        if (!existing_.contains(lower_name)) ++added_;
+        return indexed;
+      }
+    }
+  }
+
+ private:
+  // Advance the suffix counter of "<stem>_<n><ext>" names past n
+  void note_suffix(std::string_view lower_name) {
+    std::string_view stem = lower_name;
+    std::string_view extension;
+    auto dot = lower_name.rfind('.');
+    if (dot != std::string_view::npos && dot != 0) {
+      stem = lower_name.substr(0, dot);
+      extension = lower_name.substr(dot);
+    }
+    auto underscore = stem.rfind('_');
+    if (underscore == std::string_view::npos ||
+        underscore + 1 == stem.size() || stem.size() - underscore > 10) {
+      return;
+    }
+    int suffix = 0;
+    for (unsigned char c : stem.substr(underscore + 1)) {
+      if (!std::isdigit(c)) return;
+      suffix = suffix * 10 + (c - '0');
+    }
+    thread_local std::string key;
+    key.assign(stem.substr(0, underscore));
+    key += '/';
+    key += extension;
+    auto found = next_suffix_.find(std::string_view(key));
+    if (found == next_suffix_.end()) {
+      next_suffix_.emplace(key, suffix + 1);
+    } else {
+      found->second = std::max(found->second, suffix + 1);
+    }
+  }
+
+  // Hash strings and string views alike, so lookups need no temporary
+  struct StringHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view text) const {
+      return std::hash<std::string_view>{}(text);
+    }
+  };
+
+  fs::path path_;
+  std::atomic<bool> created_{false};
+  std::mutex mutex_;   // Guards everything below and creating the folder
+  NameSet existing_;   // Names listed when the folder was first used
+  NameSet claimed_;
+  std::size_t added_ = 0;  // Claimed names that were not listed
+  std::unordered_map<std::string, int, StringHash, std::equal_to<>>
+      next_suffix_;
+};
+
+// Destination folders touched by a run, each listed at most once. The
+// category folders are listed up front, and their paths are precomputed so
+// a destination is built with a single append.
+class DestinationModel {
+ public:
+  DestinationModel(const fs::path& destination,
+                   const std::vector<std::string>& category_paths) {
+    category_dirs_.reserve(category_paths.size());
+    for (const auto& category : category_paths) {
+      category_dirs_.push_back(destination / category);
+      category_folders_.push_back(
+          std::make_unique<FolderNames>(category_dirs_.back()));
+    }
+  }
+
+  // Folder of a category, by matcher index
+  const fs::path& category_dir(std::size_t category) const {
+    return category_dirs_[category];
+  }
+  FolderNames& category_folder(std::size_t category) const {
+    return *category_folders_[category];
+  }
+
+  // Any other folder, listed on first use. Folders are keyed by their
+  // lowercased UTF-8 path, as names are, so paths differing only in case
+  // share the folder first asked for.
+  FolderNames& folder(const fs::path& path) {
+    thread_local std::string key;
+    key.clear();
+    append_utf8(key, path.native(), true);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& folder = folders_[key];
+    if (!folder) folder = std::make_unique<FolderNames>(path);
+    return *folder;
+  }
+
+ private:
+  std::vector<fs::path> category_dirs_;
+  std::vector<std::unique_ptr<FolderNames>> category_folders_;
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::unique_ptr<FolderNames>> folders_;
+};
+
+// A transfer decided by a planning run. Destinations are UTF-8 and relative
+// to the destination root.
+struct PlannedTransfer {
+  std::uint64_t size = 0;  // Source size and modification time when planned
+  std::int64_t mtime = 0;
+  std::string source;       // UTF-8
+  std::string destination;
+  std::string link_target;  // Placed copy to hard link to, if a duplicate
+  bool replaces = false;    // A file was at the destination when planned
+};
+
+// Transfers collected by a planning run in place of performing them
+class MovePlan {
+ public:
+  // Add a transfer of a source file to a relative destination, which
+  // replaces the file there if there was one. Returns false for paths with
+  // tabs or line breaks, which the format cannot hold.
+  bool add(const SourceFile& file, std::string_view destination,
+           std::string_view link_target, bool replaces) {
+    PlannedTransfer transfer;
+    transfer.size = file.size;
+    transfer.mtime = file.mtime;
+    append_utf8(transfer.source, file.path.native(), false);
+    transfer.destination = destination;
+    transfer.link_target = link_target;
+    transfer.replaces = replaces;
+    for (const std::string* field :
+         {&transfer.source, &transfer.destination, &transfer.link_target}) {
+      if (field->find_first_of("\t\r\n") != std::string::npos) return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    transfers_.push_back(std::move(transfer));
+    return true;
+  }
+
+  std::size_t size() const { return transfers_.size(); }
+
+  // Write the plan as tab-separated text, sorted by destination so plans of
+  // the same library diff cleanly
+  void save(const fs::path& plan_path, const fs::path& destination,
+            TransferMode mode) {
+    std::sort(transfers_.begin(), transfers_.end(),
+              [](const PlannedTransfer& a, const PlannedTransfer& b) {
+                return a.destination < b.destination;
+              });
+    std::ofstream out(plan_path, std::ios::binary | std::ios::trunc);
+    std::string root;
+    append_utf8(root, destination.native(), false);
+    out << kPlanHeader << "\n";
+    out << "destination\t" << root << "\n";
+    out << "mode\t" << kTransferModeNames[static_cast<int>(mode)] << "\n";
+    for (const auto& transfer : transfers_) {
+      out << transfer.size << '\t' << transfer.mtime << '\t'
+          << transfer.source << '\t' << transfer.destination << '\t'
+          << transfer.link_target << '\t' << (transfer.replaces ? 1 : 0)
+          << '\n';
+    }
+    out.flush();
+    if (!out) {
+      throw fs::filesystem_error("cannot write plan", plan_path,
+                                 std::make_error_code(std::errc::io_error));
+    }
+  }
+
+  // First line of every plan file. Plans of version 1 have no column saying
+  // whether a transfer replaces a file.
+  static constexpr const char* kPlanHeader = "# Splice File Organizer plan v2";
+  static constexpr const char* kPlanHeaderV1 =
+      "# Splice File Organizer plan v1";
+
+ private:
+  std::mutex mutex_;
+  std::vector<PlannedTransfer> transfers_;
+};
+
+// Everything a worker needs to organize one file
+struct OrganizeContext {
+  const fs::path& destination;
+  const CompiledRules& rules;
+  const OrganizeOptions& options;
+  SampleIndex* index;  // nullptr when the index is disabled
+  DestinationModel& folders;
+  ShardedNameSet& processed;  // Names placed in the destination this run
+  NameLocks& name_locks;
+  const ContentClassifier* content;  // nullptr when disabled
+  MovePlan* plan;                    // Set when planning instead of moving
+  Journal* journal;                  // nullptr without an index or planning
+  Catalog* catalog;                  // nullptr without a catalog
+  const TagTable* tags;              // nullptr without a tag export
+  std::string_view tag_root;   // Tag key of the source folder
+  std::size_t source_length;   // Length of the source folder path as given
+};
+
+// Buffers reused for every file a worker organizes, so the hot path does
+// not allocate once they have grown to fit
+struct FileScratch {
+  std::string lower_name;      // Lowercased UTF-8 file name
+  std::string relative_path;   // Destination relative to the root, UTF-8
+  std::string lower_relative;  // Lowercased relative_path
+  std::string tempo_dir;       // Tempo folder, then its relative path
+  std::string shard_dir;       // Relative path of a shard folder
+  std::string bucket;          // Name of a shard folder
+  std::string tag_key;         // Source path keyed as in the tag table
+  fs::path dest_path;
+};
+
+// Tags of a source file in the context's tag table, or nullptr. key is
+// scratch space for the file's tag key.
+const SampleTag* find_tag(const fs::path& source,
+                          const OrganizeContext& context, std::string& key) {
+  key.assign(context.tag_root);
+  key.push_back('/');
+  append_utf8(
+      key, NativeStringView(source.native()).substr(context.source_length),
+      true);
+  normalize_tag_key(key);
+  return context.tags->find(key);
+}
+
+// Name of the shard folder a file goes to. The pack of a file is the first
+// folder below the source folder, or below "packs" in a Splice library; files
+// outside a pack and names without a letter or digit go by their first
+// character.
+void shard_bucket(const fs::path& source, const OrganizeContext& context,
+                  std::string_view lower_name, std::uint64_t name_hash,
+                  std::string& bucket) {
+  bucket.clear();
+  if (context.options.shard == ShardMode::kHash) {
+    constexpr const char* kHexDigits = "0123456789abcdef";
+    bucket.push_back(kHexDigits[name_hash >> 60]);
+    bucket.push_back(kHexDigits[(name_hash >> 56) & 0xF]);
+    return;
+  }
+  if (context.options.shard == ShardMode::kPack &&
+      source.native().size() > context.source_length) {
+    NativeStringView rest =
+        NativeStringView(source.native()).substr(context.source_length);
+    auto is_separator = [](NativeChar c) {
+      return c == '/' || c == fs::path::preferred_separator;
+    };
+    // Split off the next folder, or nothing at the file name
+    auto next_folder = [&]() -> NativeStringView {
+      while (!rest.empty() && is_separator(rest.front())) rest.remove_prefix(1);
+      auto end = std::find_if(rest.begin(), rest.end(), is_separator);
+      if (end == rest.end()) return {};
+      NativeStringView folder = rest.substr(0, end - rest.begin());
+      rest.remove_prefix(folder.size());
+      return folder;
+    };
+    NativeStringView pack = next_folder();
+    append_utf8(bucket, pack, true);
+    if (bucket == "packs") {
+      NativeStringView inner = next_folder();
+      if (!inner.empty()) pack = inner;
+    }
+    bucket.clear();
+    if (!pack.empty()) {
+      append_utf8(bucket, pack, false);
+      return;
+    }
+  }
+  auto letter = std::find_if(lower_name.begin(), lower_name.end(),
+                             [](unsigned char c) { return std::isalnum(c); });
+  bucket.push_back(letter == lower_name.end()
+                       ? '#'
+                       : static_cast<char>(std::toupper(
+                             static_cast<unsigned char>(*letter))));
+}
+
+// Folder a new file goes to in dir, whose path relative to the destination
+// is relative_dir. Once dir holds options.shard_size names, files go to a
+// shard folder in it, and once that is full to "<shard>_2", "<shard>_3" and
+// so on. A file whose name was in one of these folders before the run goes
+// back to it, so reruns replace it rather than placing it again. Folders are
+// counted, not reserved, so workers racing for the last places may each put
+// one file past the limit. dir and relative_dir are changed to the shard
+// folder.
+FolderNames& shard_folder(const fs::path& source,
+                          const OrganizeContext& context, FolderNames& folder,
+                          std::string_view lower_name, std::uint64_t name_hash,
+                          fs::path& dir, std::string_view& relative_dir,
+                          FileScratch& scratch) {
+  std::size_t limit = std::max<std::size_t>(context.options.shard_size, 1);
+  if (folder.listed(lower_name) || folder.size() < limit) return folder;
+  shard_bucket(source, context, lower_name, name_hash, scratch.bucket);
+  std::string& shard_dir = scratch.shard_dir;
+  for (int number = 1;; ++number) {
+    shard_dir.assign(relative_dir);
+    shard_dir.push_back('/');
+    shard_dir += scratch.bucket;
+    if (number > 1) {
+      shard_dir.push_back('_');
+      shard_dir += std::to_string(number);
+    }
+    std::string_view shard_name =
+        std::string_view(shard_dir).substr(relative_dir.size() + 1);
+    FolderNames& shard = context.folders.folder(
+        dir / fs::path(std::u8string(shard_name.begin(), shard_name.end())));
+    if (shard.listed(lower_name) || shard.size() < limit) {
+      // Place it under the name the folder was first asked for
+      dir = shard.path();
+      shard_dir.resize(relative_dir.size() + 1);
+      append_utf8(shard_dir, shard.path().filename().native(), false);
+      relative_dir = shard_dir;
+      return shard;
+    }
+  }
+}
+
+// Hard link a duplicate to the already placed copy of its content, falling
+// back to a regular transfer when the link cannot be made
+TransferMode link_duplicate(const fs::path& original, const fs::path& source,
+                            const fs::path& destination, TransferMode mode,
+                            std::size_t chunk_size) {
+  std::error_code error;
+  current_stats().add(Counter::kSyscalls);
+  fs::create_hard_link(original, destination, error);
+  if (error) return transfer_file(source, destination, mode, chunk_size);
+  if (mode == TransferMode::kMove) {
+    current_stats().add(Counter::kSyscalls);
+    fs::remove(source);
+  }
+  return TransferMode::kHardlink;
+}
+
+// Place a file at its destination without ever leaving a partial file
+// there: it is transferred under a temporary name next to the destination
+// and renamed over it, which also replaces an existing file in one step. A
+// move within one volume renames the source directly. Duplicates pass the
+// placed copy of their content as link_target. copied is set when the
+// content was written out, including a move that fell back to copying.
+TransferMode place_file(const fs::path& source, const fs::path& destination,
+                        const fs::path* link_target, TransferMode mode,
+                        std::size_t chunk_size, bool& copied) {
+  current_session().throttle.files.take(1);
+  copied = false;
+  std::error_code error;
+  if (mode == TransferMode::kMove && link_target == nullptr) {
+    current_stats().add(Counter::kSyscalls);
+    fs::rename(source, destination, error);
+    if (!error) return TransferMode::kMove;
+  }
+
+  // A move that cannot rename copies first and removes the source last
+  TransferMode step = mode == TransferMode::kMove ? TransferMode::kCopy : mode;
+  fs::path temporary = Journal::temporary_path(destination);
+  auto transfer = [&] {
+    return link_target != nullptr
+               ? link_duplicate(*link_target, source, temporary, step,
+                                chunk_size)
+               : transfer_file(source, temporary, step, chunk_size);
+  };
+  TransferMode used;
+  try {
+    used = transfer();
+  } catch (const fs::filesystem_error&) {
+    // Retry once over a temporary file left by an interrupted run
+    current_stats().add(Counter::kSyscalls);
+    if (!fs::remove(temporary, error)) throw;
+    used = transfer();
+  }
+  copied = used == TransferMode::kCopy;
+
+  current_stats().add(Counter::kSyscalls);
+  fs::rename(temporary, destination, error);
+  if (error) {
+    fs::remove(temporary, error);
+    throw fs::filesystem_error("cannot rename into place", temporary,
+                               destination, error);
+  }
+  if (used == TransferMode::kHardlink) {
+    // Renaming a link over another link to the same file does nothing
+    current_stats().add(Counter::kSyscalls);
+    fs::remove(temporary, error);
+  }
+  if (mode == TransferMode::kMove) {
+    current_stats().add(Counter::kSyscalls);
+    fs::remove(source);
+    return used == TransferMode::kHardlink ? used : TransferMode::kMove;
+  }
+  return used;
+}
+
+// Organize a file based on its content. With an index, files recorded by a
+// previous run with the same size and modification time are skipped, and
+// changed files are replaced at their recorded destination. A duplicate
+// passes the placed copy of its content as link_target and is hard linked
+// to it. Returns true if the file is now at its destination, which is
+// stored in placed_path when given.
+bool organize_file(const SourceFile& file, const OrganizeContext& context,
+                   const fs::path* link_target = nullptr,
+                   fs::path* placed_path = nullptr) {
+  const fs::path& source = file.path;
+  if (!is_audio_file(source)) {
+    current_stats().add(Counter::kSkipped);
+    return false;  // Ignore non-audio files
+  }
+
+  const fs::path& destination = context.destination;
+  const OrganizeOptions& options = context.options;
+  SampleIndex* index = context.index;
+  thread_local FileScratch scratch;
+
+  NativeStringView name = filename_view(source);
+  scratch.lower_name.clear();
+  append_utf8(scratch.lower_name, name, true);
+  std::string_view filename = scratch.lower_name;
+
+  std::uint64_t name_hash = hash_name(filename);
+
+  try {
+    std::uint64_t source_hash = 0;
+    const IndexEntry* previous = nullptr;
+    if (index != nullptr) {
+      source_hash = hash_path(source);
+      previous = index->find(source_hash);
+      if (previous != nullptr && previous->size == file.size &&
+          previous->mtime == file.mtime) {
+        // Unchanged since the last run; leave the destination alone
+        std::string_view recorded = index->destination_of(*previous);
+        index->record(source_hash, file.size, file.mtime, recorded);
+        if (context.catalog != nullptr &&
+            !context.catalog->contains(recorded)) {
+          // Placed before the catalog was started
+          context.catalog->record(recorded, file.size, file.mtime,
+                                  audio_duration(source));
+        }
+        mark_file_processed(context.processed, filename, name_hash);
+        current_stats().add(Counter::kUnchanged);
+        if (placed_path != nullptr) {
+          *placed_path = destination / fs::path(std::u8string(
+                                           recorded.begin(), recorded.end()));
+        }
+        return true;
+      }
+    }
+
+    // Read the audio headers when an option or the catalog needs them. Only
+    // the pages the parsers touch are faulted in, never the whole file.
+    std::optional<MappedFile> mapped;
+    AudioInfo info;
+    bool have_info = false;
+    if (options.check_headers || options.tempo_folders ||
+        context.content != nullptr || context.catalog != nullptr) {
+      {
+        StageTimer timer(Stage::kHeaders);
+        mapped.emplace(source);
+        have_info = read_audio_info(*mapped, info);
+      }
+      if (!have_info && options.check_headers) {
+        logger.log(LogLevel::kWarning, "unreadable-audio",
+                   {{"source", source}});
+        current_stats().add(Counter::kSkipped);
+        return false;
+      }
+    }
+
+    // Organize files based on content, or reuse the recorded destination of
+    // a changed file
+    fs::path& dest_path = scratch.dest_path;
+    FolderNames* folder;
+    std::string_view relative_dir;
+    std::string claim_name;
+    if (previous != nullptr) {
+      std::string_view recorded = index->destination_of(*previous);
+      dest_path = destination /
+                  fs::path(std::u8string(recorded.begin(), recorded.end()));
+      folder = &context.folders.folder(dest_path.parent_path());
+      auto slash = recorded.rfind('/');
+      relative_dir = recorded.substr(0, slash == recorded.npos ? 0 : slash);
+      append_lower(claim_name, recorded.substr(slash + 1));
+    } else {
+      // Tags exported from Splice take precedence over the file name
+      std::size_t category;
+      const SampleTag* tag = nullptr;
+      {
+        StageTimer timer(Stage::kClassify);
+        if (context.tags != nullptr) {
+          tag = find_tag(source, context, scratch.tag_key);
+        }
+        std::size_t fallback = context.rules.category_paths.size() - 1;
+        if (tag != nullptr && tag->category != SampleTag::kNoCategory) {
+          category = tag->category;
+        } else {
+          category = context.rules.classify(filename);
+        }
+        if (category == fallback && context.content != nullptr && have_info) {
+          category = context.content->classify(*mapped, info, fallback);
+        }
+      }
+      current_stats().add(Counter::kClassified);
+      dest_path = context.folders.category_dir(category);
+      relative_dir = context.rules.category_paths[category];
+      double tempo = have_info && info.looped ? info.tempo : 0;
+      if (tempo <= 0 && tag != nullptr && tag->looped) tempo = tag->tempo;
+      if (options.tempo_folders && tempo > 0) {
+        // Loops with a known tempo go to a "<n>bpm" folder in the category
+        std::string& tempo_dir = scratch.tempo_dir;
+        tempo_dir.assign(std::to_string(std::lround(tempo)));
+        tempo_dir += "bpm";
+        dest_path /= tempo_dir;
+        folder = &context.folders.folder(dest_path);
+        tempo_dir.insert(0, "/");
+        tempo_dir.insert(0, relative_dir);
+        relative_dir = tempo_dir;
+      } else {
+        folder = &context.folders.category_folder(category);
+      }
+      if (options.shard != ShardMode::kOff) {
+        folder = &shard_folder(source, context, *folder, filename, name_hash,
+                               dest_path, relative_dir, scratch);
+      }
+      dest_path /= name;
+    }
+    mapped.reset();  // Unmap before the source is moved or linked
+
+    logger.log(LogLevel::kDebug, "request",
+               {{"source", source}, {"destination", dest_path}});
+
+    // Perform the file move. A destination counts as taken if this run or
+    // a previous one placed a file there; the file then gets the next free
+    // indexed name in the same folder. Whether it exists at all is known
+    // from the folder listing. The name stripe is held from the existence
+    // check until the name is marked as processed, so concurrent workers
+    // agree on collisions, but not during the transfer.
+    std::optional<StageTimer> place_timer(std::in_place, Stage::kPlace);
+    std::unique_lock<std::mutex> name_lock(
+        context.name_locks[name_hash % kNameLockStripes]);
+    std::string_view lower_name = previous != nullptr ? claim_name : filename;
+    bool present = folder->contains(lower_name);
+    bool taken = false;
+    if (previous == nullptr && present) {
+      std::string& lower_relative = scratch.lower_relative;
+      lower_relative.clear();
+      append_lower(lower_relative, relative_dir);
+      lower_relative.push_back('/');
+      lower_relative.append(filename);
+      taken = file_already_processed(context.processed, filename, name_hash) ||
+              (index != nullptr && index->owns_destination(lower_relative));
+    }
+    if (!folder->claim(lower_name)) taken = true;
+
+    if (taken) {
+      dest_path.replace_filename(folder->claim_indexed(fs::path(name)));
+    }
+    mark_file_processed(context.processed, filename, name_hash);
+    name_lock.unlock();
+    std::string& relative_path = scratch.relative_path;
+    relative_path.assign(relative_dir);
+    if (!relative_path.empty()) relative_path.push_back('/');
+    append_utf8(relative_path, filename_view(dest_path), false);
+    place_timer.reset();
+
+    if (context.plan != nullptr) {
+      // Only record the decision; the destination is not touched
+      std::string link;
+      if (link_target != nullptr) {
+        append_utf8(link,
+                    link_target->lexically_relative(destination)
+                        .generic_string<NativeChar>(),
+                    false);
+      }
+      if (!context.plan->add(file, relative_path, link, present && !taken)) {
+        logger.log(LogLevel::kError, "unplannable-path", {{"source", source}});
+        current_stats().add(Counter::kFailed);
+        return false;
+      }
+      current_stats().add(Counter::kTransferred);
+      if (placed_path != nullptr) *placed_path = dest_path;
+      return true;
+    }
+
+    TransferMode used;
+    bool copied = false;
+    bool journaled;
+    {
+      StageTimer timer(Stage::kTransfer);
+      folder->create();
+      journaled = context.journal != nullptr &&
+                  context.journal->intent(source_hash, file.size, file.mtime,
+                                          relative_path);
+      used = place_file(source, dest_path, link_target, options.transfer_mode,
+                        options.copy_chunk_size, copied);
+    }
+    print_file_move_info(source, dest_path, used);
+    current_stats().add(Counter::kTransferred);
+    if (copied) {
+      current_stats().add(Counter::kBytes, file.size);
+    }
+
+    if (index != nullptr) {
+      index->record(source_hash, file.size, file.mtime, relative_path);
+    }
+    if (context.catalog != nullptr) {
+      context.catalog->record(relative_path, file.size, file.mtime,
+                              have_info ? info.duration : 0);
+    }
+    if (journaled) context.journal->commit(source_hash, dest_path);
+    if (placed_path != nullptr) *placed_path = dest_path;
+    return true;
+  } catch (const fs::filesystem_error& e) {
+    logger.log(LogLevel::kError, "transfer-failed",
+               {{"source", source}, {"error", e.what()}});
+    current_stats().add(Counter::kFailed);
+  }
+  return false;
+}
+
+// Bytes hashed before deciding whether two same-sized files need a full
+// comparison
+constexpr std::uint64_t kDedupPrefixBytes = 4096;
+
+// A file taking part in deduplication
+struct DedupItem {
+  SourceFile file;
+  std::uint64_t prefix_hash = 0;
+  std::uint64_t full_hash = 0;
+  bool hashed = true;  // False if the file could not be read
+  std::size_t duplicate_of = SIZE_MAX;
+  fs::path placed;
+};
+
+// Sort item indices by a key and call on_group for every run of two or
+// more items sharing it
+template <typename Key, typename OnGroup>
+void for_each_group(std::vector<DedupItem>& items,
+                    std::vector<std::size_t>& members, Key key,
+                    OnGroup on_group) {
+  std::sort(members.begin(), members.end(), [&](std::size_t a, std::size_t b) {
+    return std::make_pair(key(items[a]), a) < std::make_pair(key(items[b]), b);
+  });
+  for (std::size_t begin = 0; begin < members.size();) {
+    std::size_t end = begin + 1;
+    while (end < members.size() &&
+           key(items[members[end]]) == key(items[members[begin]])) {
+      ++end;
+    }
+    if (end - begin > 1) {
+      std::vector<std::size_t> group(members.begin() + begin,
+                                     members.begin() + end);
+      on_group(group);
+    }
+    begin = end;
+  }
+}
+
+// Find byte-identical files. Files are grouped by size first; only groups
+// with several members are hashed, first over a short prefix and then, for
+// matching prefixes, over the whole file, and files whose hashes match are
+// compared with the first of them byte by byte. Hashing and comparing run
+// on the worker pool. Within a group the first file in walk order is kept
+// as the original.
+void find_duplicates(std::vector<DedupItem>& items, TaskGroup& tasks,
+                     const SampleIndex* index) {
+  auto hash_items = [&](const std::vector<std::size_t>& group,
+                        bool full) {
+    for (std::size_t i : group) {
+      tasks.submit([&items, i, full] {
+        DedupItem& item = items[i];
+        if (!item.hashed) return;
+        try {
+          StageTimer timer(Stage::kHash);
+          if (full) {
+            item.full_hash = hash_file_content(item.file.path, 0);
+          } else {
+            item.prefix_hash =
+                hash_file_content(item.file.path, kDedupPrefixBytes);
+            item.full_hash = item.prefix_hash;
+          }
+        } catch (const fs::filesystem_error& e) {
+          item.hashed = false;
+          logger.log(LogLevel::kError, "hash-failed",
+                     {{"source", item.file.path}, {"error", e.what()}});
+        }
+      });
+    }
+  };
+
+  // Groups made only of files the index knows to be unchanged were
+  // resolved by an earlier run and need no hashing
+  auto unchanged = [&](const DedupItem& item) {
+    if (index == nullptr) return false;
+    const IndexEntry* previous = index->find(hash_path(item.file.path));
+    return previous != nullptr && previous->size == item.file.size &&
+           previous->mtime == item.file.mtime;
+  };
+
+  std::vector<std::size_t> all(items.size());
+  for (std::size_t i = 0; i < items.size(); ++i) all[i] = i;
+
+  std::vector<std::vector<std::size_t>> size_groups;
+  for_each_group(
+      items, all, [](const DedupItem& item) { return item.file.size; },
+      [&](std::vector<std::size_t>& group) {
+        if (std::all_of(group.begin(), group.end(), [&](std::size_t i) {
+              return unchanged(items[i]);
+            })) {
+          return;
+        }
+        hash_items(group, false);
+        size_groups.push_back(std::move(group));
+      });
+  tasks.wait_idle();
+
+  std::vector<std::vector<std::size_t>> prefix_groups;
+  for (auto& group : size_groups) {
+    for_each_group(
+        items, group,
+        [](const DedupItem& item) {
+          return std::make_pair(item.hashed, item.prefix_hash);
+        },
+        [&](std::vector<std::size_t>& members) {
+          if (!items[members.front()].hashed) return;
+          if (items[members.front()].file.size > kDedupPrefixBytes) {
+            hash_items(members, true);
+          }
+          prefix_groups.push_back(std::move(members));
+        });
+  }
+  tasks.wait_idle();
+
+  for (auto& group : prefix_groups) {
+    for_each_group(
+        items, group,
+        [](const DedupItem& item) {
+          return std::make_pair(item.hashed, item.full_hash);
+        },
+        [&](std::vector<std::size_t>& members) {
+          if (!items[members.front()].hashed) return;
+          // Hashes can collide; only equal bytes make a duplicate
+          std::size_t first = members[0];
+          for (std::size_t i = 1; i < members.size(); ++i) {
+            tasks.submit([&items, first, i = members[i]] {
+              try {
+                StageTimer timer(Stage::kHash);
+                if (same_content(items[first].file.path, items[i].file.path)) {
+                  items[i].duplicate_of = first;
+                }
+              } catch (const fs::filesystem_error& e) {
+                logger.log(LogLevel::kError, "compare-failed",
+                           {{"source", items[i].file.path},
+                            {"error", e.what()}});
+              }
+            });
+          }
+        });
+  }
+  tasks.wait_idle();
+}
+
+// Sort files for a --order other than the listing order: by disk location,
+// so a spinning disk or file server reads them nearly sequentially, and for
+// the folder order first by the category their tags or name select, so
+// each destination folder is filled in one stretch
+void sort_work(std::vector<SourceFile>& files,
+               const OrganizeContext& context) {
+  WorkOrder order = context.options.work_order;
+  if (order == WorkOrder::kListing) return;
+
+  struct Key {
+    std::size_t category;
+    std::uint64_t locality;
+    std::size_t index;
+  };
+  std::vector<Key> keys;
+  keys.reserve(files.size());
+  std::string lower_name;
+  std::string tag_key;
+  for (std::size_t i = 0; i < files.size(); ++i) {
+    const SourceFile& file = files[i];
+    std::size_t category = 0;
+    if (order == WorkOrder::kFolder) {
+      const SampleTag* tag = context.tags != nullptr
+                                 ? find_tag(file.path, context, tag_key)
+                                 : nullptr;
+      if (tag != nullptr && tag->category != SampleTag::kNoCategory) {
+        category = tag->category;
+      } else {
+        lower_name.clear();
+        append_utf8(lower_name, filename_view(file.path), true);
+        category = context.rules.classify(lower_name);
+      }
+    }
+    keys.push_back({category, disk_locality(file.file_id), i});
+  }
+  std::sort(keys.begin(), keys.end(), [](const Key& a, const Key& b) {
+    return std::tie(a.category, a.locality, a.index) <
+           std::tie(b.category, b.locality, b.index);
+  });
+
+  std::vector<SourceFile> sorted;
+  sorted.reserve(files.size());
+  for (const Key& key : keys) sorted.push_back(std::move(files[key.index]));
+  files.swap(sorted);
+}
+
+// Organize files with deduplication. They are grouped by size first;
+// originals are placed before their duplicates, which are then linked to
+// the placed copy or skipped.
+void organize_deduplicated(std::vector<SourceFile>& files, TaskGroup& tasks,
+                           const OrganizeContext& context) {
+  std::vector<DedupItem> items(files.size());
+  for (std::size_t i = 0; i < files.size(); ++i) {
+    items[i].file = std::move(files[i]);
+  }
+
+  find_duplicates(items, tasks, context.index);
+
+  for (auto& item : items) {
+    if (item.duplicate_of != SIZE_MAX) continue;
+    tasks.submit([&item, &context] {
+      organize_file(item.file, context, nullptr, &item.placed);
+    });
+  }
+  tasks.wait_idle();
+
+  for (auto& item : items) {
+    if (item.duplicate_of == SIZE_MAX) continue;
+    const fs::path& original = items[item.duplicate_of].placed;
+    if (original.empty()) {
+      // The original could not be placed; treat this copy on its own
+      tasks.submit([&item, &context] {
+        organize_file(item.file, context, nullptr, &item.placed);
+      });
+    } else if (context.options.dedup == DedupMode::kHardlink) {
+      tasks.submit([&item, &original, &context] {
+        organize_file(item.file, context, &original, &item.placed);
+      });
+    } else {
+      logger.log(LogLevel::kInfo, "duplicate-skipped",
+                 {{"source", item.file.path}, {"same_as", original}});
+      current_stats().add(Counter::kSkipped);
+    }
+  }
+  tasks.wait_idle();
+}
+
+// Organize a list of files, in the configured work order and with
+// deduplication if enabled, and wait until all are done
+void organize_files(std::vector<SourceFile>& files, TaskGroup& tasks,
+                    const OrganizeContext& context) {
+  sort_work(files, context);
+  if (context.options.dedup != DedupMode::kOff) {
+    organize_deduplicated(files, tasks, context);
+    return;
+  }
+  for (auto& file : files) {
+    tasks.submit([&file, &context] { organize_file(file, context); });
+  }
+  tasks.wait_idle();
+}
+
+// Process a directory and organize its files. The calling thread walks the
+// tree and feeds the bounded queue of the worker pool as it lists files.
+// Deduplication and sorted work orders need the whole tree listed first.
+void process_directory(const fs::path& source, TaskGroup& tasks,
+                       const OrganizeContext& context) {
+  current_stats().set_listing(true);
+  if (context.options.dedup == DedupMode::kOff &&
+      context.options.work_order == WorkOrder::kListing) {
+    walk_directory(source, [&](SourceFile&& file) {
+      tasks.submit([file = std::move(file), &context] {
+        organize_file(file, context);
+      });
+    });
+    current_stats().set_listing(false);
+    tasks.wait_idle();
+    return;
+  }
+
+  std::vector<SourceFile> files;
+  walk_directory(source, [&](SourceFile&& file) {
+    files.push_back(std::move(file));
+  });
+  current_stats().set_listing(false);
+  organize_files(files, tasks, context);
+}
+
+// Number of workers to start for a run
+unsigned resolved_worker_count(const OrganizeOptions& options) {
+  return options.worker_count != 0 ? options.worker_count
+                                   : default_worker_count();
+}
+
+// A plan file read back for execution
+struct LoadedPlan {
+  fs::path destination;
+  TransferMode mode = TransferMode::kCopy;
+  std::vector<PlannedTransfer> transfers;
+};
+
+// Split a plan line at tabs into exactly count fields
+bool split_plan_line(std::string_view line, std::string_view* fields,
+                     std::size_t count) {
+  for (std::size_t i = 0; i + 1 < count; ++i) {
+    auto tab = line.find('\t');
+    if (tab == std::string_view::npos) return false;
+    fields[i] = line.substr(0, tab);
+    line.remove_prefix(tab + 1);
+  }
+  if (line.find('\t') != std::string_view::npos) return false;
+  fields[count - 1] = line;
+  return true;
+}
+
+// Read a plan file written by MovePlan::save. Errors name the offending line.
+LoadedPlan load_plan(const fs::path& plan_path) {
+  std::ifstream in(plan_path, std::ios::binary);
+  if (!in) throw std::runtime_error("cannot open " + plan_path.string());
+
+  LoadedPlan plan;
+  std::string line;
+  int line_number = 0;
+  auto fail = [&](const char* message) {
+    throw std::runtime_error(plan_path.string() + ":" +
+                             std::to_string(line_number) + ": " + message);
+  };
+  auto utf8_path = [](std::string_view text) {
+    return fs::path(std::u8string(text.begin(), text.end()));
+  };
+
+  bool have_destination = false;
+  std::size_t transfer_fields = 6;
+  while (std::getline(in, line)) {
+    ++line_number;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line_number == 1) {
+      if (line == MovePlan::kPlanHeaderV1) {
+        transfer_fields = 5;
+      } else if (line != MovePlan::kPlanHeader) {
+        fail("not a plan file");
+      }
+      continue;
+    }
+    std::string_view fields[6];
+    if (split_plan_line(line, fields, 2) && fields[0] == "destination") {
+      plan.destination = utf8_path(fields[1]);
+      have_destination = true;
+    } else if (split_plan_line(line, fields, 2) && fields[0] == "mode") {
+      auto mode = std::find(kTransferModeNames.begin(),
+                            kTransferModeNames.end(), fields[1]);
+      if (mode == kTransferModeNames.end()) fail("unknown transfer mode");
+      plan.mode =
+          static_cast<TransferMode>(mode - kTransferModeNames.begin());
+    } else if (split_plan_line(line, fields, transfer_fields)) {
+      PlannedTransfer transfer;
+      auto size = std::from_chars(fields[0].data(),
+                                  fields[0].data() + fields[0].size(),
+                                  transfer.size);
+      auto mtime = std::from_chars(fields[1].data(),
+                                   fields[1].data() + fields[1].size(),
+                                   transfer.mtime);
+      if (size.ec != std::errc() || mtime.ec != std::errc() ||
+          fields[2].empty() || fields[3].empty() ||
+          (transfer_fields == 6 && fields[5] != "0" && fields[5] != "1")) {
+        fail("malformed transfer");
+      }
+      transfer.source = fields[2];
+      transfer.destination = fields[3];
+      transfer.link_target = fields[4];
+      transfer.replaces = transfer_fields == 6 && fields[5] == "1";
+      plan.transfers.push_back(std::move(transfer));
+    } else if (!line.empty()) {
+      fail("malformed line");
+    }
+  }
+  if (line_number == 0) fail("not a plan file");
+  if (!have_destination) fail("missing destination");
+  return plan;
+}
+
+// Carry out one planned transfer and record it in the index. A source that
+// changed since planning is skipped, since its classification may be stale,
+// and so is a destination that appeared since: collisions were resolved
+// when planning, so a file there that neither the plan meant to replace nor
+// the index owns is someone else's.
+void apply_transfer(const PlannedTransfer& transfer, const LoadedPlan& plan,
+                    DestinationModel& folders, SampleIndex* index,
+                    Journal* journal, std::size_t chunk_size) {
+  fs::path source(std::u8string(transfer.source.begin(),
+                                transfer.source.end()));
+  fs::path dest_path = plan.destination /
+                       fs::path(std::u8string(transfer.destination.begin(),
+                                              transfer.destination.end()));
+  try {
+    std::uint64_t size = fs::file_size(source);
+    std::int64_t mtime = fs::last_write_time(source).time_since_epoch().count();
+    if (size != transfer.size || mtime != transfer.mtime) {
+      logger.log(LogLevel::kWarning, "changed-since-planning",
+                 {{"source", source}});
+      current_stats().add(Counter::kSkipped);
+      return;
+    }
+    std::error_code error;
+    current_stats().add(Counter::kSyscalls);
+    if (!transfer.replaces && fs::exists(dest_path, error)) {
+      std::string lower_relative;
+      append_lower(lower_relative, transfer.destination);
+      if (index == nullptr || !index->owns_destination(lower_relative)) {
+        logger.log(LogLevel::kWarning, "destination-changed-since-planning",
+                   {{"source", source}, {"destination", dest_path}});
+        current_stats().add(Counter::kSkipped);
+        return;
+      }
+    }
+
+    folders.folder(dest_path.parent_path()).create();
+    std::uint64_t source_hash = hash_path(source);
+    bool journaled = journal != nullptr &&
+                     journal->intent(source_hash, size, mtime,
+                                     transfer.destination);
+    fs::path link_target;
+    if (!transfer.link_target.empty()) {
+      link_target = plan.destination /
+                    fs::path(std::u8string(transfer.link_target.begin(),
+                                           transfer.link_target.end()));
+    }
+    bool copied = false;
+    TransferMode used =
+        place_file(source, dest_path,
+                   link_target.empty() ? nullptr : &link_target, plan.mode,
+                   chunk_size, copied);
+    print_file_move_info(source, dest_path, used);
+    current_stats().add(Counter::kTransferred);
+    if (copied) {
+      current_stats().add(Counter::kBytes, size);
+    }
+    if (index != nullptr) {
+      index->record(source_hash, size, mtime, transfer.destination);
+    }
+    if (journaled) journal->commit(source_hash, dest_path);
+  } catch (const fs::filesystem_error& e) {
+    logger.log(LogLevel::kError, "transfer-failed",
+               {{"source", source}, {"error", e.what()}});
+    current_stats().add(Counter::kFailed);
+  }
+}
+
+// Parse a non-negative number
+std::optional<double> parse_rate(std::string_view text) {
+  double rate = 0;
+  auto result = std::from_chars(text.data(), text.data() + text.size(), rate);
+  if (result.ec != std::errc() || result.ptr != text.data() + text.size() ||
+      !(rate >= 0) || std::isinf(rate)) {
+    return std::nullopt;
+  }
+  return rate;
+}
+
+// State of one destination shared by every job that writes to it: the model
+// of its folders, the names placed there this run, the locks that order work
+// on equal names and its open index and catalog
+struct DestinationState {
+  DestinationState(const fs::path& destination, const CompiledRules& rules,
+                   const OrganizeOptions& options, bool planning)
+      : root(destination),
+        planning(planning),
+        folders(destination, rules.category_paths) {
+    if (!planning) {
+      // Create destination folders if they don't exist
+      for (std::size_t i = 0; i < rules.category_paths.size(); ++i) {
+        folders.category_folder(i).create();
+      }
+    }
+    open(options);
+  }
+
+  // Open the index, journal and catalog from the files in the destination
+  void open(const OrganizeOptions& options) {
+    if (options.use_index) open_index(root, planning, index, journal);
+    // A catalog, once started, is kept up to date by every run
+    fs::path catalog_path = root / kCatalogFileName;
+    if (!planning && (options.catalog || fs::exists(catalog_path))) {
+      catalog.emplace(catalog_path);
+    }
+    saved = false;
+  }
+
+  fs::path root;
+  bool planning;  // Only read the destination; never save the index
+  DestinationModel folders;
+  ShardedNameSet processed;
+  NameLocks name_locks;
+  std::optional<SampleIndex> index;
+  std::optional<Journal> journal;  // Set while a run writes the index
+  std::optional<Catalog> catalog;
+  bool saved = false;  // Closed by a save; opened again when next used
+};
+
+// Runs jobs one after another on one executor with one set of compiled
+// rules. Each destination is listed and its index loaded once, however many
+// jobs write to it, and finish() saves every index at the end. Everything a
+// run counts or is budgeted by lives in the runner's own session, so
+// runners in one process are independent of each other.
+class JobRunner {
+ public:
+  // Run on executor, or on a worker pool of the runner's own if it is null
+  JobRunner(const CompiledRules& rules, const OrganizeOptions& options,
+            const TagTable* tags = nullptr, Executor* executor = nullptr)
+      : rules_(rules),
+        options_(options),
+        tags_(tags),
+        own_pool_(executor == nullptr ? std::make_unique<WorkerPool>(
+                                            resolved_worker_count(options))
+                                      : nullptr),
+        tasks_(executor != nullptr ? *executor : *own_pool_, session_,
+               resolved_worker_count(options),
+               resolved_worker_count(options) * kQueueDepthPerWorker) {
+    if (options.classify_content) content_.emplace(rules.category_paths);
+    if (options.pipeline) session_.pipeline.start(session_);
+  }
+
+  // Organize the source folder of a job. With a plan, every decision is
+  // recorded in it and the destination is only read.
+  void run(const Job& job, MovePlan* plan = nullptr) {
+    SessionScope scope(session_);
+    with_context(job, plan, [&](const OrganizeContext& context) {
+      process_directory(job.source, tasks_, context);
+    });
+  }
+
+  // Organize only the given files of a job, found under its source folder
+  void run_files(const Job& job, std::vector<SourceFile>& files) {
+    SessionScope scope(session_);
+    with_context(job, nullptr, [&](const OrganizeContext& context) {
+      organize_files(files, tasks_, context);
+    });
+  }
+
+  // Organize the given paths of a job, skipping those that are not audio
+  // files
+  void run_paths(const Job& job, std::span<const fs::path> paths) {
+    SessionScope scope(session_);
+    std::vector<SourceFile> files;
+    for (const auto& path : paths) {
+      SourceFile file;
+      if (has_audio_extension(path.filename().native()) &&
+          stat_source_file(path, file)) {
+        files.push_back(std::move(file));
+      }
+    }
+    session_.stats.add(Counter::kEnumerated, files.size());
+    run_files(job, files);
+  }
+
+  // Carry out a plan read by load_plan. Duplicates are linked after all
+  // other transfers, once the copies they link to are in place.
+  void apply(const LoadedPlan& plan) {
+    SessionScope scope(session_);
+    std::optional<SampleIndex> index;
+    std::optional<Journal> journal;
+    if (options_.use_index) {
+      fs::create_directories(plan.destination);
+      open_index(plan.destination, false, index, journal);
+    }
+    SampleIndex* index_ptr = index ? &*index : nullptr;
+    Journal* journal_ptr = journal ? &*journal : nullptr;
+    DestinationModel folders(plan.destination, {});
+    session_.stats.add(Counter::kEnumerated, plan.transfers.size());
+
+    for (bool links : {false, true}) {
+      for (const auto& transfer : plan.transfers) {
+        if (transfer.link_target.empty() == links) continue;
+        tasks_.submit([&transfer, &plan, &folders, index_ptr, journal_ptr,
+                       this] {
+          apply_transfer(transfer, plan, folders, index_ptr, journal_ptr,
+                         options_.copy_chunk_size);
+        });
+      }
+      tasks_.wait_idle();
+    }
+
+    if (index) {
+      try {
+        index->save();
+        journal->discard();
+      } catch (const fs::filesystem_error& e) {
+        logger.log(LogLevel::kError, "index-save-failed",
+                   {{"error", e.what()}});
+      }
+    }
+  }
+
+  // Organize new and changed files under the sources of jobs as they
+  // appear, until stop is requested. Each settled batch of changes is
+  // organized and every index saved, so stopping loses at most the batch in
+  // progress, and its journal replays that on the next run. on_batch, if
+  // set, is told how many files each batch placed. Throws
+  // fs::filesystem_error if the sources cannot be watched.
+  void watch(std::span<const Job> jobs, std::stop_token stop,
+             const std::function<void(std::uint64_t)>& on_batch) {
+    SessionScope scope(session_);
+    SourceWatcher watcher;
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+      watcher.add_root(jobs[i].source, jobs[i].destination, i);
+    }
+
+    for (;;) {
+      std::vector<WatchedChange> changes = watcher.next_batch(stop);
+      if (stop.stop_requested()) return;
+      std::uint64_t before = session_.stats.snapshot()[Counter::kTransferred];
+
+      // Files and folders of each job, each path once
+      std::vector<std::vector<SourceFile>> files(jobs.size());
+      std::vector<bool> rescan(jobs.size(), false);
+      std::unordered_set<fs::path::string_type> seen;
+      for (auto& change : changes) {
+        if (change.rescan) {
+          rescan[change.job] = true;
+        } else if (!rescan[change.job] &&
+                   seen.insert(change.path.native()).second &&
+                   !watcher.excluded(change.path)) {
+          SourceFile file;
+          std::error_code error;
+          if (fs::is_directory(change.path, error)) {
+            walk_directory(change.path, [&](SourceFile&& found) {
+              if (seen.insert(found.path.native()).second) {
+                files[change.job].push_back(std::move(found));
+              }
+            });
+          } else if (has_audio_extension(change.path.filename().native()) &&
+                     stat_source_file(change.path, file)) {
+            session_.stats.add(Counter::kEnumerated);
+            files[change.job].push_back(std::move(file));
+          }
+        }
+      }
+
+      for (std::size_t i = 0; i < jobs.size(); ++i) {
+        if (rescan[i]) {
+          run(jobs[i]);
+        } else if (!files[i].empty()) {
+          run_files(jobs[i], files[i]);
+        }
+      }
+      finish();
+
+      std::uint64_t placed =
+          session_.stats.snapshot()[Counter::kTransferred] - before;
+      if (placed > 0 && on_batch) on_batch(placed);
+    }
+  }
+
+  // Save the index and catalog of every destination written to and close
+  // them, along with the journal that is only needed until then. A later job
+  // writing to a destination opens them again from the saved files, so a
+  // long watch keeps neither growing records nor a growing journal. A
+  // journal left by a failed save is replayed on reopening.
+  void finish() {
+    SessionScope scope(session_);
+    for (auto& [root, state] : destinations_) {
+      if (state->planning || state->saved) continue;
+      bool index_saved = false;
+      try {
+        if (state->index) {
+          state->index->save();
+          if (state->journal) state->journal->discard();
+          // The catalog drops what the saved index no longer owns
+          state->index.emplace(state->root / kIndexFileName);
+          index_saved = true;
+        }
+      } catch (const fs::filesystem_error& e) {
+        logger.log(LogLevel::kError, "index-save-failed",
+                   {{"error", e.what()}});
+      }
+      try {
+        if (state->catalog) {
+          state->catalog->save(index_saved ? &*state->index : nullptr);
+        }
+      } catch (const fs::filesystem_error& e) {
+        logger.log(LogLevel::kError, "catalog-save-failed",
+                   {{"error", e.what()}});
+      }
+      state->journal.reset();
+      state->index.reset();
+      state->catalog.reset();
+      state->saved = true;
+    }
+  }
+
+  // Put a budget into effect for the transfers and workers of the runner,
+  // from now on and in the middle of a run
+  void set_budget(const Budget& budget) {
+    session_.throttle.bytes.set_rate(budget.bytes_per_second);
+    session_.throttle.files.set_rate(budget.files_per_second);
+    tasks_.set_limit(budget.workers);
+  }
+
+  const RunStats& stats() const { return session_.stats; }
+
+ private:
+  // Run fn with the context of a job
+  template <typename Fn>
+  void with_context(const Job& job, MovePlan* plan, Fn fn) {
+    DestinationState& state = destination(job.destination, plan != nullptr);
+    std::string tag_root;
+    if (tags_ != nullptr) {
+      append_utf8(tag_root,
+                  fs::absolute(job.source).lexically_normal().native(), true);
+      normalize_tag_key(tag_root);
+    }
+    OrganizeContext context{state.root,
+                            rules_,
+                            options_,
+                            state.index ? &*state.index : nullptr,
+                            state.folders,
+                            state.processed,
+                            state.name_locks,
+                            content_ ? &*content_ : nullptr,
+                            plan,
+                            state.journal ? &*state.journal : nullptr,
+                            state.catalog ? &*state.catalog : nullptr,
+                            tags_,
+                            tag_root,
+                            job.source.native().size()};
+    fn(context);
+  }
+
+  // State of a destination, created when a job first writes to it and
+  // reopened when one writes to it after a save
+  DestinationState& destination(const fs::path& root, bool planning) {
+    auto& state = destinations_[root.lexically_normal().native()];
+    if (!state) {
+      state = std::make_unique<DestinationState>(root, rules_, options_,
+                                                 planning);
+    } else if (state->saved) {
+      state->open(options_);
+    }
+    return *state;
+  }
+
+  const CompiledRules& rules_;
+  const OrganizeOptions& options_;
+  const TagTable* tags_;  // nullptr without a tag export
+  Session session_;
+  std::unique_ptr<WorkerPool> own_pool_;  // Without an executor given
+  TaskGroup tasks_;
+  std::optional<ContentClassifier> content_;
+  std::unordered_map<fs::path::string_type, std::unique_ptr<DestinationState>>
+      destinations_;
+};
+
+// How often the progress line is redrawn
+constexpr std::chrono::milliseconds kProgressInterval(500);
+
+// Width the progress line is padded to, so a shorter line hides a longer one
+constexpr std::size_t kProgressWidth = 79;
+
+// Format seconds as "h:mm:ss"
+std::string format_duration(double seconds) {
+  auto total = static_cast<long long>(std::max(seconds, 0.0) + 0.5);
+  char text[32];
+  std::snprintf(text, sizeof(text), "%lld:%02lld:%02lld", total / 3600,
+                total / 60 % 60, total % 60);
+  return text;
+}
+
+// Format a latency in nanoseconds with a readable unit
+std::string format_latency(double nanoseconds) {
+  char text[32];
+  if (nanoseconds < 1e3) {
+    std::snprintf(text, sizeof(text), "%.0fns", nanoseconds);
+  } else if (nanoseconds < 1e6) {
+    std::snprintf(text, sizeof(text), "%.1fus", nanoseconds / 1e3);
+  } else if (nanoseconds < 1e9) {
+    std::snprintf(text, sizeof(text), "%.1fms", nanoseconds / 1e6);
+  } else {
+    std::snprintf(text, sizeof(text), "%.2fs", nanoseconds / 1e9);
+  }
+  return text;
+}
+
+// Lower the I/O and CPU priority of the process and of the threads it starts
+// from now on, so it only gets the disk and processor when others leave them
+// free
+void enter_background_mode() {
+#ifdef _WIN32
+  // Lowers I/O and memory priority along with the scheduling priority
+  SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+#else
+#if defined(__linux__)
+  // Idle I/O class; the kernel's ioprio.h is not always installed
+  constexpr int kIoprioWhoProcess = 1;
+  constexpr int kIoprioClassIdle = 3;
+  constexpr int kIoprioClassShift = 13;
+  syscall(SYS_ioprio_set, kIoprioWhoProcess, 0,
+          kIoprioClassIdle << kIoprioClassShift);
+#elif defined(__APPLE__)
+  setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE);
+#endif
+  setpriority(PRIO_PROCESS, 0, 10);
+#endif
+}
+
+// How often the control file is checked for changes
+constexpr std::chrono::seconds kControlInterval(1);
+
+// Applies the budget in a control file (--control) whenever the file
+// changes during a run. Each line is "<name> <value>": "max-rate" in MB/s,
+// "max-files" per second or "workers". Lines left out, or the whole file
+// when it is removed, fall back to the budget from the command line.
+class BudgetControl {
+ public:
+  ~BudgetControl() { stop(); }
+
+  // Watch a file, handing each budget read from it to apply
+  void start(const fs::path& path, const Budget& base,
+             std::function<void(const Budget&)> apply) {
+    stop();
+    path_ = path;
+    base_ = base;
+    apply_ = std::move(apply);
+    stopping_ = false;
+    watcher_ = std::thread([this] { watch_loop(); });
+  }
+
+  void stop() {
+    if (!watcher_.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    watcher_.join();
+  }
+
+ private:
+  void watch_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    do {
+      check();
+    } while (!wake_.wait_for(lock, kControlInterval,
+                             [this] { return stopping_; }));
+  }
+
+  // Re-read the file if it appeared, changed or went away since last time
+  void check() {
+    std::error_code error;
+    auto time = fs::last_write_time(path_, error);
+    if (error) {
+      if (seen_) {
+        seen_.reset();
+        apply(base_);
+      }
+      return;
+    }
+    if (seen_ == time) return;
+    seen_ = time;
+
+    Budget budget = base_;
+    std::ifstream in(path_);
+    std::string line;
+    for (int line_number = 1; std::getline(in, line); ++line_number) {
+      std::istringstream fields(line);
+      std::string name, value;
+      if (!(fields >> name) || name[0] == '#') continue;
+      fields >> value;
+      auto rate = parse_rate(value);
+      if (rate && name == "max-rate") {
+        budget.bytes_per_second = *rate * 1e6;
+      } else if (rate && name == "max-files") {
+        budget.files_per_second = *rate;
+      } else if (rate && name == "workers" && *rate == std::floor(*rate) &&
+                 *rate <= 4096) {
+        budget.workers = static_cast<unsigned>(*rate);
+      } else {
+        logger.log(LogLevel::kWarning, "control-invalid",
+                   {{"path", path_},
+                    {"line", static_cast<std::uint64_t>(line_number)}});
+      }
+    }
+    apply(budget);
+  }
+
+  void apply(const Budget& budget) {
+    apply_(budget);
+    logger.log(
+        LogLevel::kInfo, "budget",
+        {{"max_rate", static_cast<std::uint64_t>(budget.bytes_per_second)},
+         {"max_files", static_cast<std::uint64_t>(budget.files_per_second)},
+         {"workers", std::uint64_t{budget.workers}}});
+  }
+
+  fs::path path_;
+  Budget base_;
+  std::function<void(const Budget&)> apply_;
+  std::optional<fs::file_time_type> seen_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+  std::thread watcher_;
+};
+
+// Files that have been dealt with one way or another
+std::uint64_t files_done(const StatsSnapshot& snapshot) {
+  return snapshot[Counter::kTransferred] + snapshot[Counter::kUnchanged] +
+         snapshot[Counter::kSkipped] + snapshot[Counter::kFailed];
+}
+
+// Single console line, redrawn in place, showing files done, throughput
+// and the time left. Rates are smoothed over the last few seconds.
+class ProgressDisplay {
+ public:
+  ~ProgressDisplay() { stop(); }
+
+  // Start redrawing the progress of the run counted by stats
+  void start(const RunStats& stats) {
+    stop();
+    stopping_ = false;
+    running_ = true;
+    drawer_ = std::thread([this, &stats] { draw_loop(stats); });
+  }
+
+  // Stop redrawing and clear the line
+  void stop() {
+    if (!running_) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    drawer_.join();
+    running_ = false;
+    std::string blank(kProgressWidth, ' ');
+    std::fprintf(stdout, "\r%s\r", blank.c_str());
+    std::fflush(stdout);
+  }
+
+ private:
+  void draw_loop(const RunStats& stats) {
+    auto last_time = std::chrono::steady_clock::now();
+    std::uint64_t last_files = 0;
+    std::uint64_t last_bytes = 0;
+    double file_rate = -1;  // Negative until the first interval
+    double byte_rate = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!wake_.wait_for(lock, kProgressInterval,
+                           [this] { return stopping_; })) {
+      StatsSnapshot snapshot = stats.snapshot();
+      auto now = std::chrono::steady_clock::now();
+      double elapsed = std::chrono::duration<double>(now - last_time).count();
+      std::uint64_t done = files_done(snapshot);
+      std::uint64_t bytes = snapshot[Counter::kBytes];
+      // Exponential smoothing with a time constant of about four intervals
+      constexpr double kSmoothing = 0.25;
+      double new_file_rate = (done - last_files) / elapsed;
+      double new_byte_rate = (bytes - last_bytes) / elapsed;
+      if (file_rate < 0) {
+        file_rate = new_file_rate;
+        byte_rate = new_byte_rate;
+      } else {
+        file_rate += kSmoothing * (new_file_rate - file_rate);
+        byte_rate += kSmoothing * (new_byte_rate - byte_rate);
+      }
+      last_time = now;
+      last_files = done;
+      last_bytes = bytes;
+
+      std::uint64_t total = snapshot[Counter::kEnumerated];
+      std::string eta = "listing";
+      if (!stats.listing()) {
+        eta = file_rate > 0 ? "ETA " + format_duration((total - std::min(
+                                                            done, total)) /
+                                                       file_rate)
+                            : "ETA -";
+      }
+      char line[128];
+      std::snprintf(line, sizeof(line),
+                    "\r%llu/%llu files  %.0f files/s  %.1f MB/s  %s",
+                    static_cast<unsigned long long>(done),
+                    static_cast<unsigned long long>(total), file_rate,
+                    byte_rate / 1e6, eta.c_str());
+      std::string text = line;
+      text.resize(kProgressWidth + 1, ' ');
+      std::fwrite(text.data(), 1, text.size(), stdout);
+      std::fflush(stdout);
+    }
+  }
+
+  std::atomic<bool> running_{false};
+  std::mutex mutex_;  // Guards stopping_
+  std::condition_variable wake_;
+  bool stopping_ = false;
+  std::thread drawer_;
+};
+
+// Print the counters and stage latencies of a run and name the stage that
+// limited it. Listing runs on the calling thread, every other stage on the
+// workers, so each is measured against the time its threads had.
+void print_summary(const StatsSnapshot& snapshot, double seconds,
+                   unsigned worker_count) {
+  seconds = std::max(seconds, 1e-9);
+  auto count = [&](Counter counter) {
+    return static_cast<unsigned long long>(snapshot[counter]);
+  };
+  std::printf("\nFiles: %llu found, %llu transferred, %llu unchanged, "
+              "%llu skipped, %llu failed\n",
+              count(Counter::kEnumerated), count(Counter::kTransferred),
+              count(Counter::kUnchanged), count(Counter::kSkipped),
+              count(Counter::kFailed));
+  std::printf("Folders listed: %llu\n", count(Counter::kDirectories));
+  std::printf("Time: %s, %.0f files/s, %.1f MB copied (%.1f MB/s)\n",
+              format_duration(seconds).c_str(),
+              files_done(snapshot) / seconds,
+              snapshot[Counter::kBytes] / 1e6,
+              snapshot[Counter::kBytes] / 1e6 / seconds);
+  std::printf("System calls: %llu, errors: %llu\n\n",
+              count(Counter::kSyscalls), count(Counter::kErrors));
+
+  std::printf("%-10s %10s %10s %6s %10s %10s %10s\n", "stage", "calls",
+              "busy", "util", "mean", "p50 <", "p99 <");
+  double worst_utilization = 0;
+  std::size_t worst = kStageCount;
+  for (std::size_t s = 0; s < kStageCount; ++s) {
+    auto stage = static_cast<Stage>(s);
+    const StatsSnapshot::StageTotals& totals = snapshot[stage];
+    if (totals.calls == 0) continue;
+    double busy = totals.nanoseconds / 1e9;
+    unsigned threads = stage == Stage::kList ? 1 : worker_count;
+    double utilization = busy / (seconds * threads);
+    if (utilization > worst_utilization) {
+      worst_utilization = utilization;
+      worst = s;
+    }
+    std::printf("%-10s %10llu %9.2fs %5.0f%% %10s %10s %10s\n",
+                kStageNames[s], static_cast<unsigned long long>(totals.calls),
+                busy, utilization * 100,
+                format_latency(static_cast<double>(totals.nanoseconds) /
+                               totals.calls)
+                    .c_str(),
+                format_latency(snapshot.quantile(stage, 0.5)).c_str(),
+                format_latency(snapshot.quantile(stage, 0.99)).c_str());
+  }
+  if (worst == kStageCount) return;
+  if (worst_utilization < 0.5) {
+    // Nothing saturated; the time went to startup, the index or waiting
+    std::printf("\nNo stage was busy half of the time; the busiest was %s "
+                "(%.0f%%).\n",
+                kStageNames[worst], worst_utilization * 100);
+    return;
+  }
+
+  const char* advice = "";
+  switch (static_cast<Stage>(worst)) {
+    case Stage::kList:
+      advice = "listing runs on one thread, so more workers will not help; "
+               "a faster source disk will";
+      break;
+    case Stage::kHash:
+    case Stage::kHeaders:
+      advice = "reading sources; add workers on an SSD, or use a faster "
+               "source disk";
+      break;
+    case Stage::kClassify:
+      advice = "CPU-bound; add workers";
+      break;
+    case Stage::kPlace:
+      advice = "collision handling; fewer workers contend less on name locks";
+      break;
+    case Stage::kTransfer:
+      advice = "try --mode hardlink or reflink, or a faster destination disk";
+      break;
+    case Stage::kCount:
+      break;
+  }
+  std::printf("\nBottleneck: %s (%.0f%% busy); %s.\n", kStageNames[worst],
+              worst_utilization * 100, advice);
+}
+
+Rules::Rules(std::shared_ptr<const CompiledRules> compiled)
+    : compiled_(std::move(compiled)) {}
+
+Rules Rules::built_in() {
+  return Rules(std::make_shared<const CompiledRules>(built_in_rules()));
+}
+
+Rules Rules::load(const fs::path& rules_file) {
+  return Rules(std::make_shared<const CompiledRules>(load_rules(rules_file)));
+}
+
+std::size_t Rules::size() const { return compiled_->category_paths.size(); }
+
+Tags::Tags() = default;
+
+Tags Tags::load(const fs::path& export_file, const Rules& rules) {
+  Tags tags;
+  tags.table_ = std::make_shared<const TagTable>(
+      TagTable::load(export_file, *rules.compiled_));
+  return tags;
+}
+
+std::size_t Tags::size() const { return table_ ? table_->size() : 0; }
+
+// Everything an organizer owns. The rules, tags and options are kept here
+// for the runner, which refers to them, and the control file thread is
+// stopped before the runner it budgets goes away.
+struct Organizer::Impl {
+  Impl(std::shared_ptr<const CompiledRules> compiled_rules,
+       std::shared_ptr<const TagTable> tag_table,
+       const OrganizeOptions& organize_options, Executor* executor)
+      : rules(std::move(compiled_rules)),
+        tags(std::move(tag_table)),
+        options(organize_options),
+        runner(*rules, options, tags.get(), executor) {}
+
+  std::shared_ptr<const CompiledRules> rules;
+  std::shared_ptr<const TagTable> tags;  // nullptr without a tag export
+  OrganizeOptions options;
+  JobRunner runner;
+  ProgressDisplay progress;
+  BudgetControl control;
+};
+
+Organizer::Organizer(Rules rules, const OrganizeOptions& options, Tags tags,
+                     Executor* executor)
+    : impl_(std::make_unique<Impl>(std::move(rules.compiled_),
+                                   std::move(tags.table_), options,
+                                   executor)) {}
+
+Organizer::~Organizer() = default;
+
+void Organizer::organize(const Job& job) { impl_->runner.run(job); }
+
+void Organizer::organize(const Job& job, std::span<const fs::path> files) {
+  impl_->runner.run_paths(job, files);
+}
+
+std::size_t Organizer::plan(const Job& job, const fs::path& plan_file) {
+  MovePlan plan;
+  impl_->runner.run(job, &plan);
+  plan.save(plan_file, job.destination, impl_->options.transfer_mode);
+  return plan.size();
+}
+
+std::size_t Organizer::apply(const fs::path& plan_file) {
+  LoadedPlan plan = load_plan(plan_file);
+  impl_->runner.apply(plan);
+  return plan.transfers.size();
+}
+
+void Organizer::watch(std::span<const Job> jobs, std::stop_token stop,
+                      std::function<void(std::uint64_t)> on_batch) {
+  impl_->runner.watch(jobs, stop, on_batch);
+}
+
+void Organizer::finish() { impl_->runner.finish(); }
+
+void Organizer::set_budget(const Budget& budget) {
+  impl_->runner.set_budget(budget);
+}
+
+void Organizer::follow_control_file(const fs::path& control_file,
+                                    const Budget& base) {
+  impl_->control.start(control_file, base, [this](const Budget& budget) {
+    impl_->runner.set_budget(budget);
+  });
+}
+
+RunReport Organizer::report() const {
+  StatsSnapshot snapshot = impl_->runner.stats().snapshot();
+  RunReport report;
+  report.found = snapshot[Counter::kEnumerated];
+  report.transferred = snapshot[Counter::kTransferred];
+  report.unchanged = snapshot[Counter::kUnchanged];
+  report.skipped = snapshot[Counter::kSkipped];
+  report.failed = snapshot[Counter::kFailed];
+  report.bytes = snapshot[Counter::kBytes];
+  report.errors = snapshot[Counter::kErrors];
+  return report;
+}
+
+void Organizer::start_progress() {
+  impl_->progress.start(impl_->runner.stats());
+}
+
+void Organizer::stop_progress() { impl_->progress.stop(); }
+
+void Organizer::print_summary(double seconds) const {
+  splice_organizer::print_summary(impl_->runner.stats().snapshot(), seconds,
+                                  resolved_worker_count(impl_->options));
+}
+
+bool start_logging(LogLevel level, LogFormat format, const std::string& path) {
+  return logger.start(level, format, path);
+}
+
+void stop_logging() { logger.stop(); }
+
+}  // namespace splice_organizer
@@ -0,0 +1,320 @@
+// -----------------------------------------------------------------------------
+// Splice File Organizer library
+// -----------------------------------------------------------------------------
+// Description:
+// The organizer behind splice_file_organizer, for programs that embed it. An
+// Organizer owns everything a run touches: its rules and tags, statistics,
+// budgets, copy pipeline and the state of every destination it writes to.
+// Nothing is kept in globals apart from the process-wide log, so any number of
+// organizers can work on different libraries at the same time in one
+// process, each on its own worker pool or all on one shared Executor.
+//
+//   using namespace splice_organizer;
+//   Organizer organizer(Rules::load("splice_rules.txt"), {});
+//   organizer.organize({"Splice/Samples", "Sorted"});
+//   organizer.finish();
+//
+// See splice_file_organizer.cpp for what a run does and how.
+//
+// License: MIT, see splice_file_organizer.cpp.
+// -----------------------------------------------------------------------------
+
+#pragma once
+#ifndef GUARD_SPLICE_ORGANIZER_H
+#define GUARD_SPLICE_ORGANIZER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+
+namespace splice_organizer {
+
+namespace fs = std::filesystem;
+
+// How a file is placed at its destination
+enum class TransferMode { kCopy, kMove, kHardlink, kReflink };
+
+// Names of the transfer modes in plans and on the command line, indexed by
+// TransferMode
+constexpr std::array<const char*, 4> kTransferModeNames = {
+    "copy", "move", "hardlink", "reflink"};
+
+// What to do with files whose content matches a file already placed
+enum class DedupMode { kOff, kSkip, kHardlink };
+
+// Names of the duplicate modes on the command line, indexed by DedupMode
+constexpr std::array<const char*, 3> kDedupModeNames = {"keep", "skip",
+                                                        "link"};
+
+// Order files are handed to the workers in: as listed, or after the whole
+// tree is listed sorted by where they sit on disk, optionally grouped by the
+// category folder their name selects first
+enum class WorkOrder { kListing, kDisk, kFolder };
+
+// Names of the work orders on the command line, indexed by WorkOrder
+constexpr std::array<const char*, 3> kWorkOrderNames = {"listing", "disk",
+                                                        "folder"};
+
+// How a destination folder that has grown to OrganizeOptions::shard_size
+// files is split: not at all, or into subfolders named after the pack a
+// sample came from, the first letter or digit of its name, or two hex digits
+// of a hash of its name
+enum class ShardMode { kOff, kPack, kLetter, kHash };
+
+// Names of the shard modes on the command line, indexed by ShardMode
+constexpr std::array<const char*, 4> kShardModeNames = {"off", "pack",
+                                                        "letter", "hash"};
+
+// Importance of a log message. A logger writes the messages up to its level.
+enum class LogLevel { kError, kWarning, kInfo, kDebug };
+
+// Names of the log levels, indexed by LogLevel
+constexpr std::array<const char*, 4> kLogLevelNames = {"error", "warning",
+                                                       "info", "debug"};
+
+// How log messages are written: "key=value" text lines or NDJSON
+enum class LogFormat { kText, kJson };
+
+// Names of the log formats, indexed by LogFormat
+constexpr std::array<const char*, 2> kLogFormatNames = {"text", "json"};
+
+// Index of a name in a table of option values
+template <std::size_t N>
+std::optional<std::size_t> find_name(const std::array<const char*, N>& names,
+                                     std::string_view name) {
+  for (std::size_t i = 0; i < N; ++i) {
+    if (name == names[i]) return i;
+  }
+  return std::nullopt;
+}
+
+// Settings shared by every file in a run
+struct OrganizeOptions {
+  unsigned worker_count = 0;  // 0 selects default_worker_count()
+  TransferMode transfer_mode = TransferMode::kCopy;
+  bool use_index = true;  // Skip files unchanged since the last run
+  DedupMode dedup = DedupMode::kOff;
+  bool classify_content = false;  // Sort unmatched files by their audio
+  bool check_headers = false;     // Skip files with broken audio headers
+  bool tempo_folders = false;     // Sort loops into "<n>bpm" by their tempo
+  std::size_t copy_chunk_size = 0;  // Bytes per copy call; 0 picks by size
+  WorkOrder work_order = WorkOrder::kListing;
+  bool pipeline = false;  // Copy through one reader and one writer thread
+  bool catalog = false;   // Start a catalog in destinations without one
+  ShardMode shard = ShardMode::kOff;
+  std::size_t shard_size = 10000;  // Files per folder before it is sharded
+};
+
+// Budgets a run may use; a rate of 0 is unlimited
+struct Budget {
+  double bytes_per_second = 0;
+  double files_per_second = 0;
+  unsigned workers = 0;  // 0 runs every worker
+};
+
+// A source folder to organize into a destination folder
+struct Job {
+  fs::path source;
+  fs::path destination;
+};
+
+// Counts of what an organizer did with the files it was given
+struct RunReport {
+  std::uint64_t found = 0;        // Audio files in the sources
+  std::uint64_t transferred = 0;  // Placed, or planned in a plan
+  std::uint64_t unchanged = 0;    // Skipped because the index had them
+  std::uint64_t skipped = 0;      // Unreadable files and skipped duplicates
+  std::uint64_t failed = 0;       // Could not be placed
+  std::uint64_t bytes = 0;        // Copied; links, clones and moves copy none
+  std::uint64_t errors = 0;       // Messages logged as errors
+};
+
+// Catalog of a destination, kept in its root when OrganizeOptions::catalog
+// is set and laid out so other programs can map it and use it in place.
+// Fields are little-endian. The header is followed by the folders sorted by
+// path, the entries sorted by folder and then by name, the std::uint32_t
+// numbers of the entries sorted by name hash, and the UTF-8 strings the
+// folders and entries point into.
+constexpr const char* kCatalogFileName = ".splice_catalog";
+constexpr std::uint32_t kCatalogMagic = 0x434C5053;  // "SPLC"
+constexpr std::uint32_t kCatalogVersion = 1;
+
+struct CatalogHeader {
+  std::uint32_t magic;
+  std::uint32_t version;
+  std::uint64_t folder_count;
+  std::uint64_t entry_count;
+  std::uint64_t strings_size;
+};
+
+// A folder, relative to the destination root with '/' separators, and the
+// run of entries in it
+struct CatalogFolder {
+  std::uint32_t path_offset;
+  std::uint32_t path_length;
+  std::uint32_t first_entry;
+  std::uint32_t entry_count;
+};
+
+// A sample in a folder
+struct CatalogEntry {
+  std::uint64_t size;
+  std::int64_t mtime;         // Of the source file, in file clock ticks
+  std::uint64_t name_hash;    // FNV-1a of the name with ASCII lowercased
+  std::uint32_t name_offset;
+  std::uint32_t name_length;
+  std::uint32_t folder;       // Index of its folder
+  std::uint32_t duration_ms;  // 0 when the headers do not give one
+};
+
+// Runs the tasks of organizers. An executor may run them on any thread and
+// in any order, may block while it is busy, and may be shared by several
+// organizers. Tasks never throw.
+class Executor {
+ public:
+  virtual ~Executor() = default;
+  virtual void execute(std::function<void()> task) = 0;
+};
+
+struct CompiledRules;
+class TagTable;
+
+// Rules file looked up in the working directory at startup
+constexpr const char* kDefaultRulesFile = "splice_rules.txt";
+
+// Compiled category rules. Copies share one compiled matcher, so any number
+// of organizers can use the same rules.
+class Rules {
+ public:
+  // The built-in categories
+  static Rules built_in();
+
+  // Rules read from a rules file, through its compiled cache when that is
+  // current. Throws std::runtime_error or fs::filesystem_error.
+  static Rules load(const fs::path& rules_file);
+
+  // Number of categories
+  std::size_t size() const;
+
+ private:
+  friend class Organizer;
+  friend class Tags;
+  explicit Rules(std::shared_ptr<const CompiledRules> compiled);
+
+  std::shared_ptr<const CompiledRules> compiled_;
+};
+
+// Tags of a CSV or JSON export of the Splice library, matched against the
+// categories of the rules they were loaded with. Copies share one table.
+class Tags {
+ public:
+  // No tags; files are classified by name only
+  Tags();
+
+  // Throws std::runtime_error or fs::filesystem_error
+  static Tags load(const fs::path& export_file, const Rules& rules);
+
+  // Number of samples tagged
+  std::size_t size() const;
+
+ private:
+  friend class Organizer;
+
+  std::shared_ptr<const TagTable> table_;
+};
+
+// Organizes sample folders into destination folders. Each destination is
+// listed and its index loaded once, however many jobs write to it; finish()
+// saves every index. An organizer runs one call at a time, but separate
+// organizers are independent and may run at the same time.
+class Organizer {
+ public:
+  // Run with rules and tags on executor, or on a worker pool of the
+  // organizer's own if it is null. Tags must have been loaded with the same
+  // rules.
+  Organizer(Rules rules, const OrganizeOptions& options, Tags tags = {},
+            Executor* executor = nullptr);
+  ~Organizer();
+
+  Organizer(const Organizer&) = delete;
+  Organizer& operator=(const Organizer&) = delete;
+
+  // Organize the source folder of a job. Throws fs::filesystem_error if a
+  // folder cannot be created or listed.
+  void organize(const Job& job);
+
+  // Organize the given files, found under the source folder of a job.
+  // Paths that are not audio files are ignored.
+  void organize(const Job& job, std::span<const fs::path> files);
+
+  // Decide where every file of a job would go and write that to a plan
+  // file, reading but changing nothing. Returns the number of transfers
+  // planned. Throws fs::filesystem_error if the plan cannot be written.
+  std::size_t plan(const Job& job, const fs::path& plan_file);
+
+  // Carry out a plan written by plan(). Returns the number of transfers in
+  // it. Throws std::runtime_error if the plan cannot be read.
+  std::size_t apply(const fs::path& plan_file);
+
+  // Organize new and changed files under the sources of jobs as they
+  // appear, until stop is requested. on_batch, if set, is told how many
+  // files each batch of changes placed. Throws fs::filesystem_error if the
+  // sources cannot be watched.
+  void watch(std::span<const Job> jobs, std::stop_token stop = {},
+             std::function<void(std::uint64_t)> on_batch = {});
+
+  // Save the index and catalog of every destination written to. Later calls
+  // carry on from the saved files.
+  void finish();
+
+  // Limit the transfers and workers from now on, even during a call
+  void set_budget(const Budget& budget);
+
+  // Re-read a budget from a control file whenever it changes, falling back
+  // to base for what it leaves out
+  void follow_control_file(const fs::path& control_file, const Budget& base);
+
+  // What happened to the files so far
+  RunReport report() const;
+
+  // Show a progress line on stdout while calls run, or stop showing it
+  void start_progress();
+  void stop_progress();
+
+  // Print the counts and stage latencies of everything done so far, taking
+  // seconds, and name the stage that limited it
+  void print_summary(double seconds) const;
+
+ private:
+  struct Impl;
+  std::unique_ptr<Impl> impl_;
+};
+
+// Number of copy workers used when none is requested
+unsigned default_worker_count();
+
+// Parse a non-negative number
+std::optional<double> parse_rate(std::string_view text);
+
+// Lower the I/O and CPU priority of the process and of the threads it starts
+// from now on, so it only gets the disk and processor when others leave them
+// free
+void enter_background_mode();
+
+// Send the process-wide log to a file in the background, or to stderr if
+// the path is empty, and stop it again. Until then messages are written to
+// stderr as they come. Returns false if the file cannot be opened.
+bool start_logging(LogLevel level, LogFormat format, const std::string& path);
+void stop_logging();
+
+}  // namespace splice_organizer
+
+#endif  // !GUARD_SPLICE_ORGANIZER_H